@@ -0,0 +1,23 @@
+# Firmware size report per build variant, fails the build when the image does not fit the OTA app slot
+Import("env")
+import os
+
+def app_slot_size():
+    with open(os.path.join(env.subst("$PROJECT_DIR"), env.GetProjectOption("board_build.partitions"))) as f:
+        for line in f:
+            fields = [field.strip() for field in line.split("#")[0].split(",")]
+            if len(fields) >= 5 and fields[1] == "app":
+                return int(fields[4], 0)
+    return 0
+
+def size_report(source, target, env):
+    size = os.path.getsize(target[0].get_abspath())
+    slot = app_slot_size()
+    formats = [flag[len("-DENABLE_"):] for flag in env.subst("$BUILD_FLAGS").split() if flag.startswith("-DENABLE_")]
+    print("Size report [%s]: %d bytes / %d bytes OTA slot (%.1f%%)%s" % (env.subst("$PIOENV"), size, slot,
+          100.0 * size / slot if slot else 0, " - formats: " + (",".join(formats) if formats else "default")))
+    if slot and size > slot:
+        print("Size report [%s]: firmware does not fit the OTA slot" % env.subst("$PIOENV"))
+        env.Exit(1)
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.bin", size_report)
@@ -12,15 +12,18 @@
 
 //#define ENABLE_DEBUG
 #define ENABLE_UPDATE
+#ifndef CUSTOM_FORMATS    // Build variants pick their own: -DCUSTOM_FORMATS -DENABLE_MP3 ...
 #define ENABLE_MP3
 //#define ENABLE_FLAC
-//#define ENABLE_WAV    // SPIFFS too slow
+//#define ENABLE_WAV    // SPIFFS too slow below 240Mhz: the per bank benchmark raises the clock
 //#define ENABLE_MIDI   // https://github.com/earlephilhower/ESP8266Audio/issues/240 + printf in midi + tinysoundfont
-//#define ENABLE_MOD    // Poor quality on SPIFFS
-//#define ENABLE_AAC
+//#define ENABLE_MOD    // Poor quality on SPIFFS below 240Mhz: the per bank benchmark raises the clock
+//#define ENABLE_AAC    // Code size: not verified against the 0x140000 app partition
+#endif
 
 #include <Arduino.h>
-#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
 #include <soc/soc.h>           //disable brownout problems
 #include <soc/rtc_cntl_reg.h>  //disable brownout problems
 #include <knx.h>
@@ -48,13 +51,21 @@
   #include <AudioGeneratorMOD.h>
 #endif
 #ifdef ENABLE_MIDI
-  #include <AudioGeneratorMIDI.h>
+  #include <libtinysoundfont/tsf.h>
 #endif
 #include <AudioOutputI2S.h>
+#include <rom/crc.h>
 #ifdef ENABLE_UPDATE
   #include <Update.h>
+  #include <esp_ota_ops.h>
+  #include <mbedtls/sha256.h>
+  #include <rom/miniz.h>
 #endif
-#include <WiFiManager.h>
+#include <esp_wifi.h>
+#include <lwip/dns.h>
+#include <lwip/sockets.h>
+#include <errno.h>
+#include <DNSServer.h>
 #include <Arduino.h>
 #include <WebServer.h>
 
@@ -77,6 +88,17 @@ hw_timer_t *watchdog = NULL;
 #define PIN_TPUART_SAVE   NC   // Unused
 #define PIN_TPUART_RESET  NC   // Unused
 
+#define IDLE_CPU_FREQ     80                // MHz
+#define PLAY_CPU_FREQ     160               // MHz, while decoding a bank not benchmarked
+#define MAX_CPU_FREQ      240               // MHz
+#define BENCH_TIME        400               // ms of decoding per frequency
+#define BENCH_MARGIN      120               // % of real time required
+#define BENCH_SLICE       20                // ms of decoding per loop, keeps KNX and HTTP served
+#define IDLE_GRACE        ( 2 * 1000 )      // Stay awake after a wake up
+#define IDLE_SLEEP_MAX    ( 1000 * 1000 )   // us
+#define IDLE_SLEEP_WIFI   ( 100 * 1000 )    // us with the station connected, about a beacon interval: the AP buffers meanwhile
+#define IDLE_HTTP         ( 10 * 1000 )     // ms after the last HTTP request before sleeping with the station connected
+
 #define PIN_MUTE          23
 #define PIN_DAC           0  //PIN 25 -> https://github.com/earlephilhower/ESP8266Audio/issues/95
 
@@ -88,357 +110,2345 @@ hw_timer_t *watchdog = NULL;
 # define SOUNDFONT_PATH    "/soundfont" SOUNDFONT_SUFFIX
 #endif
 
-class NullStream : public Stream
-{
-public:
-    virtual int available() { return 0; }
-    virtual int read() { return -1; }
-    virtual int peek() { return -1; }
-    virtual void flush() {}
-    virtual size_t write(uint8_t) { return 0; }
-} nullDevice;
-
-
-static const uint16_t outputPins[] = { 18, 19, 21, 22 };
-enum { outputCount = sizeof(outputPins)/sizeof(outputPins[0]) };
-
+// Audio format registry, only enabled formats are compiled in
+//   FORMAT(id, extension, mime, cpu MHz): decoder built by create<id>()
+//   MAGIC(id, offset, bytes): file signature, '?' matches any byte
+#ifdef ENABLE_AAC
+static AudioGenerator* createAAC(AudioFileSource*&) { return new AudioGeneratorAAC(); }
+# define FORMATS_AAC(FORMAT, MAGIC)   FORMAT(AAC, ".aac", "audio/aac", PLAY_CPU_FREQ) MAGIC(AAC, 0, "\xFF\xF1") MAGIC(AAC, 0, "\xFF\xF9")
+#else
+# define FORMATS_AAC(FORMAT, MAGIC)
+#endif
+#ifdef ENABLE_MP3
+static AudioGenerator* createMP3(AudioFileSource*&) { return new AudioGeneratorMP3(); }
+# define FORMATS_MP3(FORMAT, MAGIC)   FORMAT(MP3, ".mp3", "audio/mpeg", PLAY_CPU_FREQ) MAGIC(MP3, 0, "\xFF\xFB") MAGIC(MP3, 0, "ID3")
+#else
+# define FORMATS_MP3(FORMAT, MAGIC)
+#endif
+#ifdef ENABLE_MIDI
+#define SOUNDFONT_CACHE_BLOCK   1024
+#define SOUNDFONT_CACHE_BLOCKS  16      // Direct mapped
+#define MIDI_SAMPLE_RATE        22050   // Synthesis cost scales with it
+#define MIDI_MAX_VOICES         24      // Allocated once with the synthesizer, no heap use while playing. Held notes
+                                        // beyond it release the oldest.
+#define MIDI_MAXTRACKS          16
+#define MIDI_RENDER             64      // Samples rendered at once, events are placed to this resolution
+#define MIDI_TAIL               1000    // ms rendered after the last event for the releases
 
-struct Output
+// Soundfont opened and parsed once and kept across plays: one TinySoundFont instance holds the presets,
+// instruments and voices, reset between plays. Sample data is read through a block cache.
+class AudioFileSourceSoundfont : public AudioFileSource
 {
-    void init(int baseAddr, uint16_t baseGO, uint16_t pinNb)
+public:
+    bool load()
     {
-        m_params.autoOffTimer = (knx.paramInt(baseAddr) & 0xFFFF) * 100;    // issue with first short in eeprom (maybe overwritten?) 
-        m_GO.onOff = baseGO++;
-        knx.getGroupObject(m_GO.onOff).dataPointType(DPT_Switch);
-        m_GO.status = baseGO++;
-        knx.getGroupObject(m_GO.status).dataPointType(DPT_Switch);
-        m_GO.block = baseGO++;
-        knx.getGroupObject(m_GO.block).dataPointType(DPT_Switch);
-
-        // Callbacks
-        knx.getGroupObject(m_GO.onOff).callback([this](GroupObject& go) {   this->value(go.value());    });
-
-        m_pin = pinNb;
-        pinMode(m_pin, OUTPUT);
-        digitalWrite(m_pin, LOW);
+        if (m_file) return true;
+        m_file = SPIFFS.open(SOUNDFONT_PATH, FILE_READ);
+        if (!m_file) return false;
+        m_size = m_file.size();
+        m_blocks = (uint8_t*)malloc(SOUNDFONT_CACHE_BLOCK * SOUNDFONT_CACHE_BLOCKS);
+        for (uint32_t& tag : m_tags) tag = UINT32_MAX;
+        m_pos = 0;
+        return true;
     }
 
-    void value(bool value) {
-        if (knx.getGroupObject(m_GO.block).value())
-            return;
-        if (value && m_params.autoOffTimer > 0) {
-            m_timer = millis();
-        }
-        else {
-            m_timer = 0;
-        }
-        digitalWrite(m_pin, value?HIGH:LOW);
-        knx.getGroupObject(m_GO.status).value(value);
-    }
-
-    uint32_t autoOffTimer() const { return m_params.autoOffTimer; }
-    bool value() const { return knx.getGroupObject(m_GO.status).value(); }
-
-    void loop(uint32_t time)
+    // Parsed at boot and once idle after a replacement, NULL without a usable soundfont
+    tsf* synth()
     {
-        // Manage MONO Stable timer
-        if (m_timer) {
-            if (time - m_params.autoOffTimer >= m_timer) {
-                digitalWrite(m_pin, LOW);
-                knx.getGroupObject(m_GO.status).value(false);
-                m_timer = 0;
+        m_stale = false;
+        if (m_synth == NULL && load()) {
+            m_stream.data = this;
+            m_stream.read = streamRead;
+            m_stream.skip = streamSkip;
+            m_stream.tell = streamTell;
+            m_stream.seek = streamSeek;
+            m_stream.close = streamClose;
+            m_stream.size = streamSize;
+            m_pos = 0;
+            m_synth = tsf_load(&m_stream);
+            if (m_synth) {
+                tsf_set_output(m_synth, TSF_MONO, MIDI_SAMPLE_RATE, -10);
+                if (!tsf_set_max_voices(m_synth, MIDI_MAX_VOICES)) {
+                    tsf_close(m_synth);
+                    m_synth = NULL;
+                    return NULL;
+                }
+                ++m_parses;
             }
         }
+        return m_synth;
     }
-  private:
-    uint16_t m_pin;
-    uint32_t m_timer = 0;
-    struct {
-      uint32_t autoOffTimer = 0;
-    } m_params;
-    struct {
-      uint16_t onOff;
-      uint16_t status;
-      uint16_t block;
-    } m_GO;
-  public:
-    enum { NBGO = sizeof(m_GO)/sizeof(uint16_t), SIZEPARAMS = sizeof(m_params) };    
-} output[outputCount];
 
-struct Player
-{
-    enum FORMAT : uint8_t { UNKNOWN = (uint8_t)-1, NO_FILE = 0, MP3, AAC, FLAC, WAV, MOD, MIDI };
-    void init(uint16_t pinNb, uint16_t mutePinNb)
+    // Before the soundfont is replaced or removed
+    void unload()
     {
-        m_mutePin = mutePinNb;
-        pinMode(m_mutePin, OUTPUT);
-        digitalWrite(m_mutePin, HIGH);
-        m_out.SetOutputModeMono(true);
-
-        memset(&m_content, 0, sizeof(m_content));
-        m_content.volume = 100;
-        File f = SPIFFS.open(META_PATH, FILE_READ);
-        if (f.available()) {
-            f.read((uint8_t*)&m_content, sizeof(m_content));
-        }
-        f.close();
+        if (m_synth) tsf_close(m_synth);
+        m_synth = NULL;
+        m_stale = true;
+        m_file.close();
+        free(m_blocks);
+        m_blocks = NULL;
+        m_size = m_pos = 0;
     }
 
-    void initKNX(int baseAddr, uint16_t baseGO)
+    virtual uint32_t read(void* data, uint32_t len)
     {
-        m_GO.playStop = baseGO++;
-        knx.getGroupObject(m_GO.playStop).dataPointType(DPT_Value_1_Ucount);
-        m_GO.pauseResume = baseGO++;
-        knx.getGroupObject(m_GO.pauseResume).dataPointType(DPT_Switch);
-        m_GO.volume = baseGO++;
-        knx.getGroupObject(m_GO.volume).dataPointType(DPT_Scaling);
-        m_GO.block = baseGO++;
-        knx.getGroupObject(m_GO.block).dataPointType(DPT_Switch);
-        m_GO.playing = baseGO++;
-        knx.getGroupObject(m_GO.playing).dataPointType(DPT_Switch);
-        m_GO.playingChannel = baseGO++;
-        knx.getGroupObject(m_GO.playingChannel).dataPointType(DPT_Value_1_Ucount);
-        for (int i = 0; i < NBBANKS; ++i) {
-            m_GO.play[i] = baseGO++;
-            knx.getGroupObject(m_GO.play[i]).dataPointType(DPT_Switch);
-        }
-
-        // Callbacks
-        knx.getGroupObject(m_GO.playStop).callback([this](GroupObject& go) {
-            uint32_t value = (uint32_t)go.value();
-            if (value) {
-                if(knx.getGroupObject(m_GO.block).value())
-                  return;
-                play(go.value());
+        uint8_t* out = (uint8_t*)data;
+        len = m_pos < m_size ? MIN(len, m_size - m_pos) : 0;
+        uint32_t done = 0;
+        while (done < len) {
+            uint32_t n;
+            if (m_blocks) {
+                uint32_t block = m_pos / SOUNDFONT_CACHE_BLOCK;
+                uint8_t* cached = m_blocks + (block % SOUNDFONT_CACHE_BLOCKS) * SOUNDFONT_CACHE_BLOCK;
+                if (m_tags[block % SOUNDFONT_CACHE_BLOCKS] != block) {
+                    m_file.seek(block * SOUNDFONT_CACHE_BLOCK);
+                    m_file.read(cached, SOUNDFONT_CACHE_BLOCK);
+                    m_tags[block % SOUNDFONT_CACHE_BLOCKS] = block;
+                    ++m_misses;
+                }
+                uint32_t offset = m_pos % SOUNDFONT_CACHE_BLOCK;
+                n = MIN(len - done, SOUNDFONT_CACHE_BLOCK - offset);
+                memcpy(out + done, cached + offset, n);
             }
             else {
-                m_action = STOP;
+                m_file.seek(m_pos);
+                n = m_file.read(out + done, len - done);
+                if (n == 0) break;
             }
-          });
-        knx.getGroupObject(m_GO.pauseResume).callback([this](GroupObject& go) {
-            bool value = go.value();
-            if (!value) {
-                if(knx.getGroupObject(m_GO.block).value())
-                    return;
-                m_action = RESUME;
-            }
-            else {
-                m_action = PAUSE;
-            }
-          });
-        knx.getGroupObject(m_GO.volume).callback([this](GroupObject& go) {  setVolume(go.value());  });
-        for (int i = 0; i < NBBANKS; ++i) {
-            knx.getGroupObject(m_GO.play[i]).callback([this,i](GroupObject& go) {
-                if (go.value()) {
-                    play(i + 1);
-                }
-                else {
-                    m_action = STOP;
-                }
-              });
+            done += n;
+            m_pos += n;
         }
+        return done;
     }
-
-    void play(int bank) {
-        if (pathFromChannel(bank)) {
-            m_action = PLAY;
-            m_playingChannel = bank;
-        }
+    virtual bool seek(int32_t pos, int dir)
+    {
+        int64_t target = dir == SEEK_SET ? pos : dir == SEEK_CUR ? (int64_t)m_pos + pos : (int64_t)m_size + pos;
+        if (target < 0 || target > m_size) return false;
+        m_pos = target;
+        return true;
     }
+    virtual bool close() { m_pos = 0; return true; }     // Kept open for the next play
+    virtual bool isOpen() { return m_file; }
+    virtual uint32_t getSize() { return m_size; }
+    virtual uint32_t getPos() { return m_pos; }
 
-    void pauseResume() {
-        if (m_player) m_action = m_action==PAUSE?RESUME:PAUSE;
+    // While nothing plays: the new soundfont is parsed before the next MIDI play instead of delaying it
+    void idle()
+    {
+        if (m_stale) synth();
     }
 
-    void stop() {
-        if (m_player) m_action = STOP;
-    }
-    int playingBank() const {
-        return m_playingChannel;
-    }
+    uint32_t parses() const { return m_parses; }
+    uint32_t misses() const { return m_misses; }
+private:
+    static int streamRead(void* data, void* ptr, unsigned int size) { return ((AudioFileSourceSoundfont*)data)->read(ptr, size); }
+    static int streamSkip(void* data, unsigned int count) { return ((AudioFileSourceSoundfont*)data)->seek(count, SEEK_CUR); }
+    static int streamTell(void* data) { return ((AudioFileSourceSoundfont*)data)->m_pos; }
+    static int streamSeek(void* data, unsigned int pos) { return ((AudioFileSourceSoundfont*)data)->seek(pos, SEEK_SET); }
+    static int streamClose(void*) { return 1; }
+    static int streamSize(void* data) { return ((AudioFileSourceSoundfont*)data)->m_size; }
 
-    FORMAT format(int bank) const {
-        if (pathFromChannel(bank)) {
-            return m_content.bank[bank - 1].format;
+    File m_file;
+    tsf* m_synth = NULL;
+    struct tsf_stream m_stream;
+    uint8_t* m_blocks = NULL;
+    uint32_t m_tags[SOUNDFONT_CACHE_BLOCKS];
+    uint32_t m_size = 0, m_pos = 0, m_misses = 0, m_parses = 0;
+    bool m_stale = false;
+} soundFont;
+
+// Standard MIDI file (format 0 or 1) played on the resident synthesizer: notes, program changes and tempo,
+// other events are skipped. Tracks are read through small buffers, the file is never held in RAM.
+class AudioGeneratorSMF : public AudioGenerator
+{
+public:
+    AudioGeneratorSMF(tsf* synth) : m_synth(synth) {}
+    virtual ~AudioGeneratorSMF() { stop(); }
+
+    virtual bool begin(AudioFileSource* source, AudioOutput* out)
+    {
+        if (source == NULL || out == NULL || m_synth == NULL) return false;
+        file = source;
+        output = out;
+        uint8_t header[14];
+        if (!file->seek(0, SEEK_SET) || file->read(header, sizeof(header)) != sizeof(header) || memcmp(header, "MThd", 4) != 0)
+            return false;
+        m_division = (header[12] << 8) | header[13];
+        if (m_division == 0 || (m_division & 0x8000)) return false;    // SMPTE time not supported
+        uint32_t pos = 8 + be32(header + 4);
+        m_tracks = 0;
+        uint8_t chunk[8];
+        while (m_tracks < MIDI_MAXTRACKS && file->seek(pos, SEEK_SET) && file->read(chunk, sizeof(chunk)) == sizeof(chunk)) {
+            uint32_t size = be32(chunk + 4);
+            if (memcmp(chunk, "MTrk", 4) == 0) {
+                Track& t = m_track[m_tracks++];
+                t.pos = pos + sizeof(chunk);
+                t.end = MIN(t.pos + size, file->getSize());
+                t.fill = t.next = 0;
+                t.status = 0;
+                t.tick = 0;
+                t.done = false;
+                t.tick = delta(t);
+            }
+            pos += sizeof(chunk) + size;
         }
-        return NO_FILE;
+        if (m_tracks == 0) return false;
+        tsf_reset(m_synth);
+        m_voices = 0;
+        for (uint8_t c = 0; c < 16; ++c) {
+            m_program[c] = 0;
+            m_preset[c] = preset(c);
+        }
+        m_tempo = 500000;
+        m_tempoTick = 0;
+        m_tempoSample = m_sample = 0;
+        m_rendered = m_index = 0;
+        m_tail = 0;
+        output->SetRate(MIDI_SAMPLE_RATE);
+        output->SetBitsPerSample(16);
+        output->SetChannels(2);
+        if (!output->begin()) return false;
+        running = true;
+        return true;
     }
 
-    uint8_t volume() const { return m_content.volume; }
-    void setVolume(uint8_t value)
+    virtual bool loop()
     {
-        if (knx.configured())
-            knx.getGroupObject(m_GO.volume).value(value);
-        _setVolume(value);
+        if (!running) return false;
+        while (true) {
+            while (m_index < m_rendered) {
+                lastSample[0] = lastSample[1] = m_buffer[m_index];
+                if (!output->ConsumeSample(lastSample)) return true;    // DMA full
+                ++m_index;
+            }
+            uint32_t due = events();
+            if (due == UINT32_MAX) {
+                if (m_tail >= (uint32_t)MIDI_SAMPLE_RATE * MIDI_TAIL / 1000) {
+                    stop();
+                    return false;
+                }
+                due = MIDI_RENDER;
+                m_tail += due;
+            }
+            m_rendered = MIN(due, (uint32_t)MIDI_RENDER);
+            m_index = 0;
+            tsf_render_short(m_synth, m_buffer, m_rendered, 0);
+            m_sample += m_rendered;
+        }
     }
-    void setVolume(const KNXValue& value)
+
+    virtual bool stop()
     {
-        _setVolume((uint8_t)value);
+        if (running) {
+            tsf_reset(m_synth);     // Voices kept allocated for the next play
+            m_voices = 0;
+            output->stop();
+        }
+        running = false;
+        return true;
     }
+    virtual bool isRunning() { return running; }
 
-    FORMAT autodetect(uint32_t channel = UINT32_MAX) {
-        const char* path = pathFromChannel(channel);
-        if (path == NULL) return NO_FILE;
-        FORMAT format = UNKNOWN;
-        File f = SPIFFS.open(path, FILE_READ);
-        if (f.available()) {
-            char buffer[12];
-            f.readBytes(buffer, 12);
-            if (buffer[0] == 0xFF) {
-                if (buffer[1] == 0xF1 || buffer[1] == 0xF9) {
-                    format = AAC;
-                }
-                else if (buffer[1] == 0xFB) {
-                    format = MP3;
-                }
-            }
-            else if (memcmp(buffer, F("MThd"), 4) == 0) {
-                format = MIDI;
-            }
-            else if (memcmp(buffer, F("fLaC"), 4) == 0) {
-                format = FLAC;
-            }
-            else if (memcmp(buffer, F("RIFF"), 4) == 0 && memcmp(buffer + 8, F("WAVE"), 4) == 0) {
-                format = WAV;
-            }
-            else if (memcmp(buffer, F("ID3"), 3) == 0) {
-                format = MP3;
+private:
+    struct Track {
+        uint32_t pos, end, tick;
+        uint8_t buffer[16];
+        uint8_t fill, next, status;
+        bool done;
+    };
+
+    static uint32_t be32(const uint8_t* p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | (p[2] << 8) | p[3]; }
+
+    uint8_t byte(Track& t)
+    {
+        if (t.next == t.fill) {
+            t.next = t.fill = 0;
+            if (t.pos < t.end && file->seek(t.pos, SEEK_SET)) {
+                t.fill = file->read(t.buffer, MIN(sizeof(t.buffer), t.end - t.pos));
+                t.pos += t.fill;
             }
-            else  if (f.seek(0x438, SeekSet) && f.readBytes(buffer, 4) == 4 && memcmp(buffer, F("M.K."), 4) == 0) {
-                format = MOD;
+            if (t.fill == 0) {
+                t.done = true;
+                return 0;
             }
         }
-        else {
-            format = NO_FILE;
-        }
-        f.close();
-        return format;
-    }
-    String channelName(uint32_t channel)
-    {
-        if (pathFromChannel(channel) == NULL) return String();
-        String n;
-        n.reserve(BANK_MAXNAMESIZE);
-        char * p = m_content.bank[channel - 1].name;
-        for (int i = 0; i < BANK_MAXNAMESIZE && *p; ++i, ++p) 
-            n += *p;
-        return n;
+        return t.buffer[t.next++];
     }
-    void setChannelName(uint32_t channel, String name, FORMAT format)
+    uint32_t number(Track& t)
     {
-        if (pathFromChannel(channel) == NULL) return;
-        m_content.bank[channel - 1].name[0] = 0;
-        strncpy(m_content.bank[channel - 1].name, name.c_str(), BANK_MAXNAMESIZE);
-        m_content.bank[channel - 1].name[MIN(BANK_MAXNAMESIZE - 1, name.length())] = 0;
-        m_content.bank[channel - 1].format = format;
+        uint32_t v = 0;
+        for (int i = 0; i < 4 && !t.done; ++i) {
+            uint8_t b = byte(t);
+            v = (v << 7) | (b & 0x7F);
+            if (!(b & 0x80)) return v;
+        }
+        t.done = true;      // More than 4 bytes or cut short: not a MIDI file after all
+        return 0;
     }
-    void flushConfig()
+    uint32_t delta(Track& t) { return t.tick + number(t); }
+    void skip(Track& t, uint32_t n) { while (n-- && !t.done) byte(t); }
+
+    uint32_t sampleOf(uint32_t tick) const
     {
-        File f = SPIFFS.open(META_PATH, FILE_WRITE);
-        f.write((uint8_t*)&m_content, sizeof(m_content));
-        f.close();
+        return m_tempoSample + (uint32_t)((uint64_t)(tick - m_tempoTick) * m_tempo * MIDI_SAMPLE_RATE / (1000000ULL * m_division));
     }
-    static const char* pathFromChannel(uint32_t channel)
+
+    // Runs the events due now, samples until the next one or UINT32_MAX at the end of all tracks
+    uint32_t events()
     {
-        static const __FlashStringHelper* Banks[] = { F("/bank_1"), F("/bank_2"), F("/bank_3"), F("/bank_4"),
-            F("/bank_5"), F("/bank_6"), F("/bank_7"), F("/bank_8"),
-            F("/bank_9"), F("/bank_10"), F("/bank_11"), F("/bank_12"),
-            F("/bank_13"), F("/bank_14"), F("/bank_15"), F("/bank_16"),
-            F("/bank_17"), F("/bank_18"), F("/bank_19"), F("/bank_20"),
-            F("/bank_21"), F("/bank_22"), F("/bank_23"), F("/bank_24"),
-            F("/bank_25"), F("/bank_26"), F("/bank_27"), F("/bank_28"),
-            F("/bank_29"), F("/bank_30"), F("/bank_31"), F("/bank_32") };
-        if (channel == 0 || channel > sizeof(Banks)/sizeof(Banks[0])) {
-            return NULL;
+        while (true) {
+            Track* next = NULL;
+            for (uint8_t i = 0; i < m_tracks; ++i) {
+                if (!m_track[i].done && (next == NULL || m_track[i].tick < next->tick)) next = &m_track[i];
+            }
+            if (next == NULL) return UINT32_MAX;
+            uint32_t at = sampleOf(next->tick);
+            if (at > m_sample) return at - m_sample;
+            event(*next);
+            if (!next->done) next->tick = delta(*next);
         }
-        return (const char*)Banks[channel - 1];
     }
-    void removeChannel(uint32_t channel)
+
+    void event(Track& t)
     {
-        const char* path = pathFromChannel(channel);
-        if (path) {
-            setChannelName(channel, String(), NO_FILE);
-            SPIFFS.remove(path);
-            flushConfig();
+        uint8_t status = byte(t);
+        uint8_t first;
+        if (status < 0x80) {    // Running status
+            first = status;
+            status = t.status;
+        }
+        else if (status < 0xF0) {
+            t.status = status;
+            first = byte(t);
+        }
+        else {
+            first = 0;
+        }
+        uint8_t channel = status & 0x0F;
+        switch (status & 0xF0) {
+            case 0x80:
+            case 0x90: {
+                uint8_t velocity = byte(t);
+                release(channel, first);
+                if ((status & 0xF0) == 0x90 && velocity && m_preset[channel] >= 0) noteOn(channel, first, velocity);
+            }; break;
+            case 0xA0:
+            case 0xB0:
+            case 0xE0: byte(t); break;
+            case 0xC0: {
+                m_program[channel] = first;
+                m_preset[channel] = preset(channel);
+            }; break;
+            case 0xD0: break;
+            default: {
+                if (status == 0xFF) {   // Meta event
+                    uint8_t type = byte(t);
+                    uint32_t length = number(t);
+                    if (type == 0x2F) {
+                        t.done = true;
+                    }
+                    else if (type == 0x51 && length == 3) {
+                        uint32_t tempo = byte(t) << 16;
+                        tempo |= byte(t) << 8;
+                        tempo |= byte(t);
+                        m_tempoSample = sampleOf(t.tick);
+                        m_tempoTick = t.tick;
+                        m_tempo = MAX(tempo, 1u);
+                    }
+                    else {
+                        skip(t, length);
+                    }
+                }
+                else if (status == 0xF0 || status == 0xF7) {    // System exclusive
+                    skip(t, number(t));
+                }
+                else {
+                    t.done = true;      // Not a MIDI file after all
+                }
+            }; break;
         }
     }
 
-    void clean()
+    // Held notes in the order they started: the oldest makes room once MIDI_MAX_VOICES are held, so the
+    // synthesizer never runs out of the voices allocated with it
+    void noteOn(uint8_t channel, uint8_t key, uint8_t velocity)
     {
-        clear();
-        memset(&m_content, 0, sizeof(m_content));
-        m_content.volume = 100;
+        if (m_voices == MIDI_MAX_VOICES) {
+            tsf_note_off(m_synth, m_voice[0].preset, m_voice[0].key);
+            memmove(m_voice, m_voice + 1, --m_voices * sizeof(Voice));
+        }
+        m_voice[m_voices++] = { m_preset[channel], channel, key };
+        tsf_note_on(m_synth, m_preset[channel], key, velocity / 127.0f);
     }
-#ifdef ENABLE_MIDI
-    bool hasSoundFont() const
+    void release(uint8_t channel, uint8_t key)
     {
-        return SPIFFS.exists(SOUNDFONT_PATH);
+        for (uint8_t i = 0; i < m_voices; ++i) {
+            if (m_voice[i].channel == channel && m_voice[i].key == key) {
+                tsf_note_off(m_synth, m_voice[i].preset, key);
+                memmove(m_voice + i, m_voice + i + 1, (--m_voices - i) * sizeof(Voice));
+                return;
+            }
+        }
     }
-#endif
-    AudioGenerator* audioGeneratorbuilder(uint32_t channel)
+
+    // Channel 10 plays the percussion bank
+    int preset(uint8_t channel) const
     {
-        if (pathFromChannel(channel) == NULL) {
-            return NULL;
-        }
-        switch (m_content.bank[channel - 1].format) {
-#ifdef ENABLE_AAC
-            case AAC: return new AudioGeneratorAAC(); break;
-#endif
-#ifdef ENABLE_MP3
-            case MP3: return new AudioGeneratorMP3(); break;
-#endif
-#ifdef ENABLE_MIDI
-            case MIDI: {
-                if (hasSoundFont()) {
-                    AudioGeneratorMIDI* midi = new AudioGeneratorMIDI();
-                    delete m_sf2;
-                    m_sf2 = new AudioFileSourceSPIFFS(SOUNDFONT_PATH);
-                    midi->SetSoundfont(m_sf2);
-                    midi->SetSampleRate(22050);
-                    return midi;
-                }
-             } break;
+        int bank = channel == 9 ? 128 : 0;
+        int index = tsf_get_presetindex(m_synth, bank, m_program[channel]);
+        return index >= 0 ? index : tsf_get_presetindex(m_synth, bank, 0);
+    }
+
+    struct Voice {
+        int preset;
+        uint8_t channel, key;
+    };
+
+    tsf* m_synth;
+    Voice m_voice[MIDI_MAX_VOICES];
+    uint8_t m_voices = 0;
+    Track m_track[MIDI_MAXTRACKS];
+    uint8_t m_tracks = 0;
+    uint16_t m_division = 0;
+    uint32_t m_tempo = 500000;          // us per quarter note
+    uint32_t m_tempoTick = 0, m_tempoSample = 0, m_sample = 0, m_tail = 0;
+    uint8_t m_program[16];
+    int m_preset[16];
+    int16_t m_buffer[MIDI_RENDER];
+    uint32_t m_rendered = 0, m_index = 0;
+};
+
+static AudioGenerator* createMIDI(AudioFileSource*&)
+{
+    tsf* synth = soundFont.synth();
+    return synth ? new AudioGeneratorSMF(synth) : NULL;
+}
+# define FORMATS_MIDI(FORMAT, MAGIC)  FORMAT(MIDI, ".mid", "audio/midi", MAX_CPU_FREQ) MAGIC(MIDI, 0, "MThd")
+#else
+# define FORMATS_MIDI(FORMAT, MAGIC)
 #endif
 #ifdef ENABLE_FLAC
-            case FLAC: return new AudioGeneratorFLAC(); break;
+static AudioGenerator* createFLAC(AudioFileSource*&) { return new AudioGeneratorFLAC(); }
+# define FORMATS_FLAC(FORMAT, MAGIC)  FORMAT(FLAC, ".flac", "audio/flac", MAX_CPU_FREQ) MAGIC(FLAC, 0, "fLaC")
+#else
+# define FORMATS_FLAC(FORMAT, MAGIC)
 #endif
 #ifdef ENABLE_WAV
-            case WAV: return new AudioGeneratorWAV(); break;
+static AudioGenerator* createWAV(AudioFileSource*&) { return new AudioGeneratorWAV(); }
+# define FORMATS_WAV(FORMAT, MAGIC)   FORMAT(WAV, ".wav", "audio/wav", IDLE_CPU_FREQ) MAGIC(WAV, 0, "RIFF????WAVE")
+#else
+# define FORMATS_WAV(FORMAT, MAGIC)
 #endif
 #ifdef ENABLE_MOD
-            case MOD: {
-                AudioGeneratorMOD* mod = new AudioGeneratorMOD();
-                mod->SetBufferSize(3*1024);
-                mod->SetSampleRate(22050);
-                mod->SetStereoSeparation(32);
-                return mod;
-            }; break;
+static AudioGenerator* createMOD(AudioFileSource*&)
+{
+    AudioGeneratorMOD* mod = new AudioGeneratorMOD();
+    mod->SetBufferSize(3*1024);
+    mod->SetSampleRate(22050);
+    mod->SetStereoSeparation(32);
+    return mod;
+}
+# define FORMATS_MOD(FORMAT, MAGIC)   FORMAT(MOD, ".mod", "audio/x-mod", MAX_CPU_FREQ) MAGIC(MOD, 0x438, "M.K.")
+#else
+# define FORMATS_MOD(FORMAT, MAGIC)
 #endif
-            default: break;
+#define AUDIO_FORMATS(FORMAT, MAGIC)  FORMATS_AAC(FORMAT, MAGIC) FORMATS_MP3(FORMAT, MAGIC) FORMATS_MIDI(FORMAT, MAGIC) \
+                                      FORMATS_FLAC(FORMAT, MAGIC) FORMATS_WAV(FORMAT, MAGIC) FORMATS_MOD(FORMAT, MAGIC)
+#define FORMAT_NONE(...)
+#define FORMAT_EXTENSION(id, ext, mime, freq)   ext ","
+#define FORMAT_EXTENSIONS             AUDIO_FORMATS(FORMAT_EXTENSION, FORMAT_NONE)
+#define FORMAT_COUNT(...)             + 1
+static_assert(0 AUDIO_FORMATS(FORMAT_COUNT, FORMAT_NONE) > 0, "CUSTOM_FORMATS build without any format: add -DENABLE_MP3 or another ENABLE_* flag");
+
+class NullStream : public Stream
+{
+public:
+    virtual int available() { return 0; }
+    virtual int read() { return -1; }
+    virtual int peek() { return -1; }
+    virtual void flush() {}
+    virtual size_t write(uint8_t) { return 0; }
+} nullDevice;
+
+// Post-mortem log in RTC memory: survives watchdog, panic and software resets (not power loss).
+// Fixed 16-byte records in a ring, logging is a few stores.
+#define DIAG_RECORDS    128
+#define DIAG_MAGIC      0x44494147
+#define DIAG_SLOW_LOOP  100         // ms, longer loops are recorded as new maxima
+#define DIAG_HEAP_STEP  1024        // Bytes the heap low-water mark must drop before a new record
+
+enum DIAG_TYPE : uint8_t { DIAG_BOOT, DIAG_KNX, DIAG_PLAYER, DIAG_HTTP, DIAG_LOOP, DIAG_HEAP, DIAG_WATCHDOG };
+
+struct DiagRecord
+{
+    uint32_t time;          // millis()
+    uint8_t boot;           // Low byte of the boot counter
+    DIAG_TYPE type;
+    uint16_t arg;           // BOOT: reset reason, KNX: group object, PLAYER: action, HTTP: method
+    union {
+        uint32_t value[2];  // KNX: first value bytes, PLAYER: channel, LOOP: ms, HEAP: bytes
+        char text[8];       // HTTP: start of the URI
+    };
+};
+
+struct Diag
+{
+    void init()
+    {
+        m_reason = esp_reset_reason();
+        if (m_log.magic != DIAG_MAGIC || m_reason == ESP_RST_POWERON || m_log.head >= DIAG_RECORDS) {
+            memset(&m_log, 0, sizeof(m_log));
+            m_log.magic = DIAG_MAGIC;
         }
-        return NULL;
+        else {
+            // Last event of the previous run, reported after the reset
+            const DiagRecord& last = m_log.records[(m_log.head + DIAG_RECORDS - 1) % DIAG_RECORDS];
+            m_previous = last.type;
+        }
+        ++m_log.boots;
+        m_log.loopMax = 0;
+        m_log.heapMin = UINT32_MAX;
+        log(DIAG_BOOT, m_reason);
     }
 
-    void loop()
+    void IRAM_ATTR log(DIAG_TYPE type, uint16_t arg, uint32_t value0 = 0, uint32_t value1 = 0)
     {
-        switch (m_action) {
-            case PLAY: {
-                uint32_t channel = m_playingChannel;
-                clear();
-                const char* path = pathFromChannel(channel);
+        DiagRecord& r = m_log.records[m_log.head];
+        r.time = millis();
+        r.boot = m_log.boots;
+        r.type = type;
+        r.arg = arg;
+        r.value[0] = value0;
+        r.value[1] = value1;
+        m_log.head = (m_log.head + 1) % DIAG_RECORDS;
+        if (m_log.count < DIAG_RECORDS) ++m_log.count;
+    }
+    void log(DIAG_TYPE type, uint16_t arg, const String& text)
+    {
+        log(type, arg);
+        strncpy(m_log.records[(m_log.head + DIAG_RECORDS - 1) % DIAG_RECORDS].text, text.c_str(), sizeof(DiagRecord::text));
+    }
+
+    // Loop duration and heap low-water mark, recorded when they reach new extremes
+    void loop(uint32_t duration)
+    {
+        if (duration > m_log.loopMax) {
+            m_log.loopMax = duration;
+            if (duration >= DIAG_SLOW_LOOP) log(DIAG_LOOP, 0, duration);
+        }
+        uint32_t heap = ESP.getMinFreeHeap();
+        uint32_t block = ESP.getMaxAllocHeap();
+        if (heap + DIAG_HEAP_STEP <= m_log.heapMin || m_log.heapMin == UINT32_MAX) {
+            m_log.heapMin = heap;
+            log(DIAG_HEAP, 0, heap, block);
+        }
+        // Largest free block shrinking while free heap holds: fragmentation
+        if (block + DIAG_HEAP_STEP <= m_blockMin) {
+            m_blockMin = block;
+            log(DIAG_HEAP, 1, heap, block);
+        }
+    }
+
+    // Telegram dispatch cost, CPU cycles converted at the current frequency
+    void dispatched(uint32_t cycles)
+    {
+        uint32_t us = cycles / MAX(ESP.getCpuFreqMHz(), 1);
+        ++m_dispatchCount;
+        m_dispatchTotal += us;
+        m_dispatchMax = MAX(m_dispatchMax, us);
+    }
+
+    void clear()
+    {
+        m_log.head = m_log.count = 0;
+        m_dispatchCount = m_dispatchTotal = m_dispatchMax = 0;
+    }
+
+    static const char* typeName(uint8_t type)
+    {
+        static const char* names[] = { "boot", "knx", "player", "http", "loop", "heap", "watchdog" };
+        return type < sizeof(names) / sizeof(names[0]) ? names[type] : "?";
+    }
+    static const char* reasonName(uint8_t reason)
+    {
+        static const char* names[] = { "unknown", "poweron", "ext", "sw", "panic", "intwdt", "taskwdt", "wdt", "deepsleep", "brownout", "sdio" };
+        return reason < sizeof(names) / sizeof(names[0]) ? names[reason] : "?";
+    }
+
+    // Oldest first
+    const DiagRecord& record(uint32_t i) const { return m_log.records[(m_log.head + DIAG_RECORDS - m_log.count + i) % DIAG_RECORDS]; }
+    uint32_t count() const { return m_log.count; }
+    uint32_t boots() const { return m_log.boots; }
+    uint32_t loopMax() const { return m_log.loopMax; }
+    uint32_t heapMin() const { return m_log.heapMin; }
+    uint32_t blockMin() const { return m_blockMin; }
+    uint32_t uptime() const { return esp_timer_get_time() / 1000000; }     // s, unlike millis() does not wrap after 49.7 days
+    uint8_t reason() const { return m_reason; }
+    uint8_t previous() const { return m_previous; }
+    uint32_t dispatchCount() const { return m_dispatchCount; }
+    uint32_t dispatchAvg() const { return m_dispatchCount ? m_dispatchTotal / m_dispatchCount : 0; }
+    uint32_t dispatchMax() const { return m_dispatchMax; }
+  private:
+    struct Log {
+        uint32_t magic;
+        uint32_t head;
+        uint32_t count;
+        uint32_t boots;
+        uint32_t loopMax;
+        uint32_t heapMin;
+        DiagRecord records[DIAG_RECORDS];
+    };
+    static Log m_log;
+    uint8_t m_reason = 0;
+    uint8_t m_previous = DIAG_BOOT;
+    uint32_t m_dispatchCount = 0, m_dispatchTotal = 0, m_dispatchMax = 0;   // us
+    uint32_t m_blockMin = UINT32_MAX;
+} diag;
+RTC_NOINIT_ATTR Diag::Log Diag::m_log;
+
+// Single callback of all group objects, routes on the GO number (see GO_LAYOUT)
+static void dispatchTelegram(GroupObject& go);
+
+static uint32_t lastHttpRequest = 0;    // millis(), keeps the chip awake for IDLE_HTTP
+
+// Sees every request before the real handlers, never handles it
+class DiagRequestHandler : public RequestHandler
+{
+public:
+    virtual bool canHandle(HTTPMethod method, String uri)
+    {
+        diag.log(DIAG_HTTP, method, uri.substring(1));
+        lastHttpRequest = millis();
+        return false;
+    }
+};
+
+static void IRAM_ATTR watchdogExpired()
+{
+    diag.log(DIAG_WATCHDOG, 0);
+    esp_restart();
+}
+
+// Light sleep while idle, CPU boost while decoding
+struct Power
+{
+    void init()
+    {
+        setCpuFrequencyMhz(m_freq);
+        m_awakeUntil = millis() + IDLE_GRACE;
+    }
+
+    // Hold the CPU at the given frequency until released
+    void lock(uint32_t mhz)
+    {
+        mhz = MAX(mhz, IDLE_CPU_FREQ);
+        if (mhz == m_freq)
+            return;
+        m_freq = mhz;
+        setCpuFrequencyMhz(mhz);
+    }
+    void release() { lock(IDLE_CPU_FREQ); }
+
+    // Playback started: measure latency from the wake up that triggered it
+    void played()
+    {
+        if (m_wakeTime) {
+            m_latency = micros() - m_wakeTime;
+            m_latencyMax = MAX(m_latencyMax, m_latency);
+            m_wakeTime = 0;
+        }
+    }
+
+    // Connected: short sleeps so the station keeps its association and requests wait at most IDLE_SLEEP_WIFI
+    void loop(bool idle, bool connected)
+    {
+        if (!idle) {
+            return;
+        }
+        if ((int32_t)(millis() - m_awakeUntil) < 0) {
+            return;
+        }
+        // A TP-UART start bit or a button press wakes up the chip. The telegram that woke us is
+        // not acknowledged, so the KNX sender repeats it while we stay awake for IDLE_GRACE.
+        m_wakeTime = 0;
+        gpio_wakeup_enable((gpio_num_t)PIN_TPUART_RX, GPIO_INTR_LOW_LEVEL);
+        gpio_wakeup_enable((gpio_num_t)PIN_PROG_SWITCH, GPIO_INTR_LOW_LEVEL);
+        esp_sleep_enable_gpio_wakeup();
+        esp_sleep_enable_timer_wakeup(connected ? IDLE_SLEEP_WIFI : IDLE_SLEEP_MAX);
+        uint32_t start = millis();
+        esp_light_sleep_start();
+        gpio_wakeup_disable((gpio_num_t)PIN_TPUART_RX);
+        gpio_wakeup_disable((gpio_num_t)PIN_PROG_SWITCH);
+        gpio_set_intr_type((gpio_num_t)PIN_PROG_SWITCH, GPIO_INTR_POSEDGE);    // restore knx button interrupt
+        m_sleepTime += millis() - start;
+        ++m_sleepCount;
+        if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO) {
+            m_wakeTime = micros();
+            m_awakeUntil = millis() + IDLE_GRACE;
+        }
+    }
+
+    uint32_t sleepCount() const { return m_sleepCount; }
+    uint32_t sleepTime() const { return m_sleepTime; }
+    uint32_t wakeLatency() const { return m_latency; }
+    uint32_t wakeLatencyMax() const { return m_latencyMax; }
+  private:
+    uint32_t m_freq = IDLE_CPU_FREQ;
+    uint32_t m_awakeUntil = 0;
+    uint32_t m_wakeTime = 0;
+    uint32_t m_latency = 0;
+    uint32_t m_latencyMax = 0;
+    uint32_t m_sleepCount = 0;
+    uint32_t m_sleepTime = 0;
+} power;
+
+
+static const uint16_t outputPins[] = { 18, 19, 21, 22 };
+enum { outputCount = sizeof(outputPins)/sizeof(outputPins[0]) };
+
+// Output patterns: each step byte holds the output level (bit 7) and its duration in PATTERN_TICK (bits 0-6), 0 ends the sequence
+#define PATTERN_TICK      50      // ms
+#define PATTERN_MAXSTEPS  8
+#define PATTERN_STEP(on, ms)  (uint8_t)(((on) ? 0x80 : 0) | (((ms) / PATTERN_TICK) & 0x7F))
+#define PATTERN_CUSTOM    0x7F    // Pattern defined from web
+#define PATTERN_SYNC      0x80    // Pattern value flag: follow player start/stop
+
+struct Pattern
+{
+    uint8_t repeat;     // 0 = until stopped
+    uint8_t steps[PATTERN_MAXSTEPS];
+};
+
+static const Pattern patterns[] = {
+    { 1, { PATTERN_STEP(1, 300) } },                                                                        // 1: Strike pulse
+    { 5, { PATTERN_STEP(1, 250), PATTERN_STEP(0, 250) } },                                                  // 2: Flash 5 times
+    { 0, { PATTERN_STEP(1, 500), PATTERN_STEP(0, 500) } },                                                  // 3: Blink
+    { 0, { PATTERN_STEP(1, 400), PATTERN_STEP(0, 200), PATTERN_STEP(1, 400), PATTERN_STEP(0, 2000) } },     // 4: Ring cadence
+    { 0, { PATTERN_STEP(1, 100), PATTERN_STEP(0, 100) } },                                                  // 5: Buzzer
+};
+enum { patternCount = sizeof(patterns)/sizeof(patterns[0]) };
+
+// Shared scheduler: only keeps the closest step deadline of the outputs running a pattern
+struct Sequencer
+{
+    void arm(uint8_t id, uint32_t deadline)
+    {
+        if (m_active == 0 || (int32_t)(deadline - m_next) < 0) {
+            m_next = deadline;
+        }
+        m_active |= 1 << id;
+    }
+    void disarm(uint8_t id) { m_active &= ~(1 << id); }
+    void loop(uint32_t time);
+  private:
+    uint8_t m_active = 0;
+    uint32_t m_next = 0;
+} sequencer;
+
+
+struct Output
+{
+    enum { GO_ONOFF, GO_STATUS, GO_BLOCK, NBGO };
+
+    void init(int baseAddr, uint16_t baseGO, uint16_t pinNb)
+    {
+        m_params.autoOffTimer = (knx.paramInt(baseAddr) & 0xFFFF) * 100;    // issue with first short in eeprom (maybe overwritten?) 
+        for (uint8_t i = 0; i < NBGO; ++i) {
+            m_GO[i] = &knx.getGroupObject(baseGO + i);
+            m_GO[i]->dataPointType(DPT_Switch);
+        }
+
+        m_pin = pinNb;
+        pinMode(m_pin, OUTPUT);
+        digitalWrite(m_pin, LOW);
+    }
+
+    void initPattern(uint8_t id, uint16_t goPattern)
+    {
+        m_id = id;
+        knx.getGroupObject(goPattern).dataPointType(DPT_Value_1_Ucount);
+    }
+
+    // Telegram on the GO_ONOFF + index object
+    void telegram(uint8_t index, GroupObject& go)
+    {
+        switch (index) {
+            case GO_ONOFF: value(go.value()); break;
+            case GO_BLOCK: m_blocked = go.value(); break;
+        }
+    }
+    // Pattern object: 0 = Off, 1-127 = pattern, +128 = sync with player
+    void patternTelegram(GroupObject& go);
+
+    void value(bool value) {
+        if (m_blocked)
+            return;
+        stopPattern();
+        if (value && m_params.autoOffTimer > 0) {
+            m_timer = (millis() + m_params.autoOffTimer) | 1;     // Deadline, 0 = no timer
+        }
+        else {
+            m_timer = 0;
+        }
+        digitalWrite(m_pin, value?HIGH:LOW);
+        status(value);
+    }
+
+    // 0 stops, 1..patternCount are built in, PATTERN_CUSTOM is the one set from web
+    static bool validPattern(int value)
+    {
+        return (value >= 0 && value <= patternCount) || value == PATTERN_CUSTOM;
+    }
+
+    void pattern(uint8_t value)
+    {
+        if (m_blocked)
+            return;
+        const Pattern* p = NULL;
+        if (value == PATTERN_CUSTOM) {
+            p = &m_custom;
+        }
+        else if (value > 0 && value <= patternCount) {
+            p = &patterns[value - 1];
+        }
+        if (p == NULL || p->steps[0] == 0) {
+            if (m_pattern) {
+                stopPattern();
+                digitalWrite(m_pin, LOW);
+                status(false);
+            }
+            return;
+        }
+        m_timer = 0;
+        m_pattern = p;
+        m_step = 0;
+        m_repeat = p->repeat;
+        m_deadline = millis();
+        status(true);
+        step(m_deadline);
+    }
+
+    // steps: hex encoded step bytes (see PATTERN_STEP)
+    void setCustomPattern(uint8_t repeat, const String& steps)
+    {
+        stopPattern();
+        memset(&m_custom, 0, sizeof(m_custom));
+        m_custom.repeat = repeat;
+        for (unsigned int i = 0; i + 1 < steps.length() && i / 2 < PATTERN_MAXSTEPS; i += 2) {
+            char hex[3] = { steps[i], steps[i + 1], 0 };
+            m_custom.steps[i / 2] = strtoul(hex, NULL, 16);
+        }
+    }
+
+    // Called by the sequencer once the current step deadline is reached
+    void step(uint32_t time)
+    {
+        if (m_pattern == NULL)
+            return;
+        if ((int32_t)(time - m_deadline) < 0) {
+            sequencer.arm(m_id, m_deadline);
+            return;
+        }
+        if (m_step >= PATTERN_MAXSTEPS || m_pattern->steps[m_step] == 0) {
+            if (m_pattern->repeat && --m_repeat == 0) {
+                stopPattern();
+                digitalWrite(m_pin, LOW);
+                status(false);
+                return;
+            }
+            m_step = 0;
+        }
+        uint8_t s = m_pattern->steps[m_step++];
+        digitalWrite(m_pin, (s & 0x80)?HIGH:LOW);
+        m_deadline += (s & 0x7F) * PATTERN_TICK;    // from previous deadline: no cadence drift
+        sequencer.arm(m_id, m_deadline);
+    }
+
+    uint32_t autoOffTimer() const { return m_params.autoOffTimer; }
+    bool value() const { return m_on; }
+    bool patternRunning() const { return m_pattern != NULL; }
+    bool idle() const { return m_timer == 0 && m_pattern == NULL; }
+
+    void loop(uint32_t time)
+    {
+        // Manage MONO Stable timer
+        if (m_timer) {
+            if ((int32_t)(time - m_timer) >= 0) {     // Signed difference: survives the millis() wrap
+                digitalWrite(m_pin, LOW);
+                status(false);
+                m_timer = 0;
+            }
+        }
+    }
+  private:
+    void stopPattern()
+    {
+        m_pattern = NULL;
+        sequencer.disarm(m_id);
+    }
+    void status(bool value)
+    {
+        m_on = value;
+        if (m_GO[GO_STATUS])
+            m_GO[GO_STATUS]->value(value);
+    }
+
+    uint16_t m_pin;
+    bool m_on = false;
+    bool m_blocked = false;
+    uint32_t m_timer = 0;
+    uint8_t m_id = 0;
+    const Pattern* m_pattern = NULL;
+    uint8_t m_step = 0;
+    uint8_t m_repeat = 0;
+    uint32_t m_deadline = 0;
+    Pattern m_custom = {};
+    struct {
+      uint32_t autoOffTimer = 0;
+    } m_params;
+    GroupObject* m_GO[NBGO] = {};    // Resolved once, NULL when not configured
+  public:
+    enum { SIZEPARAMS = sizeof(m_params) };
+} output[outputCount];
+
+void Sequencer::loop(uint32_t time)
+{
+    if (m_active == 0 || (int32_t)(time - m_next) < 0)
+        return;
+    uint8_t active = m_active;
+    m_active = 0;
+    for (int i = 0; i < outputCount; ++i) {
+        if (active & (1 << i)) {
+            output[i].step(time);   // rearm itself
+        }
+    }
+}
+
+// Benchmark sink: accepts and counts every sample
+class AudioOutputCounter : public AudioOutput
+{
+public:
+    virtual bool begin() { m_samples = 0; return true; }
+    virtual bool ConsumeSample(int16_t sample[2]) { (void)sample; ++m_samples; return true; }
+    virtual bool stop() { return true; }
+    uint32_t samples() const { return m_samples; }
+    uint32_t rate() const { return hertz; }
+private:
+    uint32_t m_samples = 0;
+};
+
+#define CONFIG_FLUSH_DELAY  ( 2 * 1000 )    // ms
+
+// Fixed point DSP stage in front of I2S. Volume changes and fades are ramped per sample so they do not click,
+// loudness can be normalised per block and peaks softly limited instead of clipped. Gains are Q12 (4096 = 1.0).
+#define DSP_UNITY           ( 1 << 12 )
+#define DSP_MAXGAIN         ( 4 * DSP_UNITY )
+#define DSP_VOLUME_RAMP     20          // ms
+#define DSP_FADE_TIME       150         // ms
+#define DSP_BLOCK           1024        // Samples per loudness measurement
+#define DSP_LOUDNESS_TARGET 4096        // Mean absolute level, about -18 dBFS
+#define DSP_SILENCE         64          // Mean absolute level not normalised
+#define DSP_LIMIT_KNEE      24576       // Limiter threshold, about -2.5 dBFS
+#define DSP_NORMALIZE       0x01
+#define DSP_LIMITER         0x02
+
+class AudioOutputDSP : public AudioOutputI2S
+{
+public:
+    using AudioOutputI2S::AudioOutputI2S;
+
+    void setVolume(uint8_t percent, bool ramp = true)
+    {
+        int32_t gain = MIN(percent, 100) * DSP_MAXGAIN / 100;
+        if (ramp) m_volume.set(gain, samples(DSP_VOLUME_RAMP));
+        else m_volume.jump(gain);
+    }
+    void setOptions(uint8_t options) { m_options = options; m_normalize.jump(DSP_UNITY); }
+    uint8_t options() const { return m_options; }
+    void fadeIn()
+    {
+        m_fade.jump(0);
+        m_fade.set(DSP_UNITY, samples(DSP_FADE_TIME));
+    }
+    void fadeOut() { m_fade.set(0, samples(DSP_FADE_TIME)); }
+    bool silent() const { return m_fade.value == 0; }
+    uint32_t limited() const { return m_limited; }
+    uint32_t rate() const { return hertz; }
+    // CPU cycles of the processing per stereo sample, I2S excluded, since boot. At 80 MHz and 44.1 kHz a sample lasts
+    // 1814 cycles; the maximum includes the interrupts taken meanwhile.
+    uint32_t cyclesAvg() const { return m_cycleSamples ? m_cycleTotal / m_cycleSamples : 0; }
+    uint32_t cyclesMax() const { return m_cycleMax; }
+
+    // Synchronised start: samples are refused until the local esp_timer time, 0 = no hold
+    void holdUntil(int64_t time) { m_holdUntil = time; }
+    bool holding() const { return m_holdUntil != 0; }
+    // Samples accepted since the hold ended
+    uint32_t consumed() const { return m_consumed; }
+    // Drift correction: > 0 repeats samples, < 0 drops them
+    void adjust(int8_t samples) { m_adjust += samples; }
+
+    virtual bool ConsumeSample(int16_t sample[2]) override
+    {
+        if (m_holdUntil) {
+            if (esp_timer_get_time() < m_holdUntil) return false;
+            m_holdUntil = 0;
+            m_consumed = 0;
+            m_adjust = 0;
+        }
+        if (m_adjust < 0) {
+            ++m_adjust;
+            ++m_consumed;
+            return true;
+        }
+        // A refused sample is offered again: keep it processed so ramps advance once per sample
+        if (!m_held) {
+            uint32_t start = ESP.getCycleCount();
+            int32_t gain = (m_volume.next() * m_fade.next()) >> 12;
+            if (m_options & DSP_NORMALIZE) {
+                measure(sample[LEFTCHANNEL]);
+                gain = MIN((gain * m_normalize.next()) >> 12, DSP_MAXGAIN);
+            }
+            for (int c = LEFTCHANNEL; c <= RIGHTCHANNEL; ++c) {
+                int32_t s = (sample[c] * gain) >> 12;
+                m_sample[c] = m_options & DSP_LIMITER ? limit(s) : constrain(s, -32768, 32767);
+            }
+            m_held = true;
+            uint32_t cycles = ESP.getCycleCount() - start;
+            m_cycleTotal += cycles;
+            ++m_cycleSamples;
+            m_cycleMax = MAX(m_cycleMax, cycles);
+        }
+        if (!AudioOutputI2S::ConsumeSample(m_sample))
+            return false;
+        if (m_adjust > 0) {
+            --m_adjust;         // Offered again and output twice
+            return false;
+        }
+        m_held = false;
+        ++m_consumed;
+        return true;
+    }
+private:
+    // The step keeps 16 fraction bits so a ramp lasts the time asked for, not a truncated or stretched one
+    struct Ramp {
+        int32_t value, target, step, fraction;
+        void jump(int32_t to) { value = target = to; step = fraction = 0; }
+        void set(int32_t to, uint32_t samples)
+        {
+            target = to;
+            fraction = 0;
+            step = (int32_t)((int64_t)(to - value) * 65536 / (int32_t)MAX(samples, 1u));
+            if (step == 0 && to != value) step = to > value ? 1 : -1;
+        }
+        inline int32_t next()
+        {
+            if (value != target) {
+                fraction += step;
+                value += fraction >> 16;
+                fraction &= 0xFFFF;
+                if ((step > 0) == (value > target)) value = target;
+            }
+            return value;
+        }
+    };
+
+    uint32_t samples(uint32_t ms) const { return ms * (hertz ? hertz : 44100) / 1000; }
+
+    // Mean absolute level per block drives the normalisation gain, silence keeps the current one
+    inline void measure(int16_t sample)
+    {
+        m_sum += sample < 0 ? -sample : sample;
+        if (++m_count == DSP_BLOCK) {
+            uint32_t mean = m_sum / DSP_BLOCK;
+            if (mean > DSP_SILENCE) {
+                m_normalize.set(constrain((int32_t)(((uint32_t)DSP_LOUDNESS_TARGET << 12) / mean), DSP_UNITY / 4, DSP_MAXGAIN), DSP_BLOCK);
+            }
+            m_sum = m_count = 0;
+        }
+    }
+
+    // Above the knee the level approaches full scale asymptotically
+    inline int16_t limit(int32_t s)
+    {
+        int32_t a = s < 0 ? -s : s;
+        if (a > DSP_LIMIT_KNEE) {
+            const int32_t room = 32767 - DSP_LIMIT_KNEE;
+            int32_t over = a - DSP_LIMIT_KNEE;
+            a = DSP_LIMIT_KNEE + over * room / (over + room);
+            ++m_limited;
+        }
+        return s < 0 ? -a : a;
+    }
+
+    Ramp m_volume = { DSP_MAXGAIN, DSP_MAXGAIN, 0, 0 };
+    Ramp m_fade = { DSP_UNITY, DSP_UNITY, 0, 0 };
+    Ramp m_normalize = { DSP_UNITY, DSP_UNITY, 0, 0 };
+    uint8_t m_options = 0;
+    int16_t m_sample[2];
+    bool m_held = false;
+    uint32_t m_sum = 0, m_count = 0, m_limited = 0;
+    uint64_t m_cycleTotal = 0, m_cycleSamples = 0;   // 32 bits of samples last a day of playback
+    uint32_t m_cycleMax = 0;
+    int64_t m_holdUntil = 0;
+    uint32_t m_consumed = 0;
+    int8_t m_adjust = 0;
+};
+
+// Network stream: ring buffer filled from an HTTP/ICY connection or pushed from a POST body.
+// Decoding starts once STREAM_PREFETCH bytes are buffered and pauses (rebuffers) below STREAM_LOW_WATER.
+// Name resolution and connection progress from loop(): opening never blocks the KNX loop.
+#define STREAM_BUFFER_SIZE  ( 16 * 1024 )
+#define STREAM_PREFETCH     ( 8 * 1024 )
+#define STREAM_LOW_WATER    ( 2 * 1024 )
+#define STREAM_TIMEOUT      ( 10 * 1000 )     // ms without enough data before giving up
+#define STREAM_MAXURLSIZE   128
+
+class AudioFileSourceNetwork : public AudioFileSource
+{
+public:
+    virtual ~AudioFileSourceNetwork() { close(); }
+
+    // url: http://host[:port]/path
+    virtual bool open(const char* url)
+    {
+        close();
+        String u(url);
+        if (!u.startsWith("http://")) return false;
+        int pathStart = u.indexOf('/', 7);
+        if (pathStart < 0) pathStart = u.length();
+        m_host = u.substring(7, pathStart);
+        m_path = pathStart < (int)u.length() ? u.substring(pathStart) : String("/");
+        m_port = 80;
+        int colon = m_host.indexOf(':');
+        if (colon >= 0) {
+            m_port = m_host.substring(colon + 1).toInt();
+            m_host = m_host.substring(0, colon);
+        }
+        if (m_host.isEmpty() || m_port == 0) return false;
+        ip_addr_t ip;
+        s_dnsDone = false;
+        err_t err = dns_gethostbyname(m_host.c_str(), &ip, resolved, (void*)(uintptr_t)s_dnsRequest);
+        if (err == ERR_OK) {
+            if (!connectTo(ip.u_addr.ip4.addr)) return false;
+        }
+        else if (err == ERR_INPROGRESS) {
+            m_state = RESOLVING;
+        }
+        else {
+            return false;
+        }
+        m_headers = true;
+        m_statusLine = true;
+        return allocate();
+    }
+
+    // Data provided by push()
+    bool openPush()
+    {
+        close();
+        m_push = true;
+        return allocate();
+    }
+
+    size_t push(const uint8_t* data, size_t len)
+    {
+        size_t done = 0;
+        while (m_buffer && done < len && m_level < STREAM_BUFFER_SIZE) {
+            size_t n = MIN(len - done, MIN(STREAM_BUFFER_SIZE - m_level, STREAM_BUFFER_SIZE - m_head));
+            memcpy(m_buffer + m_head, data + done, n);
+            m_head = (m_head + n) % STREAM_BUFFER_SIZE;
+            m_level += n;
+            done += n;
+        }
+        return done;
+    }
+    void endOfStream() { m_eos = true; }
+
+    virtual uint32_t read(void* data, uint32_t len)
+    {
+        uint32_t n = peek((uint8_t*)data, len);
+        m_tail = (m_tail + n) % STREAM_BUFFER_SIZE;
+        m_level -= n;
+        m_pos += n;
+        return n;
+    }
+
+    size_t peek(uint8_t* data, size_t len) const
+    {
+        size_t n = MIN(len, m_level);
+        size_t first = MIN(n, STREAM_BUFFER_SIZE - m_tail);
+        memcpy(data, m_buffer + m_tail, first);
+        memcpy(data + first, m_buffer, n - first);
+        return n;
+    }
+
+    virtual bool seek(int32_t, int) { return false; }
+    virtual bool close()
+    {
+        ++s_dnsRequest;     // A resolution still running is ignored
+        if (m_state == CONNECTING) ::close(m_fd);
+        m_state = CLOSED;
+        m_client.stop();
+        free(m_buffer);
+        m_buffer = NULL;
+        m_head = m_tail = m_level = m_pos = m_size = 0;
+        m_headers = m_statusLine = m_failed = m_eos = m_push = false;
+        m_buffering = true;
+        m_lineLength = 0;
+        m_mime[0] = 0;
+        return true;
+    }
+    virtual bool isOpen() { return m_buffer != NULL && !m_failed; }
+    virtual uint32_t getSize() { return m_size; }
+    virtual uint32_t getPos() { return m_pos; }
+
+    // Refill from network
+    virtual bool loop()
+    {
+        if (m_buffer == NULL || m_push) return true;
+        if (m_state != OPEN) {
+            connecting();
+            return true;
+        }
+        while (m_headers && m_client.available()) {
+            char c = m_client.read();
+            if (c == '\r') continue;
+            if (c != '\n') {
+                if (m_lineLength < sizeof(m_line) - 1) m_line[m_lineLength++] = c;
+                continue;
+            }
+            m_line[m_lineLength] = 0;
+            if (m_lineLength == 0) {
+                m_headers = false;
+            }
+            else if (m_statusLine) {   // "HTTP/1.x 200 OK" or "ICY 200 OK"
+                const char* code = strchr(m_line, ' ');
+                m_failed = code == NULL || atoi(code + 1) != 200;
+                m_statusLine = false;
+            }
+            else if (strncasecmp(m_line, "Content-Type:", 13) == 0) {
+                const char* v = m_line + 13;
+                while (*v == ' ') ++v;
+                size_t i = 0;
+                while (v[i] && v[i] != ';' && i < sizeof(m_mime) - 1) { m_mime[i] = v[i]; ++i; }
+                m_mime[i] = 0;
+            }
+            else if (strncasecmp(m_line, "Content-Length:", 15) == 0) {
+                m_size = atoi(m_line + 15);
+            }
+            m_lineLength = 0;
+        }
+        while (!m_headers && m_level < STREAM_BUFFER_SIZE && m_client.available()) {
+            size_t n = MIN(STREAM_BUFFER_SIZE - m_level, STREAM_BUFFER_SIZE - m_head);
+            int r = m_client.read(m_buffer + m_head, n);
+            if (r <= 0) break;
+            m_head = (m_head + r) % STREAM_BUFFER_SIZE;
+            m_level += r;
+        }
+        if (!m_client.connected() && !m_client.available()) {
+            m_eos = true;
+        }
+        return true;
+    }
+
+    // Enough data buffered to decode
+    bool ready()
+    {
+        if (m_eos) {
+            m_buffering = false;
+        }
+        else if (m_buffering) {
+            m_buffering = m_level < STREAM_PREFETCH;
+        }
+        else if (m_level < STREAM_LOW_WATER) {
+            m_buffering = true;
+            ++m_underruns;
+        }
+        return !m_buffering;
+    }
+    bool started() const { return !m_headers && (m_level > 0 || m_eos); }
+    bool failed() const { return m_failed; }
+    const char* mime() const { return m_mime; }
+    uint32_t level() const { return m_level; }
+    uint32_t underruns() const { return m_underruns; }
+private:
+    // lwip thread: only the answer to the request still waiting is kept
+    static void resolved(const char*, const ip_addr_t* ip, void* request)
+    {
+        if ((uint32_t)(uintptr_t)request != s_dnsRequest) return;
+        s_dnsAddress = ip ? ip->u_addr.ip4.addr : 0;
+        s_dnsDone = true;
+    }
+
+    bool connectTo(uint32_t address)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (fd < 0) return false;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(m_port);
+        addr.sin_addr.s_addr = address;
+        if (::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+            ::close(fd);
+            return false;
+        }
+        m_fd = fd;
+        m_state = CONNECTING;
+        return true;
+    }
+
+    void connecting()
+    {
+        if (m_state == RESOLVING) {
+            if (!s_dnsDone) return;
+            m_failed = s_dnsAddress == 0 || !connectTo(s_dnsAddress);
+            if (m_failed) m_state = CLOSED;
+            return;
+        }
+        if (m_state != CONNECTING) return;
+        fd_set writable;
+        FD_ZERO(&writable);
+        FD_SET(m_fd, &writable);
+        struct timeval timeout = { 0, 0 };
+        int ready = select(m_fd + 1, NULL, &writable, NULL, &timeout);
+        if (ready == 0) return;
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (ready < 0 || getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+            ::close(m_fd);
+            m_state = CLOSED;
+            m_failed = true;
+            return;
+        }
+        // Blocking again as WiFiClient::connect() leaves it, reads only take what is available
+        fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL, 0) & ~O_NONBLOCK);
+        m_client = WiFiClient(m_fd);
+        m_state = OPEN;
+        // HTTP/1.0: no chunked encoding, no ICY metadata interleaved in the audio
+        m_client.print("GET " + m_path + " HTTP/1.0\r\nHost: " + m_host + "\r\nIcy-MetaData: 0\r\nUser-Agent: " FW_TAG "\r\nConnection: close\r\n\r\n");
+    }
+
+    bool allocate()
+    {
+        m_buffer = (uint8_t*)malloc(STREAM_BUFFER_SIZE);
+        m_buffering = true;
+        m_underruns = 0;
+        return m_buffer != NULL;
+    }
+
+    static volatile uint32_t s_dnsRequest;
+    static volatile uint32_t s_dnsAddress;
+    static volatile bool s_dnsDone;
+
+    enum STATE : uint8_t { CLOSED, RESOLVING, CONNECTING, OPEN } m_state = CLOSED;
+    String m_host, m_path;
+    uint16_t m_port = 80;
+    int m_fd = -1;
+    WiFiClient m_client;
+    uint8_t* m_buffer = NULL;
+    size_t m_head = 0, m_tail = 0, m_level = 0;
+    uint32_t m_pos = 0, m_size = 0, m_underruns = 0;
+    bool m_push = false, m_headers = false, m_statusLine = false, m_failed = false, m_eos = false, m_buffering = true;
+    char m_line[128];
+    size_t m_lineLength = 0;
+    char m_mime[32] = "";
+};
+volatile uint32_t AudioFileSourceNetwork::s_dnsRequest = 0;
+volatile uint32_t AudioFileSourceNetwork::s_dnsAddress = 0;
+volatile bool AudioFileSourceNetwork::s_dnsDone = false;
+
+// Wall clock set from KNX time/date telegrams (DPT 10, 11 or 19) and counted on millis() in between
+#define MINUTE_MS   ( 60 * 1000UL )
+#define DAY_MS      ( 24 * 60 * MINUTE_MS )
+#define WEEK_MS     ( 7 * DAY_MS )
+
+struct WallClock
+{
+    // dayOfWeek: 1 = Monday ... 7 = Sunday, 0 = not sent (keep the known day)
+    void setTime(uint8_t dayOfWeek, uint8_t hour, uint8_t minute, uint8_t second)
+    {
+        uint32_t dayTime = ((hour * 60UL + minute) * 60 + second) * 1000;
+        uint8_t day = dayOfWeek;
+        if (day == 0) {
+            day = m_timeKnown ? weekTime() / DAY_MS + 1 : 1;
+        }
+        else {
+            m_dayKnown = true;
+        }
+        m_weekTime = (day - 1) * DAY_MS + dayTime;
+        m_syncTime = millis();
+        m_timeKnown = true;
+    }
+
+    void setDate(uint16_t year, uint8_t month, uint8_t day)
+    {
+        if (month < 1 || month > 12) return;
+        // Sakamoto's method, 0 = Sunday
+        static const uint8_t offsets[] = { 0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4 };
+        if (month < 3) --year;
+        uint8_t dow = (year + year / 4 - year / 100 + year / 400 + offsets[month - 1] + day) % 7;
+        uint32_t dayTime = m_timeKnown ? weekTime() % DAY_MS : 0;
+        m_weekTime = (dow == 0 ? 6 : dow - 1) * DAY_MS + dayTime;
+        m_syncTime = millis();
+        m_dayKnown = true;
+    }
+
+    bool timeKnown() const { return m_timeKnown; }
+    bool dayKnown() const { return m_dayKnown; }
+    // ms since Monday 00:00. The elapsed time is reduced first: added as is, it overflows 32 bits weeks before millis() wraps
+    uint32_t weekTime() const
+    {
+        uint32_t elapsed = millis() - m_syncTime;
+        return (m_weekTime + elapsed % WEEK_MS) % WEEK_MS;
+    }
+  private:
+    uint32_t m_weekTime = 0;
+    uint32_t m_syncTime = 0;
+    bool m_timeKnown = false;
+    bool m_dayKnown = false;
+} wallClock;
+
+// Intercom: RTP (RFC 3550) audio received over UDP unicast or multicast, payload types of RFC 3551:
+// PCMU/PCMA, DVI4 (IMA ADPCM) 8/16 kHz, L16 44.1 kHz and dynamic types as L16 mono at INTERCOM_RATE
+#define INTERCOM_PORT         5004
+#define INTERCOM_RATE         16000
+#define INTERCOM_SLOTS        8         // Jitter buffer packets, power of 2
+#define INTERCOM_MAXSAMPLES   736       // Per packet, 1472 bytes of L16
+#define INTERCOM_MAXPACKET    1500
+#define INTERCOM_TARGET       3         // Packets buffered before playout
+#define INTERCOM_MAXCONCEAL   3         // Lost packets replaced by the faded last one
+#define INTERCOM_TIMEOUT      ( 2 * 1000 )  // ms without packets ending the intercom
+
+class RtpReceiver
+{
+public:
+    ~RtpReceiver() { end(); }
+
+    bool begin(IPAddress group, uint16_t port)
+    {
+        end();
+        m_slots = (Slot*)calloc(INTERCOM_SLOTS, sizeof(Slot));
+        m_packet = (uint8_t*)malloc(INTERCOM_MAXPACKET);
+        if (m_slots == NULL || m_packet == NULL) {
+            end();
+            return false;
+        }
+        bool ok = group[0] >= 224 && group[0] <= 239 ? m_udp.beginMulticast(group, port) : m_udp.begin(port);
+        if (!ok) {
+            end();
+            return false;
+        }
+        m_received = m_lost = m_late = m_concealed = m_underruns = m_drift = 0;
+        m_jitter = m_transit = 0;
+        m_rate = m_index = m_frameSize = m_lastCount = m_conceal = 0;
+        m_synced = m_playing = false;
+        m_lastPacket = millis();
+        return true;
+    }
+
+    void end()
+    {
+        if (m_slots) m_udp.stop();
+        free(m_slots);
+        free(m_packet);
+        m_slots = NULL;
+        m_packet = NULL;
+    }
+    bool active() const { return m_slots != NULL; }
+
+    // Feed the output as far as it accepts samples, false once the sender went silent
+    bool loop(AudioOutput* out)
+    {
+        receive();
+        if (!m_playing) {
+            m_playing = depth() >= INTERCOM_TARGET;
+        }
+        while (m_playing) {
+            if (m_index >= m_frameSize && !nextFrame(out)) break;
+            int16_t sample[2];
+            sample[0] = sample[1] = m_last[m_index];
+            if (!out->ConsumeSample(sample)) break;
+            ++m_index;
+        }
+        return millis() - m_lastPacket < INTERCOM_TIMEOUT;
+    }
+
+    uint32_t received() const { return m_received; }
+    uint32_t lost() const { return m_lost; }
+    uint32_t late() const { return m_late; }
+    uint32_t concealed() const { return m_concealed; }
+    uint32_t underruns() const { return m_underruns; }
+    uint32_t drift() const { return m_drift; }          // Samples dropped or repeated
+    uint32_t jitter() const { return m_rate ? (m_jitter >> 4) * 1000 / m_rate : 0; }   // ms
+    uint32_t latency() const { return m_rate ? depth() * m_lastCount * 1000 / m_rate : 0; }   // Buffered ms
+private:
+    struct Slot {
+        bool valid;
+        uint16_t seq;
+        uint16_t count;
+        uint32_t rate;
+        int16_t samples[INTERCOM_MAXSAMPLES];
+    };
+
+    void receive()
+    {
+        int received;
+        while ((received = m_udp.parsePacket()) > 0) {
+            received = m_udp.read(m_packet, MIN(received, INTERCOM_MAXPACKET));
+            if (received < 12 || (m_packet[0] >> 6) != 2) continue;
+            size_t size = received;
+            size_t header = 12 + 4 * (m_packet[0] & 0x0F);     // CSRC list
+            if (m_packet[0] & 0x10) {  // extension
+                if (header + 4 > size) continue;
+                header += 4 + 4 * ((m_packet[header + 2] << 8) | m_packet[header + 3]);
+            }
+            if (header >= size) continue;
+            if (m_packet[0] & 0x20) {  // padding, the count in the last byte includes itself
+                uint8_t padding = m_packet[size - 1];
+                if (padding == 0 || padding > size - header) continue;
+                size -= padding;
+            }
+            if (header >= size) continue;
+            uint8_t type = m_packet[1] & 0x7F;
+            uint16_t seq = (m_packet[2] << 8) | m_packet[3];
+            uint32_t timestamp = ((uint32_t)m_packet[4] << 24) | ((uint32_t)m_packet[5] << 16) | (m_packet[6] << 8) | m_packet[7];
+            m_lastPacket = millis();
+            ++m_received;
+
+            int16_t offset = seq - m_playSeq;
+            if (!m_synced || offset < -INTERCOM_SLOTS || offset >= INTERCOM_SLOTS) {
+                // New talk spurt or sender restart
+                for (size_t i = 0; i < INTERCOM_SLOTS; ++i) m_slots[i].valid = false;
+                m_playSeq = seq;
+                m_synced = true;
+                m_playing = false;
+                m_index = m_frameSize = 0;
+            }
+            else if (offset < 0) {
+                ++m_late;
+                continue;
+            }
+            Slot& slot = m_slots[seq & (INTERCOM_SLOTS - 1)];
+            if (!decode(type, m_packet + header, size - header, slot)) continue;
+            slot.seq = seq;
+            slot.valid = true;
+
+            // Interarrival jitter, RFC 3550 A.8, modulo 2^32 like the timestamps
+            uint32_t transit = m_lastPacket * (slot.rate / 1000) - timestamp;
+            int32_t d = (int32_t)(transit - m_transit);
+            m_transit = transit;
+            m_jitter += (d < 0 ? 0u - (uint32_t)d : (uint32_t)d) - ((m_jitter + 8) >> 4);
+        }
+    }
+
+    bool decode(uint8_t type, const uint8_t* data, size_t size, Slot& slot)
+    {
+        switch (type) {
+            case 0:     // PCMU
+            case 8: {   // PCMA
+                slot.count = MIN(size, INTERCOM_MAXSAMPLES);
+                for (size_t i = 0; i < slot.count; ++i)
+                    slot.samples[i] = type == 0 ? ulaw(data[i]) : alaw(data[i]);
+                slot.rate = 8000;
+            }; break;
+            case 5:     // DVI4 8 kHz
+            case 6: {   // DVI4 16 kHz
+                if (size < 4) return false;
+                int32_t predicted = (int16_t)((data[0] << 8) | data[1]);
+                int index = MIN(data[2], 88);
+                slot.count = MIN((size - 4) * 2, INTERCOM_MAXSAMPLES);
+                for (size_t i = 0; i < slot.count; ++i) {
+                    static const int8_t indexTable[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+                    uint8_t nibble = i & 1 ? data[4 + i / 2] & 0x0F : data[4 + i / 2] >> 4;
+                    int32_t step = imaStep[index];
+                    int32_t diff = step >> 3;
+                    if (nibble & 4) diff += step;
+                    if (nibble & 2) diff += step >> 1;
+                    if (nibble & 1) diff += step >> 2;
+                    predicted = constrain(nibble & 8 ? predicted - diff : predicted + diff, -32768, 32767);
+                    index = constrain(index + indexTable[nibble & 7], 0, 88);
+                    slot.samples[i] = predicted;
+                }
+                slot.rate = type == 5 ? 8000 : 16000;
+            }; break;
+            case 10: {  // L16 stereo, mixed down
+                slot.count = MIN(size / 4, INTERCOM_MAXSAMPLES);
+                for (size_t i = 0; i < slot.count; ++i)
+                    slot.samples[i] = ((int16_t)((data[4 * i] << 8) | data[4 * i + 1]) + (int16_t)((data[4 * i + 2] << 8) | data[4 * i + 3])) / 2;
+                slot.rate = 44100;
+            }; break;
+            default: {  // 11: L16 mono 44.1 kHz, 96-127: L16 mono INTERCOM_RATE
+                if (type != 11 && type < 96) return false;
+                slot.count = MIN(size / 2, INTERCOM_MAXSAMPLES);
+                for (size_t i = 0; i < slot.count; ++i)
+                    slot.samples[i] = (int16_t)((data[2 * i] << 8) | data[2 * i + 1]);
+                slot.rate = type == 11 ? 44100 : INTERCOM_RATE;
+            }; break;
+        }
+        return slot.count > 0;
+    }
+
+    // Move the next packet to m_last, concealing losses and compensating the sender clock drift
+    bool nextFrame(AudioOutput* out)
+    {
+        Slot& slot = m_slots[m_playSeq & (INTERCOM_SLOTS - 1)];
+        size_t buffered = depth();
+        if (slot.valid && slot.seq == m_playSeq) {
+            slot.valid = false;
+            if (slot.rate != m_rate) {
+                m_rate = slot.rate;
+                out->SetRate(m_rate);
+            }
+            memcpy(m_last, slot.samples, slot.count * sizeof(int16_t));
+            m_lastCount = m_frameSize = slot.count;
+            m_conceal = 0;
+            // Sender faster than us: skip a sample, slower: repeat one
+            if (buffered > INTERCOM_TARGET + 1 && m_frameSize > 1) {
+                --m_frameSize;
+                ++m_drift;
+            }
+            else if (buffered < INTERCOM_TARGET && m_frameSize < INTERCOM_MAXSAMPLES) {
+                m_last[m_frameSize] = m_last[m_frameSize - 1];
+                ++m_frameSize;
+                ++m_drift;
+            }
+        }
+        else if (buffered == 0 && m_conceal >= INTERCOM_MAXCONCEAL) {
+            // Sender paused: rebuffer
+            ++m_underruns;
+            m_playing = false;
+            m_index = m_frameSize = 0;
+            return false;
+        }
+        else {
+            // Lost (or not yet received): replay the last packet, halving its level each time
+            if (buffered) ++m_lost;
+            ++m_concealed;
+            ++m_conceal;
+            for (size_t i = 0; i < m_lastCount; ++i) m_last[i] >>= 1;
+            m_frameSize = m_lastCount;
+        }
+        ++m_playSeq;
+        m_index = 0;
+        return m_frameSize > 0;
+    }
+
+    size_t depth() const
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < INTERCOM_SLOTS; ++i) {
+            n += m_slots[i].valid && (uint16_t)(m_slots[i].seq - m_playSeq) < INTERCOM_SLOTS;
+        }
+        return n;
+    }
+
+    static int16_t ulaw(uint8_t u)
+    {
+        u = ~u;
+        int32_t t = (((u & 0x0F) << 3) + 0x84) << ((u & 0x70) >> 4);
+        return u & 0x80 ? 0x84 - t : t - 0x84;
+    }
+    static int16_t alaw(uint8_t a)
+    {
+        a ^= 0x55;
+        int32_t t = (a & 0x0F) << 4;
+        uint8_t seg = (a & 0x70) >> 4;
+        t += seg ? 0x108 : 8;
+        if (seg > 1) t <<= seg - 1;
+        return a & 0x80 ? t : -t;
+    }
+    static constexpr int16_t imaStep[89] = {
+        7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+        50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+        337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+        2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+        15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767 };
+
+    WiFiUDP m_udp;
+    Slot* m_slots = NULL;
+    uint8_t* m_packet = NULL;
+    int16_t m_last[INTERCOM_MAXSAMPLES + 1];  // Packet being played
+    size_t m_index = 0, m_frameSize = 0, m_lastCount = 0;
+    uint16_t m_playSeq = 0;
+    uint8_t m_conceal = 0;
+    bool m_synced = false, m_playing = false;
+    uint32_t m_rate = 0, m_lastPacket = 0;
+    uint32_t m_transit = 0, m_jitter = 0;
+    uint32_t m_received = 0, m_lost = 0, m_late = 0, m_concealed = 0, m_underruns = 0, m_drift = 0;
+};
+constexpr int16_t RtpReceiver::imaStep[89];
+
+// Synchronised start across units. A shared clock comes from multicast beacons: the lowest chip id heard is the
+// master and the offset is taken from its least delayed recent beacon. The unit receiving a trigger announces a start
+// instant SYNC_DELAY ahead, units triggered for the same bank keep the earliest one: announcements are kept until
+// their instant so a unit whose own trigger comes later still adopts it.
+#define SYNC_GROUP          IPAddress(239, 255, 12, 34)
+#define SYNC_PORT           5005
+#define SYNC_MAGIC          0x59534244      // "DBSY"
+#define SYNC_BEACON         1000            // ms
+#define SYNC_MASTER_TIMEOUT ( 5 * SYNC_BEACON )
+#define SYNC_SAMPLES        8               // Beacons kept for the offset estimate
+#define SYNC_DELAY          200             // ms between trigger and first sample
+#define SYNC_SETTLE         1000            // ms before the drift baseline is taken (DMA filled)
+#define SYNC_CHECK          100             // ms between drift corrections
+#define SYNC_TOLERANCE      500             // us of drift before a sample is dropped or repeated
+
+struct SyncClock
+{
+    struct Packet {
+        uint32_t magic;
+        uint8_t type;
+        uint8_t bank;
+        uint16_t reserved;
+        uint32_t id;
+        int64_t time;       // Shared clock, us
+    } __attribute__((packed));
+    enum { BEACON, PLAY };
+
+    void begin()
+    {
+        if (m_active) return;
+        m_active = m_udp.beginMulticast(SYNC_GROUP, SYNC_PORT);
+        m_id = (uint32_t)(ESP.getEfuseMac() >> 24);     // NIC specific bytes: boards of a batch share the OUI and MAC[3]
+        master(m_id);
+    }
+    void end()
+    {
+        if (!m_active) return;
+        m_udp.stop();
+        m_active = false;
+        master(m_id);
+    }
+    bool active() const { return m_active; }
+
+    int64_t now() const { return esp_timer_get_time() + m_offset; }
+    int64_t toLocal(int64_t shared) const { return shared - m_offset; }
+    void announce(uint8_t bank, int64_t start) { send(PLAY, bank, start); }
+    // Earliest start announced by another unit for this bank and not reached yet, 0 = none
+    int64_t pending(uint8_t bank) const
+    {
+        if (bank < 1 || bank > NBBANKS) return 0;
+        int64_t start = m_pending[bank - 1];
+        return start > now() ? start : 0;
+    }
+
+    // onPlay(bank, start) for announcements of other units
+    template<typename F>
+    void loop(F onPlay)
+    {
+        if (!m_active) return;
+        uint32_t time = millis();
+        if (time - m_beaconTime >= SYNC_BEACON) {
+            m_beaconTime = time;
+            send(BEACON, 0, now());
+        }
+        if (m_master != m_id && time - m_masterTime > SYNC_MASTER_TIMEOUT) {
+            master(m_id);
+        }
+        Packet p;
+        while (m_udp.parsePacket() > 0) {
+            int64_t received = esp_timer_get_time();
+            if (m_udp.read((uint8_t*)&p, sizeof(p)) != sizeof(p) || p.magic != SYNC_MAGIC || p.id == m_id) continue;
+            if (p.type == PLAY) {
+                // Further ahead than announced starts can be is not an announcement of the same trigger
+                if (p.bank >= 1 && p.bank <= NBBANKS && p.time - now() <= 2 * SYNC_DELAY * 1000LL) {
+                    int64_t& pending = m_pending[p.bank - 1];
+                    if (pending <= now() || p.time < pending) pending = p.time;
+                }
+                onPlay(p.bank, p.time);
+            }
+            else if (p.type == BEACON && p.id <= m_master) {
+                if (p.id < m_master) master(p.id);
+                m_masterTime = time;
+                // Beacon time minus reception = offset minus network delay: the largest is the least delayed
+                m_samples[m_sample % SYNC_SAMPLES] = p.time - received;
+                m_sample = (m_sample + 1) % (2 * SYNC_SAMPLES);
+                if (m_sample == 0) m_sample = SYNC_SAMPLES;     // Ring full, keep the count saturated
+                int64_t best = INT64_MIN;
+                for (uint8_t i = 0; i < MIN(m_sample, (uint8_t)SYNC_SAMPLES); ++i) best = MAX(best, m_samples[i]);
+                m_offset = best;
+            }
+        }
+    }
+
+    bool isMaster() const { return m_master == m_id; }
+    uint32_t masterId() const { return m_master; }
+    int64_t offset() const { return m_offset; }
+  private:
+    void master(uint32_t id)
+    {
+        m_master = id;
+        m_sample = 0;
+        m_offset = 0;
+        m_masterTime = millis();
+        memset(m_pending, 0, sizeof(m_pending));   // Instants of the previous clock
+    }
+    void send(uint8_t type, uint8_t bank, int64_t time)
+    {
+        Packet p = { SYNC_MAGIC, type, bank, 0, m_id, time };
+        m_udp.beginMulticastPacket();
+        m_udp.write((const uint8_t*)&p, sizeof(p));
+        m_udp.endPacket();
+    }
+
+    WiFiUDP m_udp;
+    bool m_active = false;
+    uint32_t m_id = 0, m_master = 0;
+    uint32_t m_beaconTime = 0, m_masterTime = 0;
+    int64_t m_samples[SYNC_SAMPLES];
+    uint8_t m_sample = 0;
+    int64_t m_offset = 0;
+    int64_t m_pending[NBBANKS] = {};
+} syncClock;
+
+// Time window capping the volume and remapping banks, first enabled match wins
+#define NBPROFILES          4
+#define PROFILE_MAXREMAP    4
+#define PROFILE_ALLDAYS     0x7F
+
+struct Profile
+{
+    uint8_t days;                           // Bit 0 = Monday ... bit 6 = Sunday, 0 = disabled
+    uint16_t start;                         // Minute of the day
+    uint16_t end;                           // Minute of the day, before start spans midnight, equal = all day
+    uint8_t volume;                         // Cap in %
+    uint8_t remap[PROFILE_MAXREMAP][2];     // Requested bank, played bank (0 = unused)
+};
+
+struct Player
+{
+    enum { GO_PLAYSTOP, GO_PAUSERESUME, GO_VOLUME, GO_BLOCK, GO_PLAYING, GO_PLAYINGCHANNEL, GO_BANK, NBGO = GO_BANK + NBBANKS };
+    enum FORMAT : uint8_t { UNKNOWN = (uint8_t)-1, NO_FILE = 0, MP3, AAC, FLAC, WAV, MOD, MIDI };
+    struct Format {
+        FORMAT id;
+        const char* mime;
+        uint8_t cpuFreq;
+        AudioGenerator* (*create)(AudioFileSource*& aux);
+    };
+    struct Magic {
+        FORMAT id;
+        uint16_t offset;
+        uint8_t length;
+        const char* bytes;
+    };
+#define FORMAT_ENTRY(id, ext, mime, freq)   { id, mime, freq, &create##id },
+#define MAGIC_ENTRY(id, offset, bytes)      { id, offset, sizeof(bytes) - 1, bytes },
+    static constexpr Format formats[] = { AUDIO_FORMATS(FORMAT_ENTRY, FORMAT_NONE) };
+    static constexpr Magic magics[] = { AUDIO_FORMATS(FORMAT_NONE, MAGIC_ENTRY) };
+#undef FORMAT_ENTRY
+#undef MAGIC_ENTRY
+
+    static bool matchMagic(const Magic& m, const char* data)
+    {
+        uint8_t i = 0;
+        while (i < m.length && (m.bytes[i] == '?' || m.bytes[i] == data[i])) ++i;
+        return i == m.length;
+    }
+
+    // Stream format from its MIME type or its first bytes
+    static FORMAT detect(const char* mime, const uint8_t* data, size_t size)
+    {
+        for (const Format& f : formats) {
+            if (strcasecmp(mime, f.mime) == 0) return f.id;
+        }
+        for (const Magic& m : magics) {
+            if (m.offset + m.length <= size && matchMagic(m, (const char*)data + m.offset)) return m.id;
+        }
+        return UNKNOWN;
+    }
+
+    static const Format* formatInfo(FORMAT format)
+    {
+        for (const Format& f : formats) {
+            if (f.id == format) return &f;
+        }
+        return NULL;
+    }
+
+    void init(uint16_t pinNb, uint16_t mutePinNb)
+    {
+        m_mutePin = mutePinNb;
+        pinMode(m_mutePin, OUTPUT);
+        digitalWrite(m_mutePin, HIGH);
+        m_out.SetOutputModeMono(true);
+
+        loadConfig();
+    }
+
+    void loadConfig()
+    {
+        memset(&m_content, 0, sizeof(m_content));
+        m_content.volume = 100;
+        m_contentCrc = 0;
+        File f = SPIFFS.open(META_PATH, FILE_READ);
+        if (f.available() && f.read((uint8_t*)&m_content, sizeof(m_content)) == sizeof(m_content)) {
+            m_contentCrc = crc32_le(0, (const uint8_t*)&m_content, sizeof(m_content));
+        }
+        f.close();
+        for (int i = 0; i < outputCount; ++i) {
+            if (!Output::validPattern(m_content.outputSync[i]) || m_content.outputSync[i] == PATTERN_CUSTOM)
+                m_content.outputSync[i] = 0;    // saved by older firmware
+        }
+        m_profile = NULL;
+        schedule();
+        m_out.setVolume(effectiveVolume(), false);
+        m_out.setOptions(m_content.dsp);
+    }
+
+    void initKNX(int baseAddr, uint16_t baseGO)
+    {
+        for (uint8_t i = 0; i < NBGO; ++i) {
+            m_GO[i] = &knx.getGroupObject(baseGO + i);
+            m_GO[i]->dataPointType(DPT_Switch);
+        }
+        m_GO[GO_PLAYSTOP]->dataPointType(DPT_Value_1_Ucount);
+        m_GO[GO_VOLUME]->dataPointType(DPT_Scaling);
+        m_GO[GO_PLAYINGCHANNEL]->dataPointType(DPT_Value_1_Ucount);
+    }
+
+    // Telegram on the GO_PLAYSTOP + index object
+    void telegram(uint8_t index, GroupObject& go)
+    {
+        switch (index) {
+            case GO_PLAYSTOP: {
+                uint8_t value = go.value();
+                if (value == 0) m_action = STOP;
+                else if (!m_blocked) play(value);
+                break;
+            }
+            case GO_PAUSERESUME:
+                if (go.value()) m_action = PAUSE;
+                else if (!m_blocked) m_action = RESUME;
+                break;
+            case GO_VOLUME:
+                setVolume(go.value());
+                break;
+            case GO_BLOCK:
+                m_blocked = go.value();
+                break;
+            default:
+                if (index >= GO_BANK && index < NBGO) {
+                    if (go.value()) play(index - GO_BANK + 1);
+                    else m_action = STOP;
+                }
+                break;
+        }
+    }
+
+    void play(int bank) {
+        if (m_profile) {
+            for (const auto& map : m_profile->remap) {
+                if (map[0] && map[0] == bank) {
+                    bank = map[1];
+                    break;
+                }
+            }
+        }
+        if (pathFromChannel(bank)) {
+            m_action = PLAY;
+            m_playingChannel = bank;
+        }
+    }
+
+    void pauseResume() {
+        if (m_player && m_action != STOPPING) m_action = (m_action==PAUSE || m_action==PAUSED)?RESUME:PAUSE;
+    }
+
+    void stop() {
+        cancelBenchmark();
+        if (!idle()) m_action = STOP;
+    }
+    // Immediate stop, before bank files are rewritten
+    void abort() {
+        clear();
+    }
+    int playingBank() const {
+        return m_playingChannel;
+    }
+    bool idle() const {
+        return m_player == NULL && m_action == NONE && m_bench.channel == 0;
+    }
+
+    FORMAT format(int bank) const {
+        if (pathFromChannel(bank)) {
+            return m_content.bank[bank - 1].format;
+        }
+        return NO_FILE;
+    }
+
+    // CPU frequency needed to decode the bank in real time
+    uint8_t cpuFreq(uint32_t channel) const {
+        if (pathFromChannel(channel) == NULL) return IDLE_CPU_FREQ;
+        if (m_content.cpuFreq[channel - 1]) return m_content.cpuFreq[channel - 1];
+        const Format* f = formatInfo(m_content.bank[channel - 1].format);
+        return f ? f->cpuFreq : PLAY_CPU_FREQ;
+    }
+
+    // Queue the decoding benchmark of a bank, run from loop() in slices while nothing plays
+    bool benchmark(uint32_t channel) {
+        if (pathFromChannel(channel) == NULL) return false;
+        cancelBenchmark();
+        m_bench.channel = channel;
+        return true;
+    }
+    // Pending for this bank (any bank when 0)
+    bool benchmarking(uint32_t channel = 0) const {
+        return m_bench.channel && (channel == 0 || channel == m_bench.channel);
+    }
+    void cancelBenchmark(uint32_t channel = 0)
+    {
+        if (!benchmarking(channel)) return;
+        benchStop();
+        m_bench.channel = 0;
+        m_bench.step = 0;
+    }
+
+    uint8_t volume() const { return m_content.volume; }
+    uint8_t dspOptions() const { return m_content.dsp; }
+    void setDspOptions(uint8_t options)
+    {
+        m_content.dsp = options;
+        m_out.setOptions(options);
+        flushConfig();
+    }
+    uint32_t limited() const { return m_out.limited(); }
+    uint32_t dspCyclesAvg() const { return m_out.cyclesAvg(); }
+    uint32_t dspCyclesMax() const { return m_out.cyclesMax(); }
+    uint32_t configWrites() const { return m_configWrites; }
+    void setVolume(uint8_t value)
+    {
+        if (m_GO[GO_VOLUME])
+            m_GO[GO_VOLUME]->value(value);
+        _setVolume(value);
+    }
+    void setVolume(const KNXValue& value)
+    {
+        _setVolume((uint8_t)value);
+    }
+
+    FORMAT autodetect(uint32_t channel = UINT32_MAX) {
+        const char* path = pathFromChannel(channel);
+        if (path == NULL) return NO_FILE;
+        FORMAT format = UNKNOWN;
+        File f = SPIFFS.open(path, FILE_READ);
+        if (f.available()) {
+            char header[12];
+            size_t headerSize = f.readBytes(header, sizeof(header));
+            for (const Magic& m : magics) {
+                char buffer[sizeof(header)];
+                const char* data = buffer;
+                if (m.offset + m.length <= headerSize) {
+                    data = header + m.offset;
+                }
+                else if (!f.seek(m.offset, SeekSet) || f.readBytes(buffer, m.length) != m.length) {
+                    continue;
+                }
+                if (matchMagic(m, data)) {
+                    format = m.id;
+                    break;
+                }
+            }
+        }
+        else {
+            format = NO_FILE;
+        }
+        f.close();
+        return format;
+    }
+    String channelName(uint32_t channel)
+    {
+        if (pathFromChannel(channel) == NULL) return String();
+        String n;
+        n.reserve(BANK_MAXNAMESIZE);
+        char * p = m_content.bank[channel - 1].name;
+        for (int i = 0; i < BANK_MAXNAMESIZE && *p; ++i, ++p) 
+            n += *p;
+        return n;
+    }
+    void setChannelName(uint32_t channel, String name, FORMAT format)
+    {
+        if (pathFromChannel(channel) == NULL) return;
+        m_content.bank[channel - 1].name[0] = 0;
+        strncpy(m_content.bank[channel - 1].name, name.c_str(), BANK_MAXNAMESIZE);
+        m_content.bank[channel - 1].name[MIN(BANK_MAXNAMESIZE - 1, name.length())] = 0;
+        m_content.bank[channel - 1].format = format;
+        m_content.cpuFreq[channel - 1] = 0;
+        m_content.hash[channel - 1] = 0;
+    }
+
+    // CRC-32 of the bank file, computed once if the upload did not provide it
+    uint32_t hash(uint32_t channel)
+    {
+        const char* path = pathFromChannel(channel);
+        if (path == NULL) return 0;
+        if (m_content.hash[channel - 1] == 0) {
+            File f = SPIFFS.open(path, FILE_READ);
+            if (!f) return 0;
+            uint8_t buffer[512];
+            uint32_t crc = 0;
+            size_t n;
+            while ((n = f.read(buffer, sizeof(buffer))) > 0) crc = crc32_le(crc, buffer, n);
+            f.close();
+            m_content.hash[channel - 1] = crc;
+            flushConfig();
+        }
+        return m_content.hash[channel - 1];
+    }
+    void setHash(uint32_t channel, uint32_t crc)
+    {
+        if (pathFromChannel(channel)) m_content.hash[channel - 1] = crc;
+    }
+    uint8_t outputSync(int id) const { return m_content.outputSync[id]; }
+    // The custom pattern lives in RAM only: it cannot follow the player across a reboot
+    bool setOutputSync(int id, uint8_t pattern)
+    {
+        if (!Output::validPattern(pattern) || pattern == PATTERN_CUSTOM)
+            return false;
+        m_content.outputSync[id] = pattern;
+        flushConfig();
+        if (m_player && m_player->isRunning() && knx.configured()) {
+            output[id].pattern(pattern);
+        }
+        return true;
+    }
+    // Unchanged content is not rewritten: every write wears the flash
+    static size_t configSize() { return sizeof(m_content); }
+    void flushConfig()
+    {
+        uint32_t crc = crc32_le(0, (const uint8_t*)&m_content, sizeof(m_content));
+        if (crc == m_contentCrc)
+            return;
+        File f = SPIFFS.open(META_PATH, FILE_WRITE);
+        size_t written = f.write((uint8_t*)&m_content, sizeof(m_content));
+        f.close();
+        if (written != sizeof(m_content))
+            return;     // Flash full: the CRC still differs, the next flush writes again
+        m_contentCrc = crc;
+        ++m_configWrites;
+    }
+    static const char* pathFromChannel(uint32_t channel)
+    {
+        static const __FlashStringHelper* Banks[] = { F("/bank_1"), F("/bank_2"), F("/bank_3"), F("/bank_4"),
+            F("/bank_5"), F("/bank_6"), F("/bank_7"), F("/bank_8"),
+            F("/bank_9"), F("/bank_10"), F("/bank_11"), F("/bank_12"),
+            F("/bank_13"), F("/bank_14"), F("/bank_15"), F("/bank_16"),
+            F("/bank_17"), F("/bank_18"), F("/bank_19"), F("/bank_20"),
+            F("/bank_21"), F("/bank_22"), F("/bank_23"), F("/bank_24"),
+            F("/bank_25"), F("/bank_26"), F("/bank_27"), F("/bank_28"),
+            F("/bank_29"), F("/bank_30"), F("/bank_31"), F("/bank_32") };
+        if (channel == 0 || channel > sizeof(Banks)/sizeof(Banks[0])) {
+            return NULL;
+        }
+        return (const char*)Banks[channel - 1];
+    }
+    void removeChannel(uint32_t channel)
+    {
+        const char* path = pathFromChannel(channel);
+        if (path) {
+            cancelBenchmark(channel);
+            setChannelName(channel, String(), NO_FILE);
+            SPIFFS.remove(path);
+            flushConfig();
+        }
+    }
+
+    void clean()
+    {
+        cancelBenchmark();
+        clear();
+        memset(&m_content, 0, sizeof(m_content));
+        m_contentCrc = 0;       // /meta is gone with the format, even when the defaults match it
+        m_profile = NULL;
+        m_content.volume = 100;
+    }
+#ifdef ENABLE_MIDI
+    bool hasSoundFont() const
+    {
+        return SPIFFS.exists(SOUNDFONT_PATH);
+    }
+#endif
+    AudioGenerator* audioGeneratorbuilder(uint32_t channel)
+    {
+        if (pathFromChannel(channel) == NULL) {
+            return NULL;
+        }
+        return audioGeneratorbuilder(m_content.bank[channel - 1].format);
+    }
+    AudioGenerator* audioGeneratorbuilder(FORMAT format)
+    {
+        const Format* f = formatInfo(format);
+        return f ? f->create(m_sf2) : NULL;
+    }
+
+    // url: NULL when data is pushed through stream()
+    bool playStream(const char* url)
+    {
+        clear();
+        m_stream = new AudioFileSourceNetwork();
+        if (!(url ? m_stream->open(url) : m_stream->openPush())) {
+            clear();
+            return false;
+        }
+        m_file = m_stream;
+        m_streamTime = millis();
+        m_action = PREFETCH;
+        return true;
+    }
+    AudioFileSourceNetwork* stream() const { return m_stream; }
+    String streamUrl() const { return String(m_content.streamUrl); }
+    void setStreamUrl(const String& url)
+    {
+        strncpy(m_content.streamUrl, url.c_str(), STREAM_MAXURLSIZE - 1);
+        m_content.streamUrl[STREAM_MAXURLSIZE - 1] = 0;
+        flushConfig();
+    }
+
+    // Live audio from the door station, see RtpReceiver
+    bool intercom(bool on)
+    {
+        if (!on) {
+            if (m_rtp.active()) m_action = STOP;
+            return true;
+        }
+        clear();
+        if (!m_rtp.begin(IPAddress(m_content.intercomGroup), m_content.intercomPort ? m_content.intercomPort : INTERCOM_PORT))
+            return false;
+        power.lock(PLAY_CPU_FREQ);
+        WiFi.setSleep(false);   // Modem sleep delays multicast delivery
+        m_out.fadeIn();
+        m_out.begin();
+        digitalWrite(m_mutePin, LOW);
+        m_action = INTERCOM;
+        notify(true);
+        return true;
+    }
+    const RtpReceiver& rtp() const { return m_rtp; }
+    IPAddress intercomGroup() const { return IPAddress(m_content.intercomGroup); }
+    uint16_t intercomPort() const { return m_content.intercomPort ? m_content.intercomPort : INTERCOM_PORT; }
+    void setIntercom(IPAddress group, uint16_t port)
+    {
+        m_content.intercomGroup = group;
+        m_content.intercomPort = port;
+        flushConfig();
+    }
+
+    void initKNXIntercom(uint16_t goIntercom)
+    {
+        m_goIntercom = &knx.getGroupObject(goIntercom);
+        m_goIntercom->dataPointType(DPT_Switch);
+    }
+    void intercomTelegram(GroupObject& go)
+    {
+        if (!go.value()) intercom(false);
+        else if (!m_blocked) m_action = START_INTERCOM;
+    }
+
+    // DPT 10.001 time of day, DPT 11.001 date, DPT 19.001 date and time
+    void initKNXClock(uint16_t goTime, uint16_t goDate, uint16_t goDateTime)
+    {
+        m_goTime = &knx.getGroupObject(goTime);
+        m_goTime->dataPointType(DPT_TimeOfDay);
+        knx.getGroupObject(goDate).dataPointType(DPT_Date);
+        knx.getGroupObject(goDateTime).dataPointType(DPT_DateTime);
+    }
+    void timeTelegram(GroupObject& go)
+    {
+        const uint8_t* v = go.valueRef();
+        wallClock.setTime(v[0] >> 5, v[0] & 0x1F, v[1] & 0x3F, v[2] & 0x3F);
+        schedule();
+    }
+    void dateTelegram(GroupObject& go)
+    {
+        const uint8_t* v = go.valueRef();
+        uint8_t year = v[2] & 0x7F;
+        wallClock.setDate(year < 90 ? 2000 + year : 1900 + year, v[1] & 0x0F, v[0] & 0x1F);
+        schedule();
+    }
+    void dateTimeTelegram(GroupObject& go)
+    {
+        const uint8_t* v = go.valueRef();
+        // Flags: fault, no year, no date, no day of week, no time
+        if (v[6] & 0x80) return;
+        if (!(v[6] & 0x02))
+            wallClock.setTime(v[6] & 0x04 ? 0 : v[3] >> 5, v[3] & 0x1F, v[4] & 0x3F, v[5] & 0x3F);
+        if (!(v[6] & 0x18))
+            wallClock.setDate(1900 + v[0], v[1] & 0x0F, v[2] & 0x1F);
+        schedule();
+    }
+    void requestTime()
+    {
+        if (m_goTime) m_goTime->requestObjectRead();
+    }
+
+    const Profile& profile(uint8_t id) const { return m_content.profiles[id]; }
+    void setProfile(uint8_t id, const Profile& profile)
+    {
+        m_content.profiles[id] = profile;
+        flushConfig();
+        schedule();
+    }
+    // 1-based, 0 = none
+    uint8_t activeProfile() const { return m_profile ? m_profile - m_content.profiles + 1 : 0; }
+    uint8_t effectiveVolume() const { return m_profile ? MIN(m_content.volume, m_profile->volume) : m_content.volume; }
+
+    void initKNXStream(uint16_t goStream)
+    {
+        knx.getGroupObject(goStream).dataPointType(DPT_Switch);
+    }
+    void streamTelegram(GroupObject& go)
+    {
+        if (!go.value()) m_action = STOP;
+        else if (!m_blocked && m_content.streamUrl[0]) m_action = PLAY_STREAM;
+    }
+
+    void loop()
+    {
+        if (m_profileDeadline && (int32_t)(millis() - m_profileDeadline) >= 0) {
+            schedule();
+        }
+        if (m_content.sync) {
+            syncClock.loop([this](uint8_t bank, int64_t start) {
+                // Same bank triggered here and not started yet: keep the earliest instant
+                if (m_syncStart && bank == m_playingChannel && start < m_syncStart && m_out.holding()) {
+                    m_syncStart = start;
+                    m_out.holdUntil(syncClock.toLocal(start));
+                }
+              });
+            syncDrift();
+        }
+        if (m_bench.channel) {
+            benchLoop();
+        }
+        if (m_action != m_loggedAction) {
+            diag.log(DIAG_PLAYER, m_action, m_playingChannel);
+            m_loggedAction = m_action;
+        }
+        // Volume changes come in bursts (slider, dimming telegrams): write flash once they settle
+        if (m_flushDeadline && (int32_t)(millis() - m_flushDeadline) >= 0) {
+            flushConfig();
+            m_flushDeadline = 0;
+        }
+        switch (m_action) {
+            case PLAY: {
+                uint32_t channel = m_playingChannel;
+                clear();
+                const char* path = pathFromChannel(channel);
                 if (path) {
                     m_file = new AudioFileSourceSPIFFS(path);
                     if (m_file) {
                         m_player = audioGeneratorbuilder(channel);
                         if (m_player) {
+                            power.lock(cpuFreq(channel));
+                            m_out.fadeIn();
+                            syncStart(channel);
                             if (m_player->begin(m_file, &m_out)) {
-                                if (knx.configured()) {
-                                    knx.getGroupObject(m_GO.playingChannel).value(channel);
-                                    knx.getGroupObject(m_GO.play[channel - 1]).value(true);
-                                    knx.getGroupObject(m_GO.playing).value(true);
-                                }
-                                digitalWrite(m_mutePin, LOW);
+                                power.played();
                                 m_playingChannel = channel;
+                                notify(true);
+                                digitalWrite(m_mutePin, LOW);
+                                syncOutputs(true);
                             }
                             else {
                                 clear();
@@ -451,111 +2461,892 @@ struct Player
                     m_action = NONE;
                 }
             }; break;
+            case START_INTERCOM: {
+                if (!intercom(true)) m_action = NONE;
+            }; break;
+            case INTERCOM: {
+                if (!m_rtp.loop(&m_out)) {
+                    notify(false);
+                    clear();
+                }
+            }; break;
+            case PLAY_STREAM: {
+                playStream(m_content.streamUrl);
+            }; break;
+            case PREFETCH: {
+                prefetch();
+            }; break;
             case STOP: {
                 if (m_player && m_player->isRunning()) {
-                    if (knx.configured()) {
-                        knx.getGroupObject(m_GO.playing).value(false);
-                        knx.getGroupObject(m_GO.play[m_playingChannel - 1]).value(false);
-                        knx.getGroupObject(m_GO.playingChannel).value(0);
-                    }
-                    m_player->stop();
+                    notify(false);
+                    m_out.fadeOut();
+                    m_action = STOPPING;
+                    break;
+                }
+                else if (m_file || m_rtp.active()) {
+                    notify(false);
                     clear();
                 }
                 m_action = NONE;
             }; break;
+            case STOPPING: {
+                // Decoding continues until faded out
+                if (m_out.silent() || !m_player->isRunning()) {
+                    m_player->stop();
+                    clear();
+                }
+            }; break;
             case PAUSE: {
+                m_syncStart = 0;    // Alignment is lost
                 if (m_player && m_player->isRunning()) {
-                    if (knx.configured()) {
-                        knx.getGroupObject(m_GO.playing).value(false);
-                        knx.getGroupObject(m_GO.play[m_playingChannel - 1]).value(false);
-                    }
-                    digitalWrite(m_mutePin, HIGH);
+                    notify(false, true);
+                    m_out.fadeOut();
+                    m_action = PAUSED;
+                }
+                else {
+                    m_action = NONE;
                 }
             }; break;
+            case PAUSED: {
+                if (m_out.silent())
+                    digitalWrite(m_mutePin, HIGH);
+            }; break;
             case RESUME: {
                 if (m_player && m_player->isRunning()) {
-                    if (knx.configured()) {
-                        knx.getGroupObject(m_GO.playing).value(true);
-                        knx.getGroupObject(m_GO.play[m_playingChannel - 1]).value(true);
-                    }
+                    notify(true, true);
                     digitalWrite(m_mutePin, LOW);
+                    m_out.fadeIn();
                 }
                 m_action = NONE;
             }; break;
             case NONE: default: break;
         }
-        if (m_player && m_player->isRunning() && m_action != PAUSE) {
-            if (!m_player->loop()) {
-                if (knx.configured()) {
-                    knx.getGroupObject(m_GO.playing).value(false);
-                    knx.getGroupObject(m_GO.play[m_playingChannel - 1]).value(false);
-                    knx.getGroupObject(m_GO.playingChannel).value(0);
+        if (m_stream && m_player) {
+            m_stream->loop();
+        }
+        decode();
+    }
+
+    // Pushed stream data does not fit: decode from the upload handler, without the rest of loop().
+    // False when nothing consumes the buffer (paused, failed, or stopped).
+    bool pump()
+    {
+        if (m_stream == NULL)
+            return false;
+        if (m_action == PREFETCH)
+            prefetch();
+        return decode();
+    }
+
+    bool syncEnabled() const { return m_content.sync; }
+    void setSync(bool enable)
+    {
+        m_content.sync = enable;
+        flushConfig();
+    }
+    int32_t syncError() const { return m_syncError; }
+    int32_t syncErrorMax() const { return m_syncErrorMax; }
+
+  private:
+    // Stream buffered: detect the format and start decoding
+    void prefetch()
+    {
+        m_stream->loop();
+        if (m_stream->failed() || millis() - m_streamTime > STREAM_TIMEOUT) {
+            clear();
+        }
+        else if (m_stream->started() && m_stream->ready()) {
+            uint8_t header[12];
+            size_t size = m_stream->peek(header, sizeof(header));
+            FORMAT format = detect(m_stream->mime(), header, size);
+            m_player = audioGeneratorbuilder(format);
+            const Format* f = formatInfo(format);
+            if (m_player && f) {
+                power.lock(f->cpuFreq);
+                m_out.fadeIn();
+                if (m_player->begin(m_file, &m_out)) {
+                    power.played();
+                    m_playingChannel = 0;
+                    notify(true);
+                    digitalWrite(m_mutePin, LOW);
+                    syncOutputs(true);
+                    m_action = NONE;
+                    return;
                 }
+            }
+            clear();
+        }
+    }
+
+    // True while decoding
+    bool decode()
+    {
+        if (m_player && m_player->isRunning() && !(m_action == PAUSED && m_out.silent()) && (m_stream == NULL || m_stream->ready())) {
+            if (!m_player->loop()) {
+                notify(false);
                 m_player->stop();
                 clear();
+                return false;
+            }
+            return m_action != PAUSED && m_action != STOPPING;
+        }
+        return false;
+    }
+
+    void syncStart(uint8_t channel)
+    {
+        m_syncStart = 0;
+        m_syncBaseline = INT32_MIN;
+        if (!m_content.sync || !syncClock.active()) return;
+        // Another unit triggered first: join its start instead of announcing a later one it would ignore
+        m_syncStart = syncClock.pending(channel);
+        if (m_syncStart == 0) {
+            m_syncStart = syncClock.now() + SYNC_DELAY * 1000LL;
+            syncClock.announce(channel, m_syncStart);
+        }
+        m_out.holdUntil(syncClock.toLocal(m_syncStart));
+        m_syncCheck = millis();
+    }
+
+    // Samples consumed against the shared clock since the start, relative to the value once the DMA is filled
+    void syncDrift()
+    {
+        if (m_syncStart == 0 || m_player == NULL || m_out.holding() || m_out.rate() == 0 || millis() - m_syncCheck < SYNC_CHECK)
+            return;
+        m_syncCheck = millis();
+        int64_t elapsed = syncClock.now() - m_syncStart;
+        int32_t error = (int32_t)((int64_t)m_out.consumed() * 1000000 / m_out.rate() - elapsed);   // us ahead
+        if (m_syncBaseline == INT32_MIN) {
+            if (elapsed > SYNC_SETTLE * 1000LL) m_syncBaseline = error;
+            return;
+        }
+        m_syncError = error - m_syncBaseline;
+        m_syncErrorMax = MAX(m_syncErrorMax, abs(m_syncError));
+        if (m_syncError > SYNC_TOLERANCE) m_out.adjust(1);
+        else if (m_syncError < -SYNC_TOLERANCE) m_out.adjust(-1);
+    }
+
+    // Select the active profile and the time of the next window start or end, so the loop only checks one deadline
+    void schedule()
+    {
+        const Profile* active = NULL;
+        uint32_t next = WEEK_MS;
+        if (wallClock.timeKnown()) {
+            uint32_t now = wallClock.weekTime();
+            for (const Profile& p : m_content.profiles) {
+                if (p.days == 0 || (!wallClock.dayKnown() && p.days != PROFILE_ALLDAYS))
+                    continue;
+                uint32_t length = ((p.end + 24 * 60 - p.start) % (24 * 60)) * MINUTE_MS;
+                if (length == 0) length = DAY_MS;
+                for (uint8_t day = 0; day < 7; ++day) {
+                    if (!(p.days & (1 << day)))
+                        continue;
+                    uint32_t since = (now + WEEK_MS - (day * DAY_MS + p.start * MINUTE_MS)) % WEEK_MS;
+                    if (since < length) {
+                        if (active == NULL) active = &p;
+                        next = MIN(next, length - since);
+                    }
+                    else {
+                        next = MIN(next, WEEK_MS - since);
+                    }
+                }
+            }
+            m_profileDeadline = (millis() + next) | 1;
+        }
+        else {
+            m_profileDeadline = 0;
+        }
+        if (active != m_profile) {
+            m_profile = active;
+            m_out.setVolume(effectiveVolume());
+        }
+    }
+
+    // Publish playing status, channel status only for banks
+    void notify(bool playing, bool paused = false)
+    {
+        if (m_GO[GO_PLAYING] == NULL)
+            return;
+        if (!paused) {
+            m_GO[GO_PLAYINGCHANNEL]->value(playing ? m_playingChannel : 0);
+        }
+        if (m_playingChannel > 0) {
+            m_GO[GO_BANK + m_playingChannel - 1]->value(playing);
+        }
+        m_GO[GO_PLAYING]->value(playing);
+    }
+
+    // Decode the bank at increasing CPU frequencies and keep the lowest one sustaining real time.
+    // One slice per call: only the time spent decoding counts, playback requests take over at once.
+    void benchLoop()
+    {
+        static const uint8_t freqs[] = { IDLE_CPU_FREQ, PLAY_CPU_FREQ, MAX_CPU_FREQ };
+        if (m_player || m_action != NONE) {
+            if (m_bench.generator) {
+                benchStop();    // Playback first, measured again from the first frequency once idle
+                m_bench.step = 0;
+            }
+            return;
+        }
+        const char* path = pathFromChannel(m_bench.channel);
+        if (path == NULL) {
+            cancelBenchmark();
+            return;
+        }
+        bool running = true;
+        if (m_bench.generator == NULL) {
+            power.lock(freqs[m_bench.step]);
+            m_bench.elapsed = 0;
+            m_bench.file = new AudioFileSourceSPIFFS(path);
+            m_bench.generator = audioGeneratorbuilder(m_bench.channel);
+            running = m_bench.file && m_bench.generator && m_bench.generator->begin(m_bench.file, &m_bench.counter);
+        }
+        uint32_t start = millis();
+        while (running && millis() - start < BENCH_SLICE) {
+            running = m_bench.generator->loop();
+        }
+        m_bench.elapsed += millis() - start;
+        if (running && m_bench.elapsed < BENCH_TIME)
+            return;
+        // Decoding speed in % of real time
+        uint32_t ratio = m_bench.counter.rate() ? (uint64_t)m_bench.counter.samples() * 100 * 1000 / m_bench.counter.rate() / MAX(m_bench.elapsed, 1) : 0;
+        benchStop();
+        if (ratio >= BENCH_MARGIN || ++m_bench.step == sizeof(freqs)) {
+            m_content.cpuFreq[m_bench.channel - 1] = ratio >= BENCH_MARGIN ? freqs[m_bench.step] : MAX_CPU_FREQ;
+            m_bench.channel = 0;
+            m_bench.step = 0;
+            flushConfig();
+        }
+    }
+    void benchStop()
+    {
+        if (m_bench.generator) {
+            m_bench.generator->stop();
+            delete m_bench.generator;
+            m_bench.generator = NULL;
+        }
+        if (m_bench.file) {
+            delete m_bench.file;
+            m_bench.file = NULL;
+        }
+        if (m_player == NULL) power.release();
+    }
+
+    void syncOutputs(bool playing)
+    {
+        if (!knx.configured())
+            return;
+        for (int i = 0; i < outputCount; ++i) {
+            if (m_content.outputSync[i]) {
+                output[i].pattern(playing ? m_content.outputSync[i] : 0);
+            }
+        }
+    }
+
+    void clear()
+    {
+        if (m_player)
+            syncOutputs(false);
+        m_playingChannel = 0;
+        m_action = NONE;
+        digitalWrite(m_mutePin, HIGH);
+        if (m_player)
+            m_player->stop();
+        if (m_stream && m_stream != m_file) {
+            delete m_stream;    // Failed to open, never handed over
+        }
+        m_stream = NULL;
+        if (m_file) {
+            delete m_file;
+            m_file = NULL;
+        }
+        if (m_sf2) {
+            delete m_sf2;
+            m_sf2 = NULL;
+        }
+        if (m_player) {
+            delete m_player;
+            m_player = NULL;
+        }
+        if (m_rtp.active()) {
+            m_rtp.end();
+            m_out.stop();
+            WiFi.setSleep(true);
+            if (m_goIntercom)
+                m_goIntercom->value(false);
+        }
+        m_syncStart = 0;
+        m_out.holdUntil(0);
+        power.release();
+    }
+
+    void _setVolume(uint8_t value)
+    {
+        m_content.volume = value;
+        m_out.setVolume(effectiveVolume());
+        m_flushDeadline = (millis() + CONFIG_FLUSH_DELAY) | 1;
+    }
+
+    enum ACTION { NONE, STOP, STOPPING, PLAY, PAUSE, PAUSED, RESUME, PLAY_STREAM, PREFETCH, START_INTERCOM, INTERCOM } m_action;
+    int m_playingChannel = 0;
+    GroupObject* m_GO[NBGO] = {};    // Resolved once, NULL when not configured
+    bool m_blocked = false;
+    int m_mutePin;
+    AudioGenerator *m_player = NULL;
+    AudioFileSource *m_file = NULL;
+    AudioFileSourceNetwork *m_stream = NULL;    // m_file when playing a stream
+    uint32_t m_streamTime = 0;
+    RtpReceiver m_rtp;
+    GroupObject* m_goIntercom = NULL;
+    AudioFileSource *m_sf2 = NULL;
+    AudioOutputDSP m_out = AudioOutputDSP(PIN_DAC, AudioOutputI2S::INTERNAL_DAC, 128);
+    uint32_t m_flushDeadline = 0;   // Delayed configuration write, 0 = none
+    uint32_t m_contentCrc = 0;  // Of the last content read or written
+    uint32_t m_configWrites = 0;
+    struct {
+        uint32_t channel = 0;           // Bank queued for the benchmark, 0 = none
+        uint8_t step = 0;               // Frequency being measured
+        uint32_t elapsed = 0;           // ms spent decoding at this frequency
+        AudioFileSource* file = NULL;
+        AudioGenerator* generator = NULL;
+        AudioOutputCounter counter;
+    } m_bench;
+    ACTION m_loggedAction = NONE;
+    int64_t m_syncStart = 0;        // Shared clock, 0 = not synchronised
+    int32_t m_syncBaseline = INT32_MIN;
+    int32_t m_syncError = 0, m_syncErrorMax = 0;   // us
+    uint32_t m_syncCheck = 0;
+    const Profile* m_profile = NULL;
+    uint32_t m_profileDeadline = 0;
+    GroupObject* m_goTime = NULL;
+    struct {
+        struct {
+            char name[BANK_MAXNAMESIZE];
+            FORMAT format;
+        } bank[NBBANKS];
+        uint8_t volume;
+        uint8_t outputSync[outputCount];    // Pattern run on outputs while playing
+        uint8_t cpuFreq[NBBANKS];           // Benchmarked decoding frequency (MHz), 0 = unknown
+        char streamUrl[STREAM_MAXURLSIZE];  // Played from KNX
+        uint32_t intercomGroup;             // Multicast group, 0 = unicast
+        uint16_t intercomPort;              // 0 = INTERCOM_PORT
+        uint8_t dsp;                        // DSP_NORMALIZE | DSP_LIMITER
+        Profile profiles[NBPROFILES];
+        uint32_t hash[NBBANKS];             // CRC-32 of the bank files, 0 = unknown
+        uint8_t sync;                       // Synchronised start with the other units
+    } m_content;
+  public:
+    enum { SIZEPARAMS = 0 };
+} player;
+constexpr Player::Format Player::formats[];
+constexpr Player::Magic Player::magics[];
+
+#ifdef ENABLE_UPDATE
+#define OTA_HEALTH_TIME   ( 60 * 1000 )     // Uptime confirming a new image
+
+// The core would confirm a new image before setup(): the bootloader keeps it on trial until OTA_HEALTH_TIME
+// instead, so an image crashing at any point before rolls back, see Upgrade::loop()
+bool verifyRollbackLater() { return true; }
+
+// Firmware upgrade: raw or gzip image inflated while streaming. The SHA-256 of the image is required, gzip
+// images also have their CRC-32 and size checked against the trailer, all before the partition swap.
+struct Upgrade
+{
+    void begin(const String& sha256)
+    {
+        abort();
+        m_error = NULL;
+        m_state = MAGIC;
+        m_crc = 0;
+        m_size = 0;
+        mbedtls_sha256_init(&m_sha);
+        mbedtls_sha256_starts_ret(&m_sha, 0);
+        m_active = true;
+        bool valid = sha256.length() == 2 * sizeof(m_expected);
+        for (size_t i = 0; valid && i < sizeof(m_expected); ++i) {
+            char hex[3] = { sha256[2 * i], sha256[2 * i + 1], 0 };
+            valid = isxdigit(hex[0]) && isxdigit(hex[1]);
+            m_expected[i] = strtoul(hex, NULL, 16);
+        }
+        if (!valid) {
+            fail("SHA-256 required");
+        }
+        else if (!Update.begin(UPDATE_SIZE_UNKNOWN)) { //start with max available size
+            fail("no space");
+        }
+    }
+
+    void write(const uint8_t* data, size_t len)
+    {
+        while (len && m_active && !m_error) {
+            switch (m_state) {
+                case MAGIC:
+                    m_state = data[0] == 0x1F ? HEADER : RAW;
+                    m_pos = 0;
+                    break;
+                case RAW:
+                    flash(data, len);
+                    len = 0;
+                    break;
+                case HEADER:
+                    if ((m_pos == 1 && *data != 0x8B) || (m_pos == 2 && *data != 8 /* deflate */)) {
+                        fail("not a gzip image");
+                    }
+                    if (m_pos == 3) {
+                        m_flags = *data;
+                    }
+                    ++data; --len;
+                    if (++m_pos == 10) {
+                        nextField();
+                    }
+                    break;
+                case EXTRA_LENGTH:
+                    m_skip |= *data << (8 * m_pos);
+                    ++data; --len;
+                    if (++m_pos == 2) {
+                        m_state = EXTRA;
+                    }
+                    break;
+                case EXTRA: {
+                    size_t n = MIN(len, m_skip);
+                    data += n; len -= n; m_skip -= n;
+                    if (m_skip == 0) {
+                        nextField();
+                    }
+                  } break;
+                case NAME: case COMMENT:
+                    --len;
+                    if (*data++ == 0) {
+                        nextField();
+                    }
+                    break;
+                case HCRC:
+                    ++data; --len;
+                    if (++m_pos == 2) {
+                        nextField();
+                    }
+                    break;
+                case DEFLATE:
+                    inflate(data, len);
+                    break;
+                case TRAILER:
+                    m_trailer[m_pos++] = *data++; --len;
+                    if (m_pos == sizeof(m_trailer)) {
+                        checkTrailer();
+                    }
+                    break;
+                case DONE: default:
+                    len = 0;
+                    break;
+            }
+        }
+    }
+
+    bool end()
+    {
+        if (!m_active) {
+            return false;
+        }
+        if (m_state != RAW && m_state != DONE) {
+            fail("truncated image");
+        }
+        uint8_t digest[sizeof(m_expected)];
+        mbedtls_sha256_finish_ret(&m_sha, digest);
+        for (size_t i = 0; i < sizeof(digest); ++i) {
+            sprintf(m_hash + 2 * i, "%02x", digest[i]);
+        }
+        if (memcmp(digest, m_expected, sizeof(digest)) != 0) {
+            fail("SHA-256 mismatch");
+        }
+        if (!m_error && !Update.end(true)) { //true to set the size to the current progress
+            fail("invalid image");
+        }
+        release();
+        return m_error == NULL;
+    }
+
+    void abort()
+    {
+        if (m_active && Update.isRunning()) {
+            Update.abort();
+        }
+        release();
+    }
+
+    // First boot of a new image: the bootloader runs it on trial, any reset before it is confirmed boots the
+    // previous partition again
+    void checkBoot()
+    {
+        esp_ota_img_states_t state;
+        m_pending = esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY;
+    }
+
+    void loop(uint32_t time)
+    {
+        if (m_pending && time > OTA_HEALTH_TIME) {
+            esp_ota_mark_app_valid_cancel_rollback();
+            m_pending = false;
+        }
+    }
+
+    const char* error() const { return m_error; }
+    const char* hash() const { return m_hash; }
+    bool pending() const { return m_pending; }
+  private:
+    void fail(const char* error)
+    {
+        if (m_error == NULL) {
+            m_error = error;
+        }
+        if (Update.isRunning()) {
+            Update.abort();
+        }
+    }
+
+    void nextField()
+    {
+        m_pos = 0;
+        m_skip = 0;
+        if (m_flags & 0x04) {           // FEXTRA
+            m_flags &= ~0x04;
+            m_state = EXTRA_LENGTH;
+        }
+        else if (m_flags & 0x08) {      // FNAME
+            m_flags &= ~0x08;
+            m_state = NAME;
+        }
+        else if (m_flags & 0x10) {      // FCOMMENT
+            m_flags &= ~0x10;
+            m_state = COMMENT;
+        }
+        else if (m_flags & 0x02) {      // FHCRC
+            m_flags &= ~0x02;
+            m_state = HCRC;
+        }
+        else {
+            m_inflator = (tinfl_decompressor*)malloc(sizeof(tinfl_decompressor));
+            m_dict = (uint8_t*)malloc(TINFL_LZ_DICT_SIZE);
+            if (m_inflator == NULL || m_dict == NULL) {
+                fail("out of memory");
+                return;
+            }
+            tinfl_init(m_inflator);
+            m_dictPos = 0;
+            m_state = DEFLATE;
+        }
+    }
+
+    void inflate(const uint8_t*& data, size_t& len)
+    {
+        tinfl_status status;
+        do {
+            size_t in = len, out = TINFL_LZ_DICT_SIZE - m_dictPos;
+            status = tinfl_decompress(m_inflator, data, &in, m_dict, m_dict + m_dictPos, &out, TINFL_FLAG_HAS_MORE_INPUT);
+            data += in; len -= in;
+            flash(m_dict + m_dictPos, out);
+            m_dictPos = (m_dictPos + out) & (TINFL_LZ_DICT_SIZE - 1);
+        } while (status == TINFL_STATUS_HAS_MORE_OUTPUT && !m_error);
+        if (status == TINFL_STATUS_DONE) {
+            m_state = TRAILER;
+            m_pos = 0;
+        }
+        else if (status < TINFL_STATUS_DONE) {
+            fail("corrupted image");
+        }
+    }
+
+    // CRC-32 and size of the uncompressed image, little endian
+    void checkTrailer()
+    {
+        uint32_t crc = 0, size = 0;
+        for (int i = 3; i >= 0; --i) {
+            crc = (crc << 8) | m_trailer[i];
+            size = (size << 8) | m_trailer[4 + i];
+        }
+        if (crc != m_crc) {
+            fail("gzip CRC mismatch");
+        }
+        else if (size != m_size) {
+            fail("gzip size mismatch");
+        }
+        m_state = DONE;
+    }
+
+    void flash(const uint8_t* data, size_t len)
+    {
+        if (len == 0 || m_error)
+            return;
+        mbedtls_sha256_update_ret(&m_sha, data, len);
+        m_crc = crc32_le(m_crc, data, len);
+        m_size += len;
+        if (Update.write((uint8_t*)data, len) != len) {
+            fail("flash write");
+        }
+    }
+
+    void release()
+    {
+        if (m_active) {
+            mbedtls_sha256_free(&m_sha);
+            m_active = false;
+        }
+        free(m_inflator);
+        m_inflator = NULL;
+        free(m_dict);
+        m_dict = NULL;
+    }
+
+    enum STATE : uint8_t { MAGIC, RAW, HEADER, EXTRA_LENGTH, EXTRA, NAME, COMMENT, HCRC, DEFLATE, TRAILER, DONE } m_state = MAGIC;
+    bool m_active = false;
+    bool m_pending = false;
+    uint8_t m_flags = 0;
+    uint8_t m_pos = 0;
+    size_t m_skip = 0;
+    const char* m_error = NULL;
+    mbedtls_sha256_context m_sha;
+    uint8_t m_expected[32];
+    char m_hash[65] = "";
+    uint8_t m_trailer[8];
+    uint32_t m_crc = 0, m_size = 0;        // Image written so far
+    tinfl_decompressor* m_inflator = NULL;
+    uint8_t* m_dict = NULL;
+    size_t m_dictPos = 0;
+} upgrade;
+#endif
+
+// Bulk bank transfer as a ustar archive: "bank_N" entries, "meta" (raw /meta of this firmware) and the soundfont.
+// Imported entries named "N_name.ext" go to bank N, metadata is committed once at the end.
+#define TAR_BLOCK       512
+#define ARCHIVE_META    "meta"
+#define ARCHIVE_NEWMETA "/meta.new"
+
+struct Archive
+{
+    static size_t padding(size_t size) { return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK; }
+
+    static void header(uint8_t* block, const char* name, uint32_t size)
+    {
+        memset(block, 0, TAR_BLOCK);
+        strncpy((char*)block, name, 99);
+        sprintf((char*)block + 100, "%07o", 0644);
+        sprintf((char*)block + 108, "%07o", 0);
+        sprintf((char*)block + 116, "%07o", 0);
+        sprintf((char*)block + 124, "%011o", size);
+        sprintf((char*)block + 136, "%011o", 0);
+        block[156] = '0';
+        memcpy(block + 257, "ustar\0" "00", 8);
+        memset(block + 148, ' ', 8);
+        uint32_t sum = 0;
+        for (size_t i = 0; i < TAR_BLOCK; ++i) sum += block[i];
+        sprintf((char*)block + 148, "%06o", sum);
+        block[155] = ' ';
+    }
+
+    // Entries of the export, calls f(name, path) for each existing file
+    template<typename F>
+    static void entries(F f)
+    {
+        for (uint32_t channel = 1; channel <= NBBANKS; ++channel) {
+            const char* path = Player::pathFromChannel(channel);
+            if (SPIFFS.exists(path)) f(path + 1, path);
+        }
+#ifdef ENABLE_MIDI
+        if (SPIFFS.exists(SOUNDFONT_PATH)) f(SOUNDFONT_PATH + 1, SOUNDFONT_PATH);
+#endif
+        f(ARCHIVE_META, META_PATH);
+    }
+
+    // Streams the files straight from flash to the socket
+    static void send(WebServer& server)
+    {
+        player.flushConfig();
+        size_t length = 2 * TAR_BLOCK;
+        entries([&length](const char*, const char* path) {
+            File f = SPIFFS.open(path, FILE_READ);
+            length += TAR_BLOCK + f.size() + padding(f.size());
+            f.close();
+        });
+        server.sendHeader(F("Content-Disposition"), "attachment; filename=\"" FW_TAG "-" + WiFi.macAddress() + ".tar\"");
+        server.setContentLength(length);
+        server.send(200, "application/x-tar", "");
+        WiFiClient client = server.client();
+        uint8_t block[TAR_BLOCK];
+        entries([&client, &block](const char* name, const char* path) {
+            timerWrite(watchdog, 0);
+            File f = SPIFFS.open(path, FILE_READ);
+            header(block, name, f.size());
+            client.write(block, TAR_BLOCK);
+            client.write(f);
+            memset(block, 0, TAR_BLOCK);
+            client.write(block, padding(f.size()));
+            f.close();
+        });
+        memset(block, 0, TAR_BLOCK);
+        client.write(block, TAR_BLOCK);
+        client.write(block, TAR_BLOCK);
+    }
+
+    void begin()
+    {
+        player.abort();
+        m_filled = m_remaining = m_padding = 0;
+        m_channel = 0;
+        m_meta = m_changed = m_done = false;
+        m_imported = m_dropped = 0;
+        SPIFFS.remove(ARCHIVE_NEWMETA);
+    }
+
+    void write(const uint8_t* data, size_t len)
+    {
+        while (len && !m_done) {
+            size_t n;
+            if (m_remaining) {
+                n = MIN(len, m_remaining);
+                if (m_file && m_file.write(data, n) != n) {
+                    dropEntry();        // Flash full
+                }
+                m_crc = crc32_le(m_crc, data, n);
+                m_remaining -= n;
+                if (m_remaining == 0) endEntry();
+            }
+            else if (m_padding) {
+                n = MIN(len, m_padding);
+                m_padding -= n;
+            }
+            else {
+                n = MIN(len, TAR_BLOCK - m_filled);
+                memcpy(m_block + m_filled, data, n);
+                m_filled += n;
+                if (m_filled == TAR_BLOCK) {
+                    m_filled = 0;
+                    beginEntry();
+                }
+            }
+            data += n;
+            len -= n;
+        }
+    }
+
+    // Single metadata commit
+    void end()
+    {
+        if (m_file) dropEntry();    // Archive cut short
+        if (m_meta) {
+            // Exported by a firmware with another layout: the banks are kept, their metadata is not
+            File f = SPIFFS.open(ARCHIVE_NEWMETA, FILE_READ);
+            m_meta = f.size() == Player::configSize();
+            f.close();
+            if (!m_meta) {
+                SPIFFS.remove(ARCHIVE_NEWMETA);
+                ++m_dropped;
             }
         }
+        if (m_meta) {
+            SPIFFS.remove(META_PATH);
+            SPIFFS.rename(ARCHIVE_NEWMETA, META_PATH);
+            player.loadConfig();
+        }
+        else if (m_changed) {
+            player.flushConfig();
+        }
     }
 
+    uint32_t imported() const { return m_imported; }
+    uint32_t dropped() const { return m_dropped; }
   private:
-    void clear()
+    void beginEntry()
     {
-        m_playingChannel = 0;
-        m_action = NONE;
-        digitalWrite(m_mutePin, HIGH);
-        if (m_player)
-            m_player->stop();
-        if (m_file) {
-            delete m_file;
-            m_file = NULL;
+        if (m_block[0] == 0) {  // End of archive
+            m_done = true;
+            return;
         }
-        if (m_sf2) {
-            delete m_sf2;
-            m_sf2 = NULL;
+        m_remaining = strtoul((const char*)m_block + 124, NULL, 8);
+        m_padding = padding(m_remaining);
+        m_channel = 0;
+        m_crc = 0;
+        m_entryMeta = false;
+        bool file = m_block[156] == '0' || m_block[156] == 0;
+        m_block[100] = 0;
+        const char* name = strrchr((const char*)m_block, '/');
+        name = name ? name + 1 : (const char*)m_block;
+        String path;
+        if (file && strcmp(name, ARCHIVE_META) == 0) {
+            path = ARCHIVE_NEWMETA;
+            m_entryMeta = true;
         }
-        if (m_player) {
-            delete m_player;
-            m_player = NULL;
+#ifdef ENABLE_MIDI
+        else if (file && strcmp(name, SOUNDFONT_PATH + 1) == 0) {
+            path = SOUNDFONT_PATH;
+            soundFont.unload();     // Parsed again once idle
+        }
+#endif
+        else if (file) {
+            // "bank_N" or "N_name.ext"
+            const char* number = strncmp(name, "bank_", 5) == 0 ? name + 5 : name;
+            char* rest;
+            uint32_t channel = strtoul(number, &rest, 10);
+            if (rest != number && Player::pathFromChannel(channel)) {
+                path = Player::pathFromChannel(channel);
+                m_channel = channel;
+                m_name = *rest ? String(rest + 1) : String(name);
+            }
         }
+        if (path.length()) {
+            SPIFFS.remove(path);
+            m_file = SPIFFS.open(path, FILE_WRITE);
+            m_path = path;
+        }
+        if (m_remaining == 0) endEntry();
     }
 
-    void _setVolume(uint8_t value)
+    // Entry not written completely: nothing of it is left on flash, its bank is emptied
+    void dropEntry()
     {
-        m_content.volume = value;
-        m_out.SetGain(MIN(value, 100) * 4.f / 100);
-        flushConfig();
+        m_file.close();
+        SPIFFS.remove(m_path);
+        if (m_channel) {
+            player.setChannelName(m_channel, String(), Player::NO_FILE);
+            m_changed = true;
+        }
+        m_channel = 0;
+        m_entryMeta = false;
+        ++m_dropped;
     }
 
-    enum ACTION { NONE, STOP, PLAY, PAUSE, RESUME } m_action;
-    int m_playingChannel = 0;
-    struct {
-      uint16_t playStop;
-      uint16_t pauseResume;
-      uint16_t volume;
-      uint16_t block;
-      uint16_t playing;
-      uint16_t playingChannel;
-      uint16_t play[NBBANKS];
-    } m_GO;
-    int m_mutePin;
-    AudioGenerator *m_player = NULL;
-    AudioFileSourceSPIFFS *m_file = NULL;
-    AudioFileSourceSPIFFS *m_sf2 = NULL;
-    AudioOutputI2S m_out = AudioOutputI2S(PIN_DAC, AudioOutputI2S::INTERNAL_DAC, 128);
-    struct {
-        struct {
-            char name[BANK_MAXNAMESIZE];
-            FORMAT format;
-        } bank[NBBANKS];
-        uint8_t volume;
-    } m_content;
-  public:
-    enum { NBGO = sizeof(m_GO)/sizeof(uint16_t), SIZEPARAMS = 0 };
-} player;
+    void endEntry()
+    {
+        if (m_file) {
+            m_file.close();
+            ++m_imported;
+            m_meta |= m_entryMeta;
+            if (m_channel) {
+                player.setChannelName(m_channel, m_name, player.autodetect(m_channel));
+                player.setHash(m_channel, m_crc);
+                if (player.format(m_channel) == Player::UNKNOWN || player.format(m_channel) == Player::NO_FILE) {
+                    player.setChannelName(m_channel, String(), Player::NO_FILE);
+                    SPIFFS.remove(Player::pathFromChannel(m_channel));
+                }
+                m_changed = true;
+            }
+        }
+        timerWrite(watchdog, 0);
+    }
+
+    uint8_t m_block[TAR_BLOCK];
+    size_t m_filled = 0, m_remaining = 0, m_padding = 0;
+    File m_file;
+    String m_path;
+    uint32_t m_channel = 0;
+    uint32_t m_crc = 0;
+    String m_name;
+    bool m_meta = false, m_entryMeta = false, m_changed = false, m_done = false;
+    uint32_t m_imported = 0, m_dropped = 0;
+} archive;
 
 // Web server port - port du serveur web
 #define WEB_SERVER_PORT 80
 #define URI_WIFI "/reset"
+#define URI_WIFI_SETUP "/wifi"
 #define URI_REBOOT "/reboot"
 #define URI_PROGMODE "/progmode"
 #define URI_UPDATE "/update"
@@ -569,15 +3360,36 @@ struct Player
 #define URI_FORMAT "/format"
 #define URI_REMOVE "/remove"
 #define URI_TOGGLE_OUTPUT "/toggle_output"
+#define URI_PATTERN "/pattern"
+#define URI_BENCHMARK "/benchmark"
+#define URI_STREAM "/stream"
+#define URI_INTERCOM "/intercom"
+#define URI_DSP "/dsp"
+#define URI_PROFILE "/profile"
+#define URI_ARCHIVE "/archive"
+#define URI_DIAG "/diag"
+#define URI_SYNC "/sync"
 #define URI_ROOT "/"
 
 WebServer server ( WEB_SERVER_PORT );
-enum SERVER_STATE: uint8_t { DISCONNECTED = 0, CONNECTING, CONNECTED, RUNNING } serverState = DISCONNECTED;
+enum SERVER_STATE: uint8_t { DISCONNECTED = 0, CONNECTING, CONNECTED, RUNNING, PORTAL, BACKOFF } serverState = DISCONNECTED;
+DNSServer dnsServer;
+
+#define WIFI_CONNECT_TIMEOUT  ( 20 * 1000 )
+#define WIFI_BACKOFF_MIN      ( 5 * 1000 )
+#define WIFI_BACKOFF_MAX      ( 5 * 60 * 1000 )
+#define WIFI_PORTAL_RETRIES   3     // Failed connections before opening the captive portal
+#define DNS_PORT              53
 
 #define REBOOT_TIMER (1)
 #define OTA_REBOOT_TIMER (1)
 
-int64_t rebootRequested = 0;
+// Staged boot: KNX and player first, network started from loop once idle
+#define NETWORK_START_DELAY   ( 2 * 1000 )
+enum BOOT_STAGE: uint8_t { BOOT_INIT = 0, BOOT_READY, BOOT_NETWORK } bootStage = BOOT_INIT;
+uint32_t bootReadyTime = 0;     // ms from reset to KNX and player ready
+
+uint32_t rebootRequested = 0;   // millis() deadline, 0 = none
 bool wifiResetRequested = false;
 
 static void requestReboot(int timer = REBOOT_TIMER)
@@ -586,12 +3398,138 @@ static void requestReboot(int timer = REBOOT_TIMER)
         ESP.restart();
     }
     else {
-        rebootRequested = millis() + timer * 1000;    
+        rebootRequested = (millis() + timer * 1000) | 1;
+    }
+}
+
+// POST /stream: the body is decoded as it arrives, form uploads (multipart) and raw bodies (audio/mpeg...) alike.
+// A full buffer is drained by decoding from here, the rest of the main loop does not run meanwhile.
+#define STREAM_STALL  ( 2 * 1000 )    // ms without room in the buffer before the upload fails
+
+class StreamRequestHandler : public RequestHandler
+{
+public:
+    virtual bool canHandle(HTTPMethod method, String uri) { return method == HTTP_POST && uri == URI_STREAM; }
+    virtual bool canUpload(String uri) { return uri == URI_STREAM; }
+    virtual bool canRaw(String uri) { return uri == URI_STREAM; }
+    virtual bool handle(WebServer& server, HTTPMethod, String)
+    {
+        server.send(m_failed ? 503 : 200);
+        return true;
+    }
+    virtual void upload(WebServer&, String, HTTPUpload& upload)
+    {
+        if (upload.status == UPLOAD_FILE_START) start();
+        else if (upload.status == UPLOAD_FILE_WRITE) write(upload.buf, upload.currentSize);
+        else end();
+    }
+    virtual void raw(WebServer&, String, HTTPRaw& raw)
+    {
+        if (raw.status == RAW_START) start();
+        else if (raw.status == RAW_WRITE) write(raw.buf, raw.currentSize);
+        else end();
+    }
+private:
+    void start()
+    {
+        m_failed = !player.playStream(NULL);
+    }
+    void write(const uint8_t* data, size_t len)
+    {
+        uint32_t progress = millis();
+        while (!m_failed && len) {
+            timerWrite(watchdog, 0); //reset timer (feed watchdog)
+            size_t n = player.stream() ? player.stream()->push(data, len) : 0;
+            if (n) {
+                data += n;
+                len -= n;
+                progress = millis();
+            }
+            else if (!player.pump() || millis() - progress > STREAM_STALL) {
+                // Paused, stopped or stuck: the rest of the body is dropped
+                player.abort();
+                m_failed = true;
+            }
+        }
+    }
+    void end()
+    {
+        if (!m_failed && player.stream()) player.stream()->endOfStream();
+    }
+
+    bool m_failed = false;
+};
+
+// Captive portal: the soft AP is open, so only the setup page and form are served there. Anything else, uploads
+// included, is redirected to the setup page before the application handlers see it.
+class PortalRequestHandler : public RequestHandler
+{
+public:
+    virtual bool canHandle(HTTPMethod, String uri) { return serverState == PORTAL && uri != URI_ROOT && uri != URI_WIFI_SETUP; }
+    virtual bool handle(WebServer& server, HTTPMethod, String)
+    {
+        server.sendHeader(F("Location"), "http://" + WiFi.softAPIP().toString() + URI_ROOT, true);
+        server.send(302);
+        return true;
+    }
+};
+
+// Content-Disposition of a bank name (RFC 6266): an ASCII fallback as a quoted-string, the name itself as UTF-8
+// (RFC 5987). Quotes, backslashes and control characters in an uploaded file name cannot end the header.
+static String contentDisposition(const char* type, const String& name)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    String quoted, encoded;
+    for (unsigned int i = 0; i < name.length(); ++i) {
+        uint8_t c = name[i];
+        if (c == '"' || c == '\\') quoted += '\\';
+        quoted += c >= 0x20 && c < 0x7F ? (char)c : '_';
+        if (isalnum(c) || (c && strchr("!#$&+-.^_`|~", c))) {
+            encoded += (char)c;
+        }
+        else {
+            encoded += '%';
+            encoded += hex[c >> 4];
+            encoded += hex[c & 0x0F];
+        }
     }
+    return String(type) + "; filename=\"" + quoted + "\"; filename*=UTF-8''" + encoded;
 }
 
 static void initWebServer() {
+    server.addHandler(new DiagRequestHandler());     // First: logs every request
+    server.addHandler(new PortalRequestHandler());
+    server.on ( URI_WIFI_SETUP, HTTP_POST, [](){
+        if (serverState == PORTAL && !server.arg("ssid").isEmpty()) {
+            WiFi.begin(server.arg("ssid").c_str(), server.arg("password").c_str());  // Portal closes once connected
+            server.send(200, F("text/html"), F("<html><body>Connecting...</body></html>"));
+        }
+        else {
+            server.send(400);
+        }
+      });
+    server.onNotFound([](){
+        server.send(404);
+      });
     server.on ( URI_ROOT, [](){
+        if (serverState == PORTAL) {
+            server.send(200, F("text/html"), F("<html>"
+                "<head>"
+                  "<title>" FW_TAG " - WiFi</title>"
+                "</head>"
+                "<body>"
+                  "<h1>" FW_TAG "</h1>"
+                  "<form method=\"post\" action=\"" URI_WIFI_SETUP "\">"
+                    "SSID: <input name=\"ssid\" required/>"
+                    "<br/>"
+                    "Password: <input name=\"password\" type=\"password\"/>"
+                    "<br/>"
+                    "<input type=\"submit\" value=\"Connect\"/>"
+                  "</form>"
+                "</body>"
+              "</html>"));
+            return;
+        }
         const __FlashStringHelper* info =
           F("<html>"
               "<head>"
@@ -617,6 +3555,9 @@ static void initWebServer() {
                         "document.getElementById(\"mac\").innerHTML = obj.mac;"
                         "document.getElementById(\"playing\").innerHTML = obj.playing>0?(obj.playing):\"\";"
                         "document.getElementById(\"vol\").value = obj.volume;"
+                        "document.getElementById(\"normalize\").checked = obj.normalize;"
+                        "document.getElementById(\"limiter\").checked = obj.limiter;"
+                        "if (document.activeElement.id != \"streamUrl\") document.getElementById(\"streamUrl\").value = obj.streamUrl;"
                         "document.getElementById(\"reboot\").innerHTML = obj.rebootTimer>0?\" - \"+obj.rebootTimer:\"\";"
 #ifdef ENABLE_MIDI
                         "document.getElementById(\"soundfont\").innerHTML = obj.hasSoundFont?\"Yes\":\"No\";"
@@ -677,28 +3618,32 @@ static void initWebServer() {
                         "<input type=\"button\" onclick=\"invoke('" URI_PAUSE "')\" value=\"||>\"/>"
                         "<input type=\"button\" onclick=\"invoke('" URI_REMOVE "?id='+document.getElementById('bank').value)\" value=\"Clear\"/>"
                         "<input type=\"button\" type=\"submit\" onclick=\"window.open('" URI_DOWNLOAD "?id='+document.getElementById('bank').value)\" value=\"Download\"/>"
+                        "<input type=\"button\" onclick=\"var a=document.getElementById('preview');a.src='" URI_DOWNLOAD "?inline=1&id='+document.getElementById('bank').value;a.play();\" value=\"Preview\"/>"
+                        "<audio id=\"preview\"></audio>"
+                        "<input type=\"button\" onclick=\"invoke('" URI_BENCHMARK "?id='+document.getElementById('bank').value)\" value=\"Benchmark\"/>"
                         "<form id=\"uploadForm\" method=\"post\" enctype=\"multipart/form-data\" action = \"" URI_UPLOAD "?id=1\"><span class=\"action\">Upload: </span><input type=\"file\" name=\"fileToUpload\" id=\"uploadFile\" accept=\""
-#ifdef ENABLE_AAC
-                        ".aac,"
-#endif
-#ifdef ENABLE_MP3
-                        ".mp3,"
-#endif
-#ifdef ENABLE_MIDI
-                        ".mid,"
-#endif
-#ifdef ENABLE_FLAC
-                        ".flac,"
-#endif
-#ifdef ENABLE_WAV
-                        ".wav,"
-#endif
-#ifdef ENABLE_MOD
-                        ".mod,"
-#endif
+                        FORMAT_EXTENSIONS
                         "|audio/*\" /><input type=\"submit\" value=\"Upload\" id=\"uploadSubmit\"/></form>"
                         "<br/>"
                         "Volume: <input type=\"range\" id=\"vol\" min=\"0\" max=\"100\" onchange=\"invoke('" URI_VOLUME "?value='+this.value)\"/>"
+                        "<input id=\"normalize\" type=\"checkbox\" onchange=\"invoke('" URI_DSP "?normalize='+(this.checked?1:0))\"/>Normalize "
+                        "<input id=\"limiter\" type=\"checkbox\" onchange=\"invoke('" URI_DSP "?limiter='+(this.checked?1:0))\"/>Limiter"
+                        "<br/>"
+                        "Stream: <input id=\"streamUrl\" type=\"text\" size=\"40\" placeholder=\"http://\"/>"
+                        "<input type=\"button\" onclick=\"invoke('" URI_STREAM "?save=1&url='+encodeURIComponent(document.getElementById('streamUrl').value))\" value=\"Play\"/>"
+                        "<br/>"
+                        "Profile: <input id=\"profile\" type=\"number\" min=\"1\" max=\"" STRINGIFY(NBPROFILES) "\" value=\"1\"/>"
+                        " days <input id=\"profileDays\" type=\"number\" min=\"0\" max=\"127\" value=\"127\" title=\"1=Mon 2=Tue 4=Wed 8=Thu 16=Fri 32=Sat 64=Sun\"/>"
+                        " <input id=\"profileStart\" type=\"time\" value=\"22:00\"/>-<input id=\"profileEnd\" type=\"time\" value=\"07:00\"/>"
+                        " volume <input id=\"profileVolume\" type=\"number\" min=\"0\" max=\"100\" value=\"30\"/>"
+                        " banks <input id=\"profileRemap\" type=\"text\" size=\"10\" placeholder=\"1:2,3:4\"/>"
+                        "<input type=\"button\" onclick=\"var m=function(id){var t=document.getElementById(id).value.split(':');return t[0]*60+t[1]*1;};"
+                          "invoke('" URI_PROFILE "?id='+document.getElementById('profile').value+'&days='+document.getElementById('profileDays').value+'&start='+m('profileStart')+'&end='+m('profileEnd')"
+                          "+'&volume='+document.getElementById('profileVolume').value+'&remap='+document.getElementById('profileRemap').value)\" value=\"Save\"/>"
+                        "<br/>"
+                        "Intercom: <input id=\"intercomGroup\" type=\"text\" size=\"15\" placeholder=\"unicast\"/>"
+                        "<input type=\"button\" onclick=\"invoke('" URI_INTERCOM "?on=1&group='+document.getElementById('intercomGroup').value)\" value=\"Listen\"/>"
+                        "<input type=\"button\" onclick=\"invoke('" URI_INTERCOM "?on=0')\" value=\"Stop\"/>"
                         "<br/>"
                         "Output: "
                         "<input id=\"output1\" type=\"button\" onclick=\"invoke('" URI_TOGGLE_OUTPUT "?id=1'); update();\"/>"
@@ -706,16 +3651,26 @@ static void initWebServer() {
                         "<input id=\"output3\" type=\"button\" onclick=\"invoke('" URI_TOGGLE_OUTPUT "?id=3'); update();\"/>"
                         "<input id=\"output4\" type=\"button\" onclick=\"invoke('" URI_TOGGLE_OUTPUT "?id=4'); update();\"/>"
                         "<br/>"
+                        "Pattern: <input id=\"patternOutput\" type=\"number\" min=\"1\" max=\"4\" value=\"1\"/>"
+                        "<input id=\"pattern\" type=\"number\" min=\"0\" max=\"127\" value=\"1\"/>"
+                        "<input id=\"patternSync\" type=\"checkbox\"/>Sync with bell "
+                        "<input type=\"button\" onclick=\"invoke('" URI_PATTERN "?id='+document.getElementById('patternOutput').value+'&value='+document.getElementById('pattern').value+'&sync='+(document.getElementById('patternSync').checked?1:0)); update();\" value=\"Run\"/>"
+                        "<br/>"
                         "<a class=\"link\" href=\"\" onclick=\"invoke(\'" URI_FORMAT "\');return false;\">Remove All Bells</a>"
                         "<br/>"
+                        "<a class=\"link\" href=\"" URI_ARCHIVE "\">Export All Bells</a>"
+                        "<form method=\"post\" enctype=\"multipart/form-data\" action=\"" URI_ARCHIVE "\"><span class=\"action\">Import (.tar): </span><input type=\"file\" name=\"archive\" accept=\".tar\"/><input type=\"submit\" value=\"Import\"/></form>"
+                        "<br/>"
                         "<a class=\"link\" href=\"\" onclick=\"invoke(\'" URI_REBOOT "\');return false;\">Reboot Device</a><span id=\"reboot\"></span>"
                         "<br/>"
+                        "<a class=\"link\" href=\"" URI_DIAG "\" target=\"_blank\">Diagnostics</a>"
+                        "<br/>"
                         "<a class=\"link\" href=\"\" onclick=\"invoke(\'" URI_WIFI "\');return false;\">Reset WiFi</a>"
                         "<br/>"
                         "<a class=\"link\" href=\"\" onclick=\"invoke(\'" URI_PROGMODE "\');return false;\">Toggle Program Mode</a>: <span id=\"progMode\"></span>"
                         "<br/>"
 #ifdef ENABLE_UPDATE
-                        "<form id=\"upgradeForm\" method=\"post\" enctype=\"multipart/form-data\" action=\"" URI_UPDATE "\"><span class=\"action\">Upgrade Firmware: </span><input type=\"file\" name=\"fileToUpgrade\" id=\"upgradeFile\" /><input type=\"submit\" value=\"Upgrade\" id=\"upgradeSubmit\"/></form>"
+                        "<form id=\"upgradeForm\" method=\"post\" enctype=\"multipart/form-data\" action=\"" URI_UPDATE "\" onsubmit=\"this.action='" URI_UPDATE "?sha256='+document.getElementById('upgradeHash').value\"><span class=\"action\">Upgrade Firmware (.bin or .bin.gz): </span><input type=\"file\" name=\"fileToUpgrade\" id=\"upgradeFile\" /> SHA-256: <input type=\"text\" id=\"upgradeHash\" size=\"64\" required/><input type=\"submit\" value=\"Upgrade\" id=\"upgradeSubmit\"/></form>"
                         "<br/>"
 #endif
                     "</td>"
@@ -730,6 +3685,91 @@ static void initWebServer() {
     server.on ( URI_PAUSE, [](){ player.pauseResume(); server.send(200); });
     server.on ( URI_STOP, [](){ player.stop(); server.send(200); });
     server.on ( URI_VOLUME, [](){ if (!server.arg("value").isEmpty()) player.setVolume(server.arg("value").toInt()); server.send(200); });
+    server.on ( URI_DSP, [](){
+        uint8_t options = player.dspOptions();
+        if (server.hasArg("normalize")) options = server.arg("normalize").toInt() ? options | DSP_NORMALIZE : options & ~DSP_NORMALIZE;
+        if (server.hasArg("limiter")) options = server.arg("limiter").toInt() ? options | DSP_LIMITER : options & ~DSP_LIMITER;
+        if (options != player.dspOptions()) player.setDspOptions(options);
+        server.send(200);
+    });
+    // ?id=1..NBPROFILES&days=&start=&end=&volume=&remap=from:to,from:to updates a profile, all are returned
+    server.on ( URI_PROFILE, [](){
+        int id = server.arg("id").toInt();
+        if (id >= 1 && id <= NBPROFILES) {
+            Profile p = player.profile(id - 1);
+            if (server.hasArg("days")) p.days = server.arg("days").toInt() & PROFILE_ALLDAYS;
+            if (server.hasArg("start")) p.start = server.arg("start").toInt() % (24 * 60);
+            if (server.hasArg("end")) p.end = server.arg("end").toInt() % (24 * 60);
+            if (server.hasArg("volume")) p.volume = MIN(server.arg("volume").toInt(), 100);
+            if (server.hasArg("remap")) {
+                String remap = server.arg("remap");
+                memset(p.remap, 0, sizeof(p.remap));
+                for (int i = 0, pos = 0; i < PROFILE_MAXREMAP && pos < (int)remap.length(); ++i) {
+                    int colon = remap.indexOf(':', pos);
+                    int comma = remap.indexOf(',', pos);
+                    if (comma < 0) comma = remap.length();
+                    if (colon < 0 || colon > comma) break;
+                    p.remap[i][0] = constrain(remap.substring(pos, colon).toInt(), 0, NBBANKS);
+                    p.remap[i][1] = constrain(remap.substring(colon + 1, comma).toInt(), 0, NBBANKS);
+                    pos = comma + 1;
+                }
+            }
+            player.setProfile(id - 1, p);
+        }
+        String profiles;
+        for (uint8_t i = 0; i < NBPROFILES; ++i) {
+            const Profile& p = player.profile(i);
+            String remap;
+            for (const auto& map : p.remap) {
+                if (map[0]) remap += (remap.isEmpty() ? "" : ",") + String(map[0]) + ":" + String(map[1]);
+            }
+            profiles += "{\"id\":" + String(i + 1) + ",\"days\":" + String(p.days) + ",\"start\":" + String(p.start) + ",\"end\":" + String(p.end) + ",\"volume\":" + String(p.volume) + ",\"remap\":\"" + remap + "\"}";
+            if (i < NBPROFILES - 1) profiles += ",";
+        }
+        server.send(200, F("application/json"), "{\"active\":" + String(player.activeProfile()) + ",\"profiles\":[" + profiles + "]}");
+    });
+    server.on ( URI_SYNC, [](){
+        if (server.hasArg("enable")) player.setSync(server.arg("enable").toInt());
+        server.send(200, F("application/json"), "{"
+                        "\"enabled\":" + String(player.syncEnabled() ? "true" : "false") + ","
+                        "\"active\":" + String(syncClock.active() ? "true" : "false") + ","
+                        "\"master\":\"" + String(syncClock.masterId(), HEX) + "\","
+                        "\"isMaster\":" + String(syncClock.isMaster() ? "true" : "false") + ","
+                        "\"offset\":" + String((int32_t)syncClock.offset()) + ","
+                        "\"error\":" + String(player.syncError()) + ","
+                        "\"errorMax\":" + String(player.syncErrorMax()) +
+                        "}");
+    });
+    // Post-mortem log, oldest first, ?clear=1 empties it
+    server.on ( URI_DIAG, [](){
+        if (server.arg("clear") == "1") diag.clear();
+        String records;
+        for (uint32_t i = 0; i < diag.count(); ++i) {
+            const DiagRecord& r = diag.record(i);
+            records += "{\"boot\":" + String(r.boot) + ",\"time\":" + String(r.time) + ",\"type\":\"" + Diag::typeName(r.type) + "\",\"arg\":" + String(r.arg) + ",";
+            if (r.type == DIAG_HTTP) {
+                char text[sizeof(r.text) + 1] = {};
+                memcpy(text, r.text, sizeof(r.text));
+                records += "\"uri\":\"/" + String(text) + "\"}";
+            }
+            else {
+                records += "\"value\":" + String(r.value[0]) + "}";
+            }
+            if (i + 1 < diag.count()) records += ",";
+        }
+        server.send(200, F("application/json"), "{"
+                        "\"boots\":" + String(diag.boots()) + ","
+                        "\"reset\":\"" + Diag::reasonName(diag.reason()) + "\","
+                        "\"lastEvent\":\"" + Diag::typeName(diag.previous()) + "\","
+                        "\"loopMax\":" + String(diag.loopMax()) + ","
+                        "\"heapMin\":" + String(diag.heapMin()) + ","
+                        "\"blockMin\":" + String(diag.blockMin()) + ","
+                        "\"uptime\":" + String(diag.uptime()) + ","
+                        "\"telegrams\":" + String(diag.dispatchCount()) + ","
+                        "\"dispatchAvg\":" + String(diag.dispatchAvg()) + ","
+                        "\"dispatchMax\":" + String(diag.dispatchMax()) + ","
+                        "\"records\":[" + records + "]}");
+    });
     server.on ( URI_TOGGLE_OUTPUT, [](){
         int id = server.arg("id").toInt() - 1;
         if (id >= 0 && id < outputCount) {
@@ -740,11 +3780,85 @@ static void initWebServer() {
             server.send(404);
         }
     });
+    server.on ( URI_PATTERN, [](){
+        int id = server.arg("id").toInt() - 1;
+        if (id >= 0 && id < outputCount && knx.configured()) {
+            if (!server.arg("steps").isEmpty()) {
+                output[id].setCustomPattern(server.arg("repeat").toInt(), server.arg("steps"));
+            }
+            int value = server.arg("value").toInt();
+            if (!Output::validPattern(value)) {
+                server.send(400);
+            }
+            else if (server.arg("sync").toInt()) {
+                server.send(player.setOutputSync(id, value) ? 200 : 400);
+            }
+            else {
+                output[id].pattern(value);
+                server.send(200);
+            }
+        }
+        else {
+            server.send(404);
+        }
+    });
+    // Queued: the frequency shows in /status once measured
+    server.on ( URI_BENCHMARK, [](){
+        int channel = server.arg("id").toInt();
+        if (player.benchmark(channel)) {
+            server.send(202, F("application/json"), "{\"bank\":" + String(channel) + ",\"pending\":true}");
+        }
+        else {
+            server.send(404);
+        }
+    });
+    // GET ?url=http://...[&save=1] plays a remote stream, POST streams the uploaded body as it arrives
+    server.on ( URI_STREAM, HTTP_GET, [](){
+        String url = server.arg("url");
+        if (url.isEmpty()) url = player.streamUrl();
+        if (url.length() < STREAM_MAXURLSIZE && player.playStream(url.c_str())) {
+            if (server.arg("save") == "1") player.setStreamUrl(url);
+            server.send(200);
+        }
+        else {
+            server.send(400);
+        }
+    });
+    server.addHandler(new StreamRequestHandler());
+    // ?on=0|1[&group=239.x.x.x][&port=5004]: group and port are saved
+    server.on ( URI_INTERCOM, [](){
+        if (server.hasArg("group") || server.hasArg("port")) {
+            IPAddress group;
+            if (!group.fromString(server.arg("group"))) group = IPAddress((uint32_t)0);
+            player.setIntercom(group, server.arg("port").toInt());
+        }
+        if (server.hasArg("on")) {
+            if (!player.intercom(server.arg("on").toInt())) {
+                server.send(500);
+                return;
+            }
+        }
+        const RtpReceiver& rtp = player.rtp();
+        server.send(200, F("application/json"), "{"
+                        "\"active\":" + String(rtp.active() ? "true" : "false") + ","
+                        "\"group\":\"" + player.intercomGroup().toString() + "\","
+                        "\"port\":" + String(player.intercomPort()) + ","
+                        "\"received\":" + String(rtp.received()) + ","
+                        "\"lost\":" + String(rtp.lost()) + ","
+                        "\"late\":" + String(rtp.late()) + ","
+                        "\"concealed\":" + String(rtp.concealed()) + ","
+                        "\"underruns\":" + String(rtp.underruns()) + ","
+                        "\"drift\":" + String(rtp.drift()) + ","
+                        "\"jitter\":" + String(rtp.jitter()) + ","
+                        "\"latency\":" + String(rtp.latency()) +
+                        "}");
+    });
     server.on ( URI_STATUS, [](){
         unsigned long currentTimer = millis();
         String banks;
+        banks.reserve(NBBANKS * (64 + BANK_MAXNAMESIZE));   // One allocation instead of one per bank
         for (size_t i = 1; i <= NBBANKS; ++i) {
-            banks += "{\"bank\":" + String(i) + ",\"format\":" + String(player.format(i)) + ",\"name\":\"" + player.channelName(i) + "\"}";
+            banks += "{\"bank\":" + String(i) + ",\"format\":" + String(player.format(i)) + ",\"cpuFreq\":" + String(player.cpuFreq(i)) + ",\"name\":\"" + player.channelName(i) + "\"}";
             if (i < NBBANKS) banks += ",";
         }
         String info = "{"
@@ -758,13 +3872,28 @@ static void initWebServer() {
                         "\"banks\":[" + banks + "],"
 #ifdef ENABLE_MIDI
                         "\"hasSoundFont\":" + String(player.hasSoundFont()) + ","
+                        "\"soundFontParses\":" + String(soundFont.parses()) + ","
+                        "\"soundFontMisses\":" + String(soundFont.misses()) + ","
 #endif
+                        "\"formats\":\"" FORMAT_EXTENSIONS "\","
+                        "\"streamUrl\":\"" + player.streamUrl() + "\","
+                        "\"streamLevel\":" + String(player.stream() ? player.stream()->level() : 0) + ","
+                        "\"streamUnderruns\":" + String(player.stream() ? player.stream()->underruns() : 0) + ","
                         "\"volume\":" + String(player.volume()) + ","
+                        "\"normalize\":" + String(player.dspOptions() & DSP_NORMALIZE ? "true" : "false") + ","
+                        "\"limiter\":" + String(player.dspOptions() & DSP_LIMITER ? "true" : "false") + ","
+                        "\"limited\":" + String(player.limited()) + ","
+                        "\"dspCyclesAvg\":" + String(player.dspCyclesAvg()) + ","
+                        "\"dspCyclesMax\":" + String(player.dspCyclesMax()) + ","
+                        "\"configWrites\":" + String(player.configWrites()) + ","
+                        "\"clock\":" + String(wallClock.timeKnown() ? (int32_t)(wallClock.weekTime() / MINUTE_MS) : -1) + ","
+                        "\"profile\":" + String(player.activeProfile()) + ","
+                        "\"syncError\":" + String(player.syncError()) + ","
                         "\"chipId\":\"" + String((uint32_t)ESP.getEfuseMac()) + "\","
                         "\"reboot\":" + String(rebootRequested > 0 ? "true" : "false") + ","
                         "\"usedSpace\":" + String(SPIFFS.usedBytes()) + ","
                         "\"totalSpace\":" + String(SPIFFS.totalBytes()) + ","
-                        "\"rebootTimer\":" + String(MAX(0, int((rebootRequested - currentTimer) / 1000))) + ","
+                        "\"rebootTimer\":" + String(rebootRequested ? MAX(0, (int32_t)(rebootRequested - currentTimer) / 1000) : 0) + ","
                         "\"output1\":" + String(output[0].value() ? "true" : "false") + ","
                         "\"output2\":" + String(output[1].value() ? "true" : "false") + ","
                         "\"output3\":" + String(output[2].value() ? "true" : "false") + ","
@@ -773,6 +3902,21 @@ static void initWebServer() {
                         "\"output2_timer\":" + String(output[1].autoOffTimer()) + ","
                         "\"output3_timer\":" + String(output[2].autoOffTimer()) + ","
                         "\"output4_timer\":" + String(output[3].autoOffTimer()) + ","
+                        "\"output1_sync\":" + String(player.outputSync(0)) + ","
+                        "\"output2_sync\":" + String(player.outputSync(1)) + ","
+                        "\"output3_sync\":" + String(player.outputSync(2)) + ","
+                        "\"output4_sync\":" + String(player.outputSync(3)) + ","
+#ifdef ENABLE_UPDATE
+                        "\"otaPending\":" + String(upgrade.pending() ? "true" : "false") + ","
+#endif
+                        "\"wifiState\":" + String(serverState) + ","
+                        "\"bootTime\":" + String(bootReadyTime) + ","
+                        "\"cpuFreq\":" + String(getCpuFrequencyMhz()) + ","
+                        "\"benchmarking\":" + String(player.benchmarking() ? "true" : "false") + ","
+                        "\"sleepCount\":" + String(power.sleepCount()) + ","
+                        "\"sleepTime\":" + String(power.sleepTime()) + ","
+                        "\"wakeLatency\":" + String(power.wakeLatency()) + ","
+                        "\"wakeLatencyMax\":" + String(power.wakeLatencyMax()) + ","
                         "\"KNX_address\":\"" + String((knx.induvidualAddress() >> 12) ) + "." + String((knx.induvidualAddress() >> 8) & 0xF) + "." + String(knx.induvidualAddress() & 0xFF) + "\","
                         "\"KNX_configured\":" + String(knx.configured() ? "true" : "false") + ","
                         "\"KNX_progMode\":" + String(knx.progMode() ? "true" : "false") + ""
@@ -793,6 +3937,9 @@ static void initWebServer() {
       });
     server.on ( URI_FORMAT, [](){
         player.clean();
+#ifdef ENABLE_MIDI
+        soundFont.unload();
+#endif
         server.send(SPIFFS.format()?200:500);
         server.send(200);
       });
@@ -801,19 +3948,86 @@ static void initWebServer() {
         player.removeChannel(channel);
         server.send(200);
       });
-    server.on ( URI_DOWNLOAD, HTTP_GET, []() {
+    // GET and HEAD, single byte range (resume, seeking in a preview), ETag from the bank CRC. Without a CRC (0: the
+    // bank could not be read) there is no validator: no ETag, If-None-Match ignored, If-Range never matches.
+    auto download = []() {
         int channel = server.arg("id").toInt();
-        File download = SPIFFS.open(player.pathFromChannel(channel), FILE_READ);
-        if (download) {
-            server.sendHeader("Content-Type", "text/text");
-            server.sendHeader("Content-Disposition", "attachment; filename=" + player.channelName(channel));
-            server.sendHeader("Connection", "close");
-            server.streamFile(download, "application/octet-stream");
+        const char* path = player.pathFromChannel(channel);
+        File download = path ? SPIFFS.open(path, FILE_READ) : File();
+        if (!download) {
+            server.send(404);
+            return;
+        }
+        size_t size = download.size();
+        const Player::Format* format = Player::formatInfo(player.format(channel));
+        const char* mime = format ? format->mime : "application/octet-stream";
+        uint32_t hash = player.hash(channel);
+        String etag = hash ? "\"" + String(hash, HEX) + "\"" : String();
+        if (hash) server.sendHeader(F("ETag"), etag);
+        server.sendHeader(F("Accept-Ranges"), F("bytes"));
+        server.sendHeader(F("Content-Disposition"), contentDisposition(server.arg("inline") == "1" ? "inline" : "attachment", player.channelName(channel)));
+        if (hash && server.header("If-None-Match") == etag) {
             download.close();
+            server.send(304);
+            return;
         }
-        else
-            server.send(404);
-      });
+        size_t start = 0, end = size ? size - 1 : 0;
+        bool partial = false;
+        String range = server.header("Range");
+        if (size && range.startsWith("bytes=") && (!server.hasHeader("If-Range") || (hash && server.header("If-Range") == etag))) {
+            int dash = range.indexOf('-');
+            int comma = range.indexOf(',');     // Only the first range is served
+            String first = range.substring(6, MAX(dash, 6));
+            String last = dash < 0 ? String() : range.substring(dash + 1, comma < 0 ? range.length() : comma);
+            if (first.isEmpty()) {
+                start = size - MIN((size_t)last.toInt(), size);
+            }
+            else {
+                start = first.toInt();
+                if (!last.isEmpty()) end = MIN((size_t)last.toInt(), size - 1);
+            }
+            if (dash < 0 || start >= size || start > end) {
+                download.close();
+                server.sendHeader(F("Content-Range"), "bytes */" + String(size));
+                server.send(416);
+                return;
+            }
+            partial = true;
+            server.sendHeader(F("Content-Range"), "bytes " + String(start) + "-" + String(end) + "/" + String(size));
+        }
+        size_t length = size ? end - start + 1 : 0;
+        server.setContentLength(length);
+        server.send(partial ? 206 : 200, mime, "");
+        if (server.method() != HTTP_HEAD && download.seek(start)) {
+            WiFiClient client = server.client();
+            uint8_t buffer[1024];
+            while (length) {
+                size_t n = download.read(buffer, MIN(sizeof(buffer), length));
+                if (n == 0 || client.write(buffer, n) != n) break;
+                length -= n;
+            }
+        }
+        download.close();
+    };
+    server.on ( URI_DOWNLOAD, HTTP_GET, download);
+    server.on ( URI_DOWNLOAD, HTTP_HEAD, download);
+    static const char* headers[] = { "Range", "If-Range", "If-None-Match" };
+    server.collectHeaders(headers, sizeof(headers) / sizeof(headers[0]));
+    server.on ( URI_ARCHIVE, HTTP_GET, []() { Archive::send(server); });
+    server.on ( URI_ARCHIVE, HTTP_POST, []() {
+        server.send(200, F("application/json"), "{\"imported\":" + String(archive.imported()) + ",\"dropped\":" + String(archive.dropped()) + "}");
+      }, [](){
+        timerWrite(watchdog, 0); //reset timer (feed watchdog)
+        HTTPUpload& upload = server.upload();
+        if (upload.status == UPLOAD_FILE_START) {
+            archive.begin();
+        } else if (upload.status == UPLOAD_FILE_WRITE) {
+            archive.write(upload.buf, upload.currentSize);
+        } else if (upload.status == UPLOAD_FILE_END || upload.status == UPLOAD_FILE_ABORTED) {
+            archive.end();
+        }
+        yield();
+      } );
     server.on ( URI_UPLOAD, HTTP_POST, []() {
         const __FlashStringHelper* html = F("<html>"
                         "<head>"
@@ -828,18 +4042,24 @@ static void initWebServer() {
         int channel = server.arg("id").toInt();
         static File file;
         static String fileName;
+        static uint32_t crc;
         if (upload.status == UPLOAD_FILE_START) {
+            crc = 0;
 #ifdef ENABLE_MIDI
             String lowerFileName = upload.filename;
             lowerFileName.toLowerCase();
             if (lowerFileName.endsWith(SOUNDFONT_SUFFIX)) {
                 fileName = SOUNDFONT_PATH;
+                player.abort();
+                soundFont.unload();
             }
             else {
                 fileName = player.pathFromChannel(channel);
+                player.cancelBenchmark(channel);
             }
 #else
             fileName = player.pathFromChannel(channel);
+            player.cancelBenchmark(channel);
 #endif
             if (fileName) {
                 SPIFFS.remove(fileName);
@@ -851,18 +4071,24 @@ static void initWebServer() {
                     // error
                     file.close();
                 }
+                crc = crc32_le(crc, upload.buf, upload.currentSize);
             }
         } else if (upload.status == UPLOAD_FILE_END) {
             if (file) {
+                file.close();
 #ifdef ENABLE_MIDI
                 if (!fileName.endsWith(SOUNDFONT_SUFFIX)) {
 #else
                 {
 #endif
                     player.setChannelName(channel, upload.filename, player.autodetect(channel));
+                    player.setHash(channel, crc);
                     if ((player.format(channel) == Player::UNKNOWN || player.format(channel) == Player::NO_FILE)) {
                         player.removeChannel(channel);
                     }
+                    else {
+                        player.benchmark(channel);
+                    }
                     player.flushConfig();
                 }
             }
@@ -880,57 +4106,236 @@ static void initWebServer() {
         String html = "<html>"
                         "<head>"
                         "<title>" FW_TAG " - Update</title>" +
-                        (!Update.hasError() ? "<meta http-equiv=\"refresh\" content=\"" + String(OTA_REBOOT_TIMER + 10) + "; url=/\">" : "") +
+                        (!upgrade.error() ? "<meta http-equiv=\"refresh\" content=\"" + String(OTA_REBOOT_TIMER + 10) + "; url=/\">" : "") +
                         "</head>"
-                        "<body>Update " + (Update.hasError() ? "failed" : "succeeded") + "</body>"
+                        "<body>Update " + (upgrade.error() ? "failed: " + String(upgrade.error()) : "succeeded") + "<br/>SHA-256: " + upgrade.hash() + "</body>"
                     "</html>";
         server.sendHeader(F("Connection"), F("close"));
         server.send(200, F("text/html"), html);
-        requestReboot();
+        if (!upgrade.error()) {
+            requestReboot();
+        }
       }, [](){
         timerWrite(watchdog, 0); //reset timer (feed watchdog)
         HTTPUpload& upload = server.upload();
         if (upload.status == UPLOAD_FILE_START) {
-            if (!Update.begin(UPDATE_SIZE_UNKNOWN)) { //start with max available size
-            }
+            upgrade.begin(server.arg("sha256"));
         } else if (upload.status == UPLOAD_FILE_WRITE) {
-            if (Update.write(upload.buf, upload.currentSize) != upload.currentSize) {
-            }
+            upgrade.write(upload.buf, upload.currentSize);
         } else if (upload.status == UPLOAD_FILE_END) {
-            if (!Update.end(true)) { //true to set the size to the current progress
-            }
+            upgrade.end();
+        } else if (upload.status == UPLOAD_FILE_ABORTED) {
+            upgrade.abort();
         }
         yield();
       } );
 #endif
 }
 
+// Non blocking: led driven from loop
+static uint8_t blinkCount = 0;
 static void blink(int nb) {
-    for (int i = 0; i < nb; ++i) {
-        digitalWrite(PIN_PROG_LED, HIGH);
-        delay(250);
-        digitalWrite(PIN_PROG_LED, LOW);
-        delay(250);
+    blinkCount = 2 * nb + 1;
+}
+static void blinkLoop(uint32_t time) {
+    static uint32_t lastTime = 0;
+    if (blinkCount && time - lastTime >= 250) {
+        lastTime = time;
+        --blinkCount;
+        digitalWrite(PIN_PROG_LED, (blinkCount & 1) ? HIGH : LOW);
+    }
+}
+
+static bool fsMounted = false;
+
+static void startNetwork()
+{
+    if (!fsMounted) {
+        fsMounted = SPIFFS.begin(true);     // format on failure: long, kept out of the boot path
+        player.init(PIN_DAC, PIN_MUTE);
     }
-    delay(1000);
+    WiFi.disconnect(true);  // WiFi off managed at runtime
+    initWebServer();
+    bootStage = BOOT_NETWORK;
 }
 
 bool wifiOn = true;
 static bool wifiForProgramming = false;
+
+static bool hasWiFiCredentials()
+{
+    wifi_config_t config;
+    return esp_wifi_get_config(WIFI_IF_STA, &config) == ESP_OK && config.sta.ssid[0] != 0;
+}
+
+// WiFi connection state machine: never blocks the main loop
+static void wifiLoop(uint32_t time)
+{
+    static uint32_t stateTime = 0;
+    static uint8_t retries = 0;     // Failed connections since the portal last closed
+    static uint8_t failures = 0;    // Since the last connection: the backoff keeps growing across portal cycles
+    if (!wifiOn || wifiResetRequested) {
+        if (serverState != DISCONNECTED) {
+            server.stop();
+            dnsServer.stop();
+            WiFi.disconnect(true, wifiResetRequested);
+            serverState = DISCONNECTED;
+            retries = failures = 0;
+        }
+        wifiResetRequested = false;
+        return;
+    }
+    switch (serverState) {
+        case DISCONNECTED:
+            WiFi.mode(WIFI_STA);
+            if (hasWiFiCredentials() && retries < WIFI_PORTAL_RETRIES) {
+                WiFi.begin();
+                serverState = CONNECTING;
+            }
+            else {
+                // Captive portal, stored network still tried in background
+                WiFi.mode(WIFI_AP_STA);
+                WiFi.softAP((FW_TAG "-" + String((uint32_t)(ESP.getEfuseMac() >> 24))).c_str());
+                dnsServer.start(DNS_PORT, "*", WiFi.softAPIP());
+                if (hasWiFiCredentials()) {
+                    WiFi.begin();
+                }
+                server.begin();
+                serverState = PORTAL;
+            }
+            stateTime = time;
+            break;
+        case CONNECTING:
+            if (WiFi.isConnected()) {
+                retries = failures = 0;
+                serverState = CONNECTED;
+            }
+            else if (time - stateTime > WIFI_CONNECT_TIMEOUT) {
+                ++retries;
+                failures = MIN(failures + 1, 6);
+                WiFi.disconnect();
+                serverState = BACKOFF;
+                stateTime = time;
+            }
+            break;
+        case BACKOFF:
+            if (time - stateTime > MIN((uint32_t)WIFI_BACKOFF_MIN << failures, (uint32_t)WIFI_BACKOFF_MAX)) {
+                serverState = DISCONNECTED;
+            }
+            break;
+        case PORTAL:
+            dnsServer.processNextRequest();
+            server.handleClient();
+            if (WiFi.isConnected()) {
+                dnsServer.stop();
+                WiFi.softAPdisconnect(true);
+                WiFi.mode(WIFI_STA);
+                retries = failures = 0;
+                serverState = RUNNING;
+            }
+            else if (time - stateTime > PROG_TIMEOUT) {
+                server.stop();
+                dnsServer.stop();
+                WiFi.softAPdisconnect(true);
+                retries = 0;
+                serverState = BACKOFF;
+                stateTime = time;
+            }
+            break;
+        case CONNECTED:
+            server.begin();
+            serverState = RUNNING;
+            break;
+        case RUNNING:
+            if (WiFi.isConnected()) {
+                server.handleClient();
+            }
+            else {
+                server.stop();
+                serverState = BACKOFF;
+                stateTime = time;
+            }
+            break;
+    }
+}
+
+// Group object numbers, fixed by the ETS application
+enum GO_LAYOUT : uint16_t {
+    GO_WIFI = 1,
+    GO_WIFI_STATUS,
+    GO_OUTPUTS,
+    GO_PLAYER = GO_OUTPUTS + outputCount * Output::NBGO,
+    GO_PATTERNS = GO_PLAYER + Player::NBGO,
+    GO_STREAM = GO_PATTERNS + outputCount,
+    GO_INTERCOM,
+    GO_TIME,
+    GO_DATE,
+    GO_DATETIME,
+    GO_RESET_REASON,
+    GO_LAST_EVENT,
+    GO_END
+};
+
+void Output::patternTelegram(GroupObject& go)
+{
+    uint8_t value = go.value();
+    if (!validPattern(value & ~PATTERN_SYNC))
+        return;
+    if (value & PATTERN_SYNC) {
+        player.setOutputSync(m_id, value & ~PATTERN_SYNC);
+    }
+    else {
+        pattern(value);
+    }
+}
+
+static void dispatchTelegram(GroupObject& go)
+{
+    uint32_t start = ESP.getCycleCount();
+    uint16_t goNb = go.asap();
+    uint32_t value = 0;
+    memcpy(&value, go.valueRef(), MIN(go.valueSize(), sizeof(value)));
+    diag.log(DIAG_KNX, goNb, value);
+
+    if (goNb >= GO_OUTPUTS && goNb < GO_PLAYER) {
+        output[(goNb - GO_OUTPUTS) / Output::NBGO].telegram((goNb - GO_OUTPUTS) % Output::NBGO, go);
+    }
+    else if (goNb >= GO_PLAYER && goNb < GO_PATTERNS) {
+        player.telegram(goNb - GO_PLAYER, go);
+    }
+    else if (goNb >= GO_PATTERNS && goNb < GO_STREAM) {
+        output[goNb - GO_PATTERNS].patternTelegram(go);
+    }
+    else switch (goNb) {
+        case GO_WIFI:
+            wifiOn = go.value();
+            wifiForProgramming = false;
+            knx.getGroupObject(GO_WIFI_STATUS).value(wifiOn);
+            break;
+        case GO_STREAM:     player.streamTelegram(go);      break;
+        case GO_INTERCOM:   player.intercomTelegram(go);    break;
+        case GO_TIME:       player.timeTelegram(go);        break;
+        case GO_DATE:       player.dateTelegram(go);        break;
+        case GO_DATETIME:   player.dateTimeTelegram(go);    break;
+    }
+    diag.dispatched(ESP.getCycleCount() - start);
+}
+
 void setup()
 {
     pinMode(PIN_PROG_LED, OUTPUT);
-    blink(1);
+    digitalWrite(PIN_PROG_LED, HIGH);   // booting
 
     // Stop Bluetooth
     btStop();
 
-    // set frequency to 80Mhz
-    esp_pm_config_esp32_t pm_config;
-    pm_config.max_freq_mhz = 80;
-    pm_config.min_freq_mhz = 80;
-    pm_config.light_sleep_enable = false;
-    esp_pm_configure(&pm_config);
+    diag.init();
+#ifdef ENABLE_UPDATE
+    upgrade.checkBoot();
+#endif
+
+    // set frequency to 80Mhz, raised while playing
+    power.init();
 
     WRITE_PERI_REG(RTC_CNTL_BROWN_OUT_REG, 0); //disable brownout detector
 
@@ -964,41 +4369,58 @@ void setup()
     // read adress table, association table, groupobject table and parameters from eeprom
     knx.readMemory();
 
-    SPIFFS.begin(true);
+    fsMounted = SPIFFS.begin(false);
 
     player.init(PIN_DAC, PIN_MUTE);
+#ifdef ENABLE_MIDI
+    soundFont.synth();      // The first MIDI press plays at once instead of waiting for the parse
+#endif
 
     if (knx.configured()) {
-        uint16_t offsetGO = 1; int offsetParam = 0;
+        int offsetParam = 0;
         // Wifi On/Off
 //        wifiOn = false;
         wifiForProgramming = false;
-        knx.getGroupObject(offsetGO).dataPointType(DPT_Switch);
-        knx.getGroupObject(offsetGO + 1 /* status */).dataPointType(DPT_Switch);
-        knx.getGroupObject(offsetGO).callback([offsetGO](GroupObject& go) { wifiOn = go.value(); wifiForProgramming = false; knx.getGroupObject(offsetGO + 1 /* status */).value(wifiOn); });
-        offsetGO += 2;
-        for (uint16_t i = 0; i < outputCount; ++i, offsetGO += Output::NBGO, offsetParam += Output::SIZEPARAMS) {
-            output[i].init(offsetParam, offsetGO, outputPins[i]);
+        knx.getGroupObject(GO_WIFI).dataPointType(DPT_Switch);
+        knx.getGroupObject(GO_WIFI_STATUS).dataPointType(DPT_Switch);
+        for (uint16_t i = 0; i < outputCount; ++i, offsetParam += Output::SIZEPARAMS) {
+            output[i].init(offsetParam, GO_OUTPUTS + i * Output::NBGO, outputPins[i]);
+            output[i].initPattern(i, GO_PATTERNS + i);
+        }
+        player.initKNX(offsetParam, GO_PLAYER);
+        player.initKNXStream(GO_STREAM);
+        player.initKNXIntercom(GO_INTERCOM);
+        player.initKNXClock(GO_TIME, GO_DATE, GO_DATETIME);
+        // Post-mortem: reset reason and last event before it
+        knx.getGroupObject(GO_RESET_REASON).dataPointType(DPT_Value_1_Ucount);
+        knx.getGroupObject(GO_LAST_EVENT).dataPointType(DPT_String_8859_1);
+        // Status objects never receive telegrams, a shared callback costs nothing
+        for (uint16_t goNb = GO_WIFI; goNb < GO_END; ++goNb) {
+            knx.getGroupObject(goNb).callback(dispatchTelegram);
         }
-        player.initKNX(offsetParam, offsetGO);
     }
 
     // start the framework.
     knx.start();
+    if (knx.configured()) {
+        player.requestTime();
+        knx.getGroupObject(GO_RESET_REASON).value(diag.reason());
+        knx.getGroupObject(GO_LAST_EVENT).value((String(Diag::reasonName(diag.reason())) + " " + Diag::typeName(diag.previous())).substring(0, 14).c_str());
+    }
 
     watchdog = timerBegin(0, 80, true); //timer 0, div 80
-    timerAttachInterrupt(watchdog, &esp_restart, true);
+    timerAttachInterrupt(watchdog, &watchdogExpired, true);
     timerAlarmWrite(watchdog, WATCHDOG_TIMEOUT, false); //set time in us
     timerAlarmEnable(watchdog); //enable interrupt
 
-    WiFi.disconnect(true);  // WiFi off managed at runtime
-    initWebServer();
-
+    bootStage = BOOT_READY;
+    bootReadyTime = millis();
     blink(3);
 }
 
 void loop() 
 {
+    uint32_t loopStart = millis();
     timerWrite(watchdog, 0); //reset timer (feed watchdog)
 
     // don't delay here to much. Otherwise you might lose packages or mess up the timing with ETS
@@ -1008,57 +4430,46 @@ void loop()
     if (knx.configured()) {
         static uint32_t lastTime = millis();
         uint32_t time = millis();
-        if (lastTime + 50 < time) {
+        if (time - lastTime > 50) {
             for (int i = 0; i < outputCount; ++i) {
                 output[i].loop(time);
             }
             lastTime = time;
         }
+        sequencer.loop(time);
     }
     player.loop();
+#ifdef ENABLE_MIDI
+    if (player.idle()) soundFont.idle();
+#endif
+    blinkLoop(millis());
 
-    if (wifiOn) {
-        if (serverState == DISCONNECTED) {
-            serverState = CONNECTING;
-            WiFiManager wm;
-            wm.setConfigPortalTimeout(PROG_TIMEOUT / 1000);
-            wm.setLoopCallback(&loop);  // main loop is called
-            wm.autoConnect((FW_TAG "-" + String((uint32_t)ESP.getEfuseMac())).c_str(), "");
-            serverState = WiFi.isConnected()?CONNECTED:DISCONNECTED;
+    if (bootStage == BOOT_READY) {
+        if (player.idle() && millis() - bootReadyTime > NETWORK_START_DELAY) {
+            startNetwork();
         }
     }
-    if (serverState == CONNECTED) {
-        server.begin();
-        serverState = RUNNING;
+
+    if (bootStage == BOOT_NETWORK) {
+        wifiLoop(millis());
     }
-    if (serverState == RUNNING) {
-        if (wifiOn) {
-            server.handleClient();
-        }
-        else {
-            server.stop();
-            WiFi.disconnect(true);
-            serverState = DISCONNECTED;
-        }
+    if (player.syncEnabled() && serverState == RUNNING) {
+        syncClock.begin();
     }
-
-    if (wifiResetRequested) {
-        server.stop();
-        WiFi.disconnect(true, true);
-        serverState = DISCONNECTED;
-        wifiResetRequested = false;
+    else {
+        syncClock.end();
     }
     static uint32_t timerProgMode = 0;
     if (knx.progMode()) {
         if (timerProgMode == 0) {
-            timerProgMode = millis();
+            timerProgMode = (millis() + PROG_TIMEOUT) | 1;     // Deadline
             if (!wifiOn) {
                 wifiOn = true;
                 wifiForProgramming = true;
             }
         }
         else {
-            if (millis() > timerProgMode + PROG_TIMEOUT) {
+            if ((int32_t)(millis() - timerProgMode) >= 0) {
                 knx.progMode(false);
                 timerProgMode = 0;
                 if (wifiForProgramming) {
@@ -1072,8 +4483,22 @@ void loop()
     }
 
     unsigned long currentTime = millis();
-    if (rebootRequested != 0 && currentTime > rebootRequested) {
+#ifdef ENABLE_UPDATE
+    upgrade.loop(currentTime);
+#endif
+    if (rebootRequested != 0 && (int32_t)(currentTime - rebootRequested) >= 0) {
         rebootRequested = 0;
         requestReboot(0);
     }
+
+    // Light sleep with WiFi off, or connected without HTTP requests for IDLE_HTTP, and nothing to play or drive.
+    // Synchronised units stay awake for the beacons and start announcements.
+    bool connected = serverState == RUNNING;
+    bool network = connected ? millis() - lastHttpRequest > IDLE_HTTP && !player.syncEnabled() : !wifiOn && serverState == DISCONNECTED;
+    bool idle = player.idle() && network && !knx.progMode() && rebootRequested == 0;
+    for (int i = 0; idle && i < outputCount; ++i) {
+        idle = output[i].idle();
+    }
+    diag.loop(millis() - loopStart);
+    power.loop(idle, connected);
 }
@@ -0,0 +1,496 @@
+// Host build of the firmware for the native test environment: the Arduino API on top of a virtual clock
+// and a tracked heap. Header only, each test suite is one translation unit including src/main.cpp.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fake {
+
+// Virtual clock by default: tests advance it, light sleep and delay() move it. Realtime for the
+// multi-process tests, where each process adds its own offset as independent crystals would.
+struct Clock
+{
+    bool realtime = false;
+    int64_t virtualUs = 0;
+    int64_t offsetUs = 0;
+    int64_t now() const
+    {
+        if (realtime) {
+            static const auto origin = std::chrono::steady_clock::now();
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - origin).count() + offsetUs;
+        }
+        return virtualUs + offsetUs;
+    }
+    void advance(int64_t us)
+    {
+        if (realtime) std::this_thread::sleep_for(std::chrono::microseconds(us));
+        else virtualUs += us;
+    }
+};
+inline Clock clock;
+
+// Allocations of the firmware, mapped first fit into an arena the size of the ESP32 heap so the
+// largest free block shows fragmentation. Fake internals (flash contents, sockets) are not counted.
+struct Heap
+{
+    size_t capacity = 200 * 1024;
+    size_t used = 0, peak = 0, allocations = 0, failures = 0;
+    std::map<uintptr_t, std::pair<size_t, size_t>>* live = nullptr;    // pointer -> arena offset, size
+    std::map<size_t, size_t>* arena = nullptr;                          // offset -> size, sorted
+    std::recursive_mutex lock;
+
+    size_t freeBytes() const { return capacity - used; }
+    size_t minFree() const { return capacity - peak; }
+    size_t largestFree()
+    {
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        size_t largest = 0, end = 0;
+        if (arena) {
+            for (auto& block : *arena) {
+                largest = std::max(largest, block.first - end);
+                end = block.first + block.second;
+            }
+        }
+        return std::max(largest, capacity - std::min(end, capacity));
+    }
+    void resetPeak() { peak = used; }
+};
+inline Heap heap;
+inline thread_local int untracked = 0;
+
+// Scope excluded from the heap accounting
+struct Untracked
+{
+    Untracked() { ++untracked; }
+    ~Untracked() { --untracked; }
+};
+
+inline size_t arenaSize(size_t size) { return ((size + 7) & ~(size_t)7) + 8; }     // Header and alignment
+
+inline void* track(void* p, size_t size, bool* fits = nullptr)
+{
+    if (fits) *fits = true;
+    if (p == nullptr || untracked) return p;
+    Untracked scope;
+    std::lock_guard<std::recursive_mutex> guard(heap.lock);
+    if (heap.live == nullptr) {
+        heap.live = new std::map<uintptr_t, std::pair<size_t, size_t>>();
+        heap.arena = new std::map<size_t, size_t>();
+    }
+    size_t need = arenaSize(size), offset = 0;
+    bool found = false;
+    for (auto& block : *heap.arena) {
+        if (block.first - offset >= need) { found = true; break; }
+        offset = block.first + block.second;
+    }
+    if (!found && heap.capacity >= offset && heap.capacity - offset >= need) found = true;
+    if (!found) {
+        ++heap.failures;
+        if (fits) *fits = false;
+        return p;
+    }
+    (*heap.arena)[offset] = need;
+    (*heap.live)[(uintptr_t)p] = { offset, need };
+    heap.used += need;
+    heap.peak = std::max(heap.peak, heap.used);
+    ++heap.allocations;
+    return p;
+}
+
+inline void untrack(void* p)
+{
+    if (p == nullptr || heap.live == nullptr) return;
+    Untracked scope;
+    std::lock_guard<std::recursive_mutex> guard(heap.lock);
+    auto it = heap.live->find((uintptr_t)p);
+    if (it == heap.live->end()) return;
+    heap.arena->erase(it->second.first);
+    heap.used -= it->second.second;
+    heap.live->erase(it);
+}
+
+// malloc() of the firmware fails like the device one once the arena has no block large enough
+inline void* heapMalloc(size_t size)
+{
+    bool fits;
+    void* p = track(::malloc(size), size, &fits);
+    if (!fits) {
+        ::free(p);
+        return nullptr;
+    }
+    return p;
+}
+inline void* heapCalloc(size_t n, size_t size)
+{
+    void* p = heapMalloc(n * size);
+    if (p) memset(p, 0, n * size);
+    return p;
+}
+inline void heapFree(void* p)
+{
+    untrack(p);
+    ::free(p);
+}
+inline void* heapRealloc(void* p, size_t size)
+{
+    if (p == nullptr) return heapMalloc(size);
+    untrack(p);
+    void* q = ::realloc(p, size);
+    bool fits;
+    track(q, size, &fits);
+    return q;
+}
+
+// Hardware bits the tests look at
+struct Board
+{
+    uint8_t pins[64] = {};
+    uint32_t cpuFreq = 80;
+    uint32_t restarts = 0;
+    uint64_t efuseMac = 0x0000A1B2C3D4E5F6ULL;
+    uint32_t sleeps = 0;
+    int64_t sleepUs = 0;
+    int resetReason = 1;    // ESP_RST_POWERON
+};
+inline Board board;
+
+} // namespace fake
+
+// Every allocation through new goes to the arena accounting (new never returns NULL on the device either)
+inline void* operator new(size_t size) { return fake::track(::malloc(size ? size : 1), size); }
+inline void* operator new[](size_t size) { return fake::track(::malloc(size ? size : 1), size); }
+inline void* operator new(size_t size, const std::nothrow_t&) noexcept { return fake::track(::malloc(size ? size : 1), size); }
+inline void* operator new[](size_t size, const std::nothrow_t&) noexcept { return fake::track(::malloc(size ? size : 1), size); }
+inline void operator delete(void* p) noexcept { fake::untrack(p); ::free(p); }
+inline void operator delete[](void* p) noexcept { fake::untrack(p); ::free(p); }
+inline void operator delete(void* p, size_t) noexcept { fake::untrack(p); ::free(p); }
+inline void operator delete[](void* p, size_t) noexcept { fake::untrack(p); ::free(p); }
+
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 1
+#define INPUT 0
+#define INPUT_PULLUP 2
+#define RISING 1
+#define FALLING 2
+#define CHANGE 3
+#define IRAM_ATTR
+#define RTC_NOINIT_ATTR
+#define RTC_DATA_ATTR
+#define PROGMEM
+#define HEX 16
+#define DEC 10
+#define WRITE_PERI_REG(a, v) ((void)(a), (void)(v))
+#define digitalPinToInterrupt(p) (p)
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+using std::abs;
+using std::max;
+using std::min;
+
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper*)(s))
+#define PSTR(s) (s)
+typedef bool boolean;
+typedef uint8_t byte;
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+class String
+{
+public:
+    String(const char* s = "") { assign(s ? s : "", s ? strlen(s) : 0); }
+    String(const __FlashStringHelper* s) : String((const char*)s) {}
+    String(const String& s) { assign(s.c_str(), s.m_length); }
+    String(String&& s) noexcept : m_buffer(s.m_buffer), m_length(s.m_length) { s.m_buffer = nullptr; s.m_length = 0; }
+    String(char c) { char s[2] = { c, 0 }; assign(s, 1); }
+    String(unsigned char v, unsigned char base = 10) { number(v, base); }
+    String(int v, unsigned char base = 10) { base == 10 ? signedNumber(v) : number((unsigned int)v, base); }
+    String(unsigned int v, unsigned char base = 10) { number(v, base); }
+    String(long v, unsigned char base = 10) { base == 10 ? signedNumber(v) : number((unsigned long)v, base); }
+    String(unsigned long v, unsigned char base = 10) { number(v, base); }
+    String(long long v, unsigned char base = 10) { base == 10 ? signedNumber(v) : number((unsigned long long)v, base); }
+    String(unsigned long long v, unsigned char base = 10) { number(v, base); }
+    String(float v, unsigned char decimals = 2) : String((double)v, decimals) {}
+    String(double v, unsigned char decimals = 2) { char s[48]; snprintf(s, sizeof(s), "%.*f", decimals, v); assign(s, strlen(s)); }
+    ~String() { heapFreeBuffer(); }
+
+    String& operator=(const String& s) { if (this != &s) assign(s.c_str(), s.m_length); return *this; }
+    String& operator=(String&& s) noexcept { if (this != &s) { heapFreeBuffer(); m_buffer = s.m_buffer; m_length = s.m_length; s.m_buffer = nullptr; s.m_length = 0; } return *this; }
+    String& operator=(const char* s) { assign(s ? s : "", s ? strlen(s) : 0); return *this; }
+
+    const char* c_str() const { return m_buffer ? m_buffer : ""; }
+    unsigned int length() const { return m_length; }
+    bool isEmpty() const { return m_length == 0; }
+    bool reserve(unsigned int) { return true; }
+    long toInt() const { return atol(c_str()); }
+    float toFloat() const { return atof(c_str()); }
+    explicit operator bool() const { return true; }
+    char operator[](unsigned int i) const { return i < m_length ? m_buffer[i] : 0; }
+    char& operator[](unsigned int i) { static char dummy; return i < m_length ? m_buffer[i] : dummy; }
+    char charAt(unsigned int i) const { return (*this)[i]; }
+
+    bool concat(const char* s, unsigned int n)
+    {
+        char* b = (char*)fake::heapMalloc(m_length + n + 1);
+        if (b == nullptr) return false;
+        memcpy(b, c_str(), m_length);
+        memcpy(b + m_length, s, n);
+        b[m_length + n] = 0;
+        unsigned int length = m_length + n;
+        heapFreeBuffer();
+        m_buffer = b;
+        m_length = length;
+        return true;
+    }
+    String& operator+=(const String& s) { concat(s.c_str(), s.m_length); return *this; }
+    String& operator+=(const char* s) { concat(s, strlen(s)); return *this; }
+    String& operator+=(char c) { concat(&c, 1); return *this; }
+    String& operator+=(int v) { return *this += String(v); }
+    String& operator+=(unsigned int v) { return *this += String(v); }
+    String& operator+=(long v) { return *this += String(v); }
+    String& operator+=(unsigned long v) { return *this += String(v); }
+
+    bool equals(const String& s) const { return m_length == s.m_length && memcmp(c_str(), s.c_str(), m_length) == 0; }
+    bool operator==(const String& s) const { return equals(s); }
+    bool operator==(const char* s) const { return strcmp(c_str(), s) == 0; }
+    bool operator!=(const String& s) const { return !equals(s); }
+    bool operator!=(const char* s) const { return strcmp(c_str(), s) != 0; }
+    bool operator<(const String& s) const { return strcmp(c_str(), s.c_str()) < 0; }
+    int compareTo(const String& s) const { return strcmp(c_str(), s.c_str()); }
+    bool startsWith(const String& s) const { return s.m_length <= m_length && memcmp(c_str(), s.c_str(), s.m_length) == 0; }
+    bool endsWith(const String& s) const { return s.m_length <= m_length && memcmp(c_str() + m_length - s.m_length, s.c_str(), s.m_length) == 0; }
+    int indexOf(char c, unsigned int from = 0) const
+    {
+        for (unsigned int i = from; i < m_length; ++i) if (m_buffer[i] == c) return i;
+        return -1;
+    }
+    int indexOf(const String& s, unsigned int from = 0) const
+    {
+        if (from > m_length) return -1;
+        const char* found = strstr(c_str() + from, s.c_str());
+        return found ? found - c_str() : -1;
+    }
+    int lastIndexOf(char c) const
+    {
+        for (int i = (int)m_length - 1; i >= 0; --i) if (m_buffer[i] == c) return i;
+        return -1;
+    }
+    String substring(unsigned int from, unsigned int to) const
+    {
+        if (from > to) std::swap(from, to);
+        from = std::min(from, m_length);
+        to = std::min(to, m_length);
+        String s;
+        s.assign(c_str() + from, to - from);
+        return s;
+    }
+    String substring(unsigned int from) const { return substring(from, m_length); }
+    void toLowerCase() { for (unsigned int i = 0; i < m_length; ++i) m_buffer[i] = tolower(m_buffer[i]); }
+    void toUpperCase() { for (unsigned int i = 0; i < m_length; ++i) m_buffer[i] = toupper(m_buffer[i]); }
+    void trim()
+    {
+        unsigned int start = 0, end = m_length;
+        while (start < end && isspace((unsigned char)m_buffer[start])) ++start;
+        while (end > start && isspace((unsigned char)m_buffer[end - 1])) --end;
+        *this = substring(start, end);
+    }
+    void replace(const String& from, const String& to)
+    {
+        String result;
+        int start = 0, found;
+        while (from.m_length && (found = indexOf(from, start)) >= 0) {
+            result += substring(start, found);
+            result += to;
+            start = found + from.m_length;
+        }
+        result += substring(start);
+        *this = result;
+    }
+
+private:
+    void assign(const char* s, size_t n)
+    {
+        char* b = (char*)fake::heapMalloc(n + 1);
+        if (b == nullptr) { heapFreeBuffer(); return; }    // Invalidated like the Arduino String on failure
+        memcpy(b, s, n);
+        b[n] = 0;
+        heapFreeBuffer();
+        m_buffer = b;
+        m_length = n;
+    }
+    template<typename T> void number(T v, unsigned char base)
+    {
+        char s[72];
+        int i = sizeof(s) - 1;
+        s[i] = 0;
+        do { s[--i] = "0123456789abcdefghijklmnopqrstuvwxyz"[v % base]; v /= base; } while (v);
+        assign(s + i, sizeof(s) - 1 - i);
+    }
+    template<typename T> void signedNumber(T v)
+    {
+        char s[32];
+        snprintf(s, sizeof(s), "%lld", (long long)v);
+        assign(s, strlen(s));
+    }
+    void heapFreeBuffer() { fake::heapFree(m_buffer); m_buffer = nullptr; m_length = 0; }
+
+    char* m_buffer = nullptr;
+    unsigned int m_length = 0;
+};
+inline String operator+(const String& a, const String& b) { String s(a); s += b; return s; }
+inline String operator+(const String& a, const char* b) { String s(a); s += b; return s; }
+inline String operator+(const char* a, const String& b) { String s(a); s += b; return s; }
+inline String operator+(const String& a, char b) { String s(a); s += b; return s; }
+inline String operator+(const String& a, const __FlashStringHelper* b) { return a + (const char*)b; }
+inline String operator+(const __FlashStringHelper* a, const String& b) { return (const char*)a + b; }
+// A chain appends to its first temporary like StringSumHelper does, instead of copying at every step
+inline String operator+(String&& a, const String& b) { a += b; return std::move(a); }
+inline String operator+(String&& a, const char* b) { a += b; return std::move(a); }
+inline String operator+(String&& a, char b) { a += b; return std::move(a); }
+inline String operator+(String&& a, const __FlashStringHelper* b) { a += (const char*)b; return std::move(a); }
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t* b, size_t n) { size_t i = 0; while (i < n && write(b[i])) ++i; return i; }
+    size_t write(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+    size_t print(const String& s) { return write((const uint8_t*)s.c_str(), s.length()); }
+    size_t print(const char* s) { return write(s); }
+    size_t print(const __FlashStringHelper* s) { return write((const char*)s); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int v) { return print(String(v)); }
+    size_t print(unsigned int v) { return print(String(v)); }
+    size_t print(long v) { return print(String(v)); }
+    size_t print(unsigned long v) { return print(String(v)); }
+    size_t println(const String& s) { return print(s) + println(); }
+    size_t println(const char* s) { return print(s) + println(); }
+    size_t println(int v) { return print(v) + println(); }
+    size_t println() { return write("\r\n"); }
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        char s[256];
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(s, sizeof(s), format, args);
+        va_end(args);
+        return write((const uint8_t*)s, std::min(n, (int)sizeof(s) - 1));
+    }
+    virtual void flush() {}
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    size_t readBytes(uint8_t* b, size_t n) { size_t i = 0; int c; while (i < n && (c = read()) >= 0) b[i++] = c; return i; }
+    size_t readBytes(char* b, size_t n) { return readBytes((uint8_t*)b, n); }
+    void setTimeout(unsigned long) {}
+};
+
+class HardwareSerial : public Stream
+{
+public:
+    void begin(unsigned long, uint32_t = 0, int8_t = -1, int8_t = -1) {}
+    void end() {}
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    size_t write(uint8_t) override { return 1; }
+    using Print::write;
+};
+inline HardwareSerial Serial, Serial1, Serial2;
+
+inline unsigned long millis() { return (uint32_t)(fake::clock.now() / 1000); }
+inline unsigned long micros() { return (uint32_t)fake::clock.now(); }
+inline void delay(uint32_t ms) { fake::clock.advance(ms * 1000LL); }
+inline void delayMicroseconds(uint32_t us) { fake::clock.advance(us); }
+inline void yield() {}
+inline int64_t esp_timer_get_time() { return fake::clock.now(); }
+inline uint32_t esp_random() { return (uint32_t)random(); }
+inline long random(long max) { return max > 0 ? ::random() % max : 0; }
+inline long random(long min, long max) { return min + random(max - min); }
+
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t pin, uint8_t value) { fake::board.pins[pin & 63] = value; }
+inline int digitalRead(uint8_t pin) { return fake::board.pins[pin & 63]; }
+inline void attachInterrupt(uint8_t, void (*)(void), int) {}
+inline void detachInterrupt(uint8_t) {}
+
+// Hardware watchdog timer: only counts how long it went unfed
+struct hw_timer_s { uint64_t alarm = 0; int64_t fed = 0; int64_t longest = 0; };
+typedef struct hw_timer_s hw_timer_t;
+inline hw_timer_t* timerBegin(uint8_t, uint16_t, bool) { fake::Untracked scope; static hw_timer_t timer; return &timer; }
+inline void timerAttachInterrupt(hw_timer_t*, void (*)(void), bool) {}
+inline void timerAlarmWrite(hw_timer_t* t, uint64_t us, bool) { t->alarm = us; }
+inline void timerAlarmEnable(hw_timer_t* t) { t->fed = fake::clock.now(); }
+inline void timerAlarmDisable(hw_timer_t*) {}
+inline void timerWrite(hw_timer_t* t, uint64_t)
+{
+    if (t == nullptr) return;
+    int64_t now = fake::clock.now();
+    if (t->fed) t->longest = std::max(t->longest, now - t->fed);
+    t->fed = now;
+}
+
+extern "C" inline void esp_restart(void) { ++fake::board.restarts; }
+extern "C" bool verifyRollbackLater();      // Weak in the core: true leaves a new image on trial after setup()
+inline void btStop() {}
+inline void uartSetDebug(void*) {}
+typedef enum { ESP_LOG_NONE, ESP_LOG_ERROR, ESP_LOG_WARN, ESP_LOG_INFO } esp_log_level_t;
+inline void esp_log_level_set(const char*, esp_log_level_t) {}
+
+typedef enum { ESP_RST_UNKNOWN, ESP_RST_POWERON, ESP_RST_EXT, ESP_RST_SW, ESP_RST_PANIC, ESP_RST_INT_WDT, ESP_RST_TASK_WDT, ESP_RST_WDT, ESP_RST_DEEPSLEEP, ESP_RST_BROWNOUT, ESP_RST_SDIO } esp_reset_reason_t;
+inline esp_reset_reason_t esp_reset_reason(void) { return (esp_reset_reason_t)fake::board.resetReason; }
+
+inline bool setCpuFrequencyMhz(uint32_t mhz) { fake::board.cpuFreq = mhz; return true; }
+inline uint32_t getCpuFrequencyMhz() { return fake::board.cpuFreq; }
+
+class EspClass
+{
+public:
+    void restart() { esp_restart(); }
+    uint64_t getEfuseMac() { return fake::board.efuseMac; }
+    uint32_t getFreeHeap() { return fake::heap.freeBytes(); }
+    uint32_t getMinFreeHeap() { return fake::heap.minFree(); }
+    uint32_t getMaxAllocHeap() { return fake::heap.largestFree(); }
+    uint32_t getCpuFreqMHz() { return fake::board.cpuFreq; }
+    // Host time at the CPU frequency: measures code, not the virtual clock
+    uint32_t getCycleCount()
+    {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        return (uint32_t)(ns * fake::board.cpuFreq / 1000);
+    }
+    uint32_t getFreeSketchSpace() { return 0x140000; }
+    uint32_t getSketchSize() { return 0; }
+};
+inline EspClass ESP;
+
+// Firmware allocations go through the arena (std headers above keep the C library ones)
+#define malloc(n) fake::heapMalloc(n)
+#define calloc(n, s) fake::heapCalloc(n, s)
+#define realloc(p, n) fake::heapRealloc(p, n)
+#define free(p) fake::heapFree(p)
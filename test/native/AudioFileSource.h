@@ -0,0 +1,29 @@
+#pragma once
+#include <Arduino.h>
+class AudioStatus
+{
+public:
+    typedef void (*metadataCBFn)(void*, const char*, bool, const char*);
+    typedef void (*statusCBFn)(void*, int, const char*);
+    bool RegisterMetadataCB(metadataCBFn, void*) { return true; }
+    bool RegisterStatusCB(statusCBFn, void*) { return true; }
+};
+class AudioFileSource
+{
+public:
+    AudioFileSource() {}
+    virtual ~AudioFileSource() {}
+    virtual bool open(const char*) { return false; }
+    virtual uint32_t read(void*, uint32_t) { return 0; }
+    virtual uint32_t readNonBlock(void* data, uint32_t len) { return read(data, len); }
+    virtual bool seek(int32_t, int) { return false; }
+    virtual bool close() { return false; }
+    virtual bool isOpen() { return false; }
+    virtual uint32_t getSize() { return 0; }
+    virtual uint32_t getPos() { return 0; }
+    virtual bool loop() { return true; }
+    virtual bool RegisterMetadataCB(AudioStatus::metadataCBFn, void*) { return false; }
+    virtual bool RegisterStatusCB(AudioStatus::statusCBFn, void*) { return false; }
+protected:
+    AudioStatus cb;
+};
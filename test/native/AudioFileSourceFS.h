@@ -0,0 +1,20 @@
+#pragma once
+#include <AudioFileSource.h>
+#include <FS.h>
+class AudioFileSourceFS : public AudioFileSource
+{
+public:
+    AudioFileSourceFS(fs::FS& fs) : m_fs(&fs) {}
+    AudioFileSourceFS(fs::FS& fs, const char* path) : m_fs(&fs) { open(path); }
+    virtual ~AudioFileSourceFS() { close(); }
+    bool open(const char* path) override { m_file = m_fs->open(path, FILE_READ); return m_file; }
+    uint32_t read(void* data, uint32_t len) override { return m_file.read((uint8_t*)data, len); }
+    bool seek(int32_t pos, int dir) override { return m_file.seek(pos, (SeekMode)dir); }
+    bool close() override { m_file.close(); return true; }
+    bool isOpen() override { return m_file; }
+    uint32_t getSize() override { return m_file.size(); }
+    uint32_t getPos() override { return m_file.position(); }
+private:
+    fs::FS* m_fs;
+    fs::File m_file;
+};
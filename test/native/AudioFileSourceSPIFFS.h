@@ -0,0 +1,9 @@
+#pragma once
+#include <AudioFileSourceFS.h>
+#include <SPIFFS.h>
+class AudioFileSourceSPIFFS : public AudioFileSourceFS
+{
+public:
+    AudioFileSourceSPIFFS() : AudioFileSourceFS(SPIFFS) {}
+    AudioFileSourceSPIFFS(const char* path) : AudioFileSourceFS(SPIFFS, path) {}
+};
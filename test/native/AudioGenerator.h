@@ -0,0 +1,80 @@
+#pragma once
+#include <AudioFileSource.h>
+#include <AudioOutput.h>
+class AudioGenerator
+{
+public:
+    AudioGenerator() {}
+    virtual ~AudioGenerator() {}
+    virtual bool begin(AudioFileSource*, AudioOutput*) { return false; }
+    virtual bool loop() { return false; }
+    virtual bool stop() { return false; }
+    virtual bool isRunning() { return false; }
+    virtual void desync() {}
+protected:
+    bool running = false;
+    AudioFileSource* file = nullptr;
+    AudioOutput* output = nullptr;
+    int16_t lastSample[2];
+};
+
+namespace fake {
+// Decoder of the native test environment: one stereo sample per byte of input at 22050 Hz, about
+// what an MP3 at 176 kbit/s gives. Every format decodes this way, only the magic bytes differ.
+struct Decoders { uint32_t created = 0, deleted = 0, bytes = 0; };
+inline Decoders decoders;
+
+class Generator : public AudioGenerator
+{
+public:
+    Generator() { ++decoders.created; }
+    ~Generator() { ++decoders.deleted; }
+    bool begin(AudioFileSource* source, AudioOutput* out) override
+    {
+        if (source == nullptr || out == nullptr) return false;
+        file = source;
+        output = out;
+        output->SetRate(22050);
+        output->SetBitsPerSample(16);
+        output->SetChannels(2);
+        if (!output->begin()) return false;
+        m_pending = false;
+        m_size = m_pos = 0;
+        running = true;
+        return true;
+    }
+    bool loop() override
+    {
+        if (!running) return false;
+        for (int frame = 0; frame < 32; ++frame) {
+            if (m_pending) {
+                if (!output->ConsumeSample(lastSample)) return true;    // DMA full
+                m_pending = false;
+            }
+            if (m_pos == m_size) {
+                m_size = file->read(m_buffer, sizeof(m_buffer));
+                m_pos = 0;
+                decoders.bytes += m_size;
+                if (m_size == 0) {
+                    running = false;
+                    return false;
+                }
+            }
+            int16_t s = (int16_t)((m_buffer[m_pos++] - 128) * 256);
+            lastSample[0] = lastSample[1] = s;
+            m_pending = true;
+        }
+        return true;
+    }
+    bool stop() override { running = false; if (output) output->stop(); return true; }
+    bool isRunning() override { return running; }
+    void SetBufferSize(int) {}
+    void SetSampleRate(int) {}
+    void SetStereoSeparation(int) {}
+    bool SetSoundfont(AudioFileSource*) { return true; }
+private:
+    uint8_t m_buffer[64];
+    uint32_t m_size = 0, m_pos = 0;
+    bool m_pending = false;
+};
+}
@@ -0,0 +1,3 @@
+#pragma once
+#include <AudioGenerator.h>
+class AudioGeneratorAAC : public fake::Generator { public: AudioGeneratorAAC() {} AudioGeneratorAAC(void*, int) {} };
@@ -0,0 +1,3 @@
+#pragma once
+#include <AudioGenerator.h>
+class AudioGeneratorFLAC : public fake::Generator { public: AudioGeneratorFLAC() {} AudioGeneratorFLAC(void*, int) {} };
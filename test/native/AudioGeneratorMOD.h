@@ -0,0 +1,3 @@
+#pragma once
+#include <AudioGenerator.h>
+class AudioGeneratorMOD : public fake::Generator { public: AudioGeneratorMOD() {} AudioGeneratorMOD(void*, int) {} };
@@ -0,0 +1,3 @@
+#pragma once
+#include <AudioGenerator.h>
+class AudioGeneratorMP3 : public fake::Generator { public: AudioGeneratorMP3() {} AudioGeneratorMP3(void*, int) {} };
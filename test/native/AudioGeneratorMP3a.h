@@ -0,0 +1,3 @@
+#pragma once
+#include <AudioGenerator.h>
+class AudioGeneratorMP3a : public fake::Generator { public: AudioGeneratorMP3a() {} AudioGeneratorMP3a(void*, int) {} };
@@ -0,0 +1,3 @@
+#pragma once
+#include <AudioGenerator.h>
+class AudioGeneratorWAV : public fake::Generator { public: AudioGeneratorWAV() {} AudioGeneratorWAV(void*, int) {} };
@@ -0,0 +1,68 @@
+// I2S of the native test environment: DMA buffers drained at the sample rate of the (virtual) clock
+#pragma once
+#include <AudioOutput.h>
+
+namespace fake {
+struct I2S
+{
+    bool paced = true;              // false: every sample accepted at once (benchmarks)
+    bool stuck = false;             // DMA never drains
+    uint32_t rate = 0;              // Last SetRate()
+    int32_t ppm = 0;                // DAC clock error against the system clock
+    uint64_t samples = 0;           // Accepted since boot
+    int64_t started = 0;            // Clock time the first sample of the current play reached the DAC
+    size_t keep = 0;                // Samples recorded for inspection
+    std::vector<int16_t> recorded;  // Interleaved stereo
+};
+inline I2S i2s;
+}
+
+class AudioOutputI2S : public AudioOutput
+{
+public:
+    enum : int { EXTERNAL_I2S = 0, INTERNAL_DAC = 1, INTERNAL_PDM = 2 };
+    AudioOutputI2S(int = 0, int = EXTERNAL_I2S, int dma_buf_count = 8, int = 0) : m_capacity(dma_buf_count * 64) {}
+    bool SetRate(int hz) override { hertz = hz; fake::i2s.rate = hz; return true; }
+    bool SetBitsPerSample(int bits) override { bps = bits; return true; }
+    bool SetChannels(int chan) override { channels = chan; return true; }
+    bool SetOutputModeMono(bool) { return true; }
+    bool begin() override { m_queued = 0; m_base = 0; m_pushed = 0; m_drained = fake::clock.now(); m_first = true; return true; }
+    bool ConsumeSample(int16_t sample[2]) override
+    {
+        if (fake::i2s.paced) {
+            int64_t now = fake::clock.now();
+            // Drained since the queue last ran dry, without losing the fractions of a sample between calls
+            int64_t ticks = (now - m_drained) * (int64_t)hertz;
+            uint64_t drained = hertz ? m_base + (ticks + ticks / 1000000 * fake::i2s.ppm) / 1000000 : m_pushed;
+            if (drained >= m_pushed) {
+                m_base = m_pushed;
+                m_drained = now;
+            }
+            m_queued = m_pushed - std::min(drained, m_pushed);
+            if (m_queued >= m_capacity || fake::i2s.stuck) {
+                // Callers spin until the DMA takes the sample: time passes meanwhile
+                if (!fake::clock.realtime) fake::clock.advance(hertz ? 1000000 / hertz : 1);
+                return false;
+            }
+            if (m_first) {
+                fake::i2s.started = now + (hertz ? (int64_t)m_queued * 1000000 / hertz : 0);
+                m_first = false;
+            }
+            ++m_queued;
+            ++m_pushed;
+        }
+        ++fake::i2s.samples;
+        if (fake::i2s.recorded.size() < 2 * fake::i2s.keep) {
+            fake::Untracked scope;
+            fake::i2s.recorded.push_back(sample[0]);
+            fake::i2s.recorded.push_back(sample[1]);
+        }
+        return true;
+    }
+    void flush() override {}
+    bool stop() override { m_queued = 0; m_base = m_pushed = 0; m_drained = fake::clock.now(); m_first = true; return true; }
+private:
+    uint64_t m_capacity, m_queued = 0, m_base = 0, m_pushed = 0;
+    int64_t m_drained = 0;
+    bool m_first = true;
+};
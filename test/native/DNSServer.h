@@ -0,0 +1,9 @@
+#pragma once
+#include <WiFi.h>
+class DNSServer
+{
+public:
+    bool start(uint16_t, const String&, const IPAddress&) { return true; }
+    void stop() {}
+    void processNextRequest() {}
+};
@@ -0,0 +1,139 @@
+// In-memory flash file system of the native test environment, with the byte and write counts
+// that wear the flash and a capacity to run it full.
+#pragma once
+#include <Arduino.h>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+enum SeekMode { SeekSet, SeekCur, SeekEnd };
+
+namespace fake {
+struct Flash
+{
+    std::map<std::string, std::vector<uint8_t>> files;
+    size_t capacity = 1408 * 1024;
+    uint64_t bytesWritten = 0;      // Total bytes programmed
+    uint64_t writes = 0;            // write() calls reaching the flash
+    std::map<std::string, uint64_t> fileWrites;     // Files opened for writing, per path
+    uint32_t formats = 0;
+    bool mounted = false;
+    size_t used() const
+    {
+        size_t total = 0;
+        for (auto& f : files) total += f.second.size() + 256;     // Object header and page rounding
+        return total;
+    }
+};
+inline Flash flash;
+}
+
+namespace fs {
+
+class File : public Stream
+{
+public:
+    File() {}
+    File(const std::string& path, bool write) : m_handle(std::make_shared<Handle>())
+    {
+        m_handle->path = path;
+        m_handle->write = write;
+    }
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* data, size_t n) override
+    {
+        if (!m_handle || !m_handle->write) return 0;
+        fake::Untracked scope;
+        auto& content = fake::flash.files[m_handle->path];
+        size_t used = fake::flash.used();
+        n = used >= fake::flash.capacity ? 0 : std::min(n, fake::flash.capacity - used);
+        content.insert(content.end(), data, data + n);
+        m_handle->pos = content.size();
+        fake::flash.bytesWritten += n;
+        ++fake::flash.writes;
+        return n;
+    }
+    int available() override { return m_handle && !m_handle->write ? (int)(size() - m_handle->pos) : 0; }
+    int read() override { uint8_t c; return read(&c, 1) == 1 ? c : -1; }
+    int peek() override { uint8_t c; if (read(&c, 1) != 1) return -1; --m_handle->pos; return c; }
+    size_t read(uint8_t* data, size_t n)
+    {
+        const std::vector<uint8_t>* content = this->content();
+        if (content == nullptr || m_handle->pos >= content->size()) return 0;
+        n = std::min(n, content->size() - m_handle->pos);
+        memcpy(data, content->data() + m_handle->pos, n);
+        m_handle->pos += n;
+        return n;
+    }
+    bool seek(uint32_t pos, SeekMode mode = SeekSet)
+    {
+        if (!m_handle) return false;
+        size_t base = mode == SeekSet ? 0 : mode == SeekCur ? m_handle->pos : size();
+        if (base + pos > size()) return false;
+        m_handle->pos = base + pos;
+        return true;
+    }
+    size_t position() const { return m_handle ? m_handle->pos : 0; }
+    size_t size() const { auto c = content(); return c ? c->size() : 0; }
+    void close() { m_handle.reset(); }
+    void flush() override {}
+    operator bool() const { return m_handle && content() != nullptr; }
+    const char* name() const { return m_handle ? m_handle->path.c_str() : ""; }
+    bool isDirectory() { return false; }
+    File openNextFile(const char* = FILE_READ) { return File(); }
+    time_t getLastWrite() { return 0; }
+private:
+    struct Handle { std::string path; bool write = false; size_t pos = 0; };
+    const std::vector<uint8_t>* content() const
+    {
+        if (!m_handle) return nullptr;
+        auto it = fake::flash.files.find(m_handle->path);
+        return it == fake::flash.files.end() ? nullptr : &it->second;
+    }
+    std::shared_ptr<Handle> m_handle;
+};
+
+class FS
+{
+public:
+    File open(const char* path, const char* mode = FILE_READ, bool = false)
+    {
+        if (!fake::flash.mounted || path == nullptr) return File();
+        fake::Untracked scope;
+        std::string p(path);
+        if (mode[0] == 'w') {
+            fake::flash.files[p].clear();
+            ++fake::flash.fileWrites[p];
+        }
+        else if (mode[0] == 'a') {
+            fake::flash.files[p];
+            ++fake::flash.fileWrites[p];
+        }
+        else if (!fake::flash.files.count(p)) {
+            return File();
+        }
+        File f(p, mode[0] != 'r');
+        if (mode[0] == 'a') f.seek(0, SeekEnd);
+        return f;
+    }
+    File open(const String& path, const char* mode = FILE_READ, bool create = false) { return open(path.c_str(), mode, create); }
+    bool exists(const char* path) { fake::Untracked scope; return fake::flash.files.count(path) != 0; }
+    bool exists(const String& path) { return exists(path.c_str()); }
+    bool remove(const char* path) { fake::Untracked scope; return fake::flash.files.erase(path) != 0; }
+    bool remove(const String& path) { return remove(path.c_str()); }
+    bool rename(const char* from, const char* to)
+    {
+        fake::Untracked scope;
+        auto it = fake::flash.files.find(from);
+        if (it == fake::flash.files.end()) return false;
+        auto content = std::move(it->second);
+        fake::flash.files.erase(it);
+        fake::flash.files[to] = std::move(content);
+        return true;
+    }
+    bool rename(const String& from, const String& to) { return rename(from.c_str(), to.c_str()); }
+};
+
+} // namespace fs
+using fs::File;
+using fs::FS;
@@ -0,0 +1,13 @@
+#pragma once
+#include <FS.h>
+
+class SPIFFSFS : public fs::FS
+{
+public:
+    bool begin(bool formatOnFail = false, const char* = "/spiffs", uint8_t = 10, const char* = NULL) { (void)formatOnFail; fake::flash.mounted = true; return true; }
+    bool format() { fake::Untracked scope; fake::flash.files.clear(); ++fake::flash.formats; return true; }
+    size_t totalBytes() { return fake::flash.capacity; }
+    size_t usedBytes() { return fake::flash.used(); }
+    void end() { fake::flash.mounted = false; }
+};
+inline SPIFFSFS SPIFFS;
@@ -0,0 +1,47 @@
+// Flash update of the native test environment: the image written is kept for inspection
+#pragma once
+#include <Arduino.h>
+#define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
+#define U_FLASH 0
+namespace fake {
+struct Update
+{
+    std::string image;              // Written since the last begin()
+    uint32_t begins = 0, ends = 0, aborts = 0;
+};
+inline Update update;
+}
+class UpdateClass
+{
+public:
+    bool begin(size_t = UPDATE_SIZE_UNKNOWN, int = U_FLASH, int = -1, uint8_t = LOW)
+    {
+        fake::Untracked scope;
+        fake::update.image.clear();
+        ++fake::update.begins;
+        m_running = true;
+        m_progress = 0;
+        return true;
+    }
+    size_t write(uint8_t* data, size_t n)
+    {
+        fake::Untracked scope;
+        fake::update.image.append((const char*)data, n);
+        m_progress += n;
+        return n;
+    }
+    bool end(bool = false) { m_running = false; ++fake::update.ends; return true; }
+    bool hasError() { return false; }
+    void abort() { m_running = false; ++fake::update.aborts; }
+    uint8_t getError() { return 0; }
+    bool setMD5(const char*) { return true; }
+    size_t progress() { return m_progress; }
+    size_t size() { return m_progress; }
+    bool isRunning() { return m_running; }
+    void printError(Print&) {}
+    const char* errorString() { return ""; }
+private:
+    bool m_running = false;
+    size_t m_progress = 0;
+};
+inline UpdateClass Update;
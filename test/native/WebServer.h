@@ -0,0 +1,214 @@
+// Web server of the native test environment: handlers registered by the firmware are invoked by
+// request() like the ESP32 WebServer parses a client, bodies delivered in HTTP_UPLOAD_BUFLEN chunks.
+#pragma once
+#include <WiFi.h>
+#include <FS.h>
+
+enum HTTPMethod { HTTP_ANY, HTTP_GET, HTTP_HEAD, HTTP_POST, HTTP_PUT, HTTP_PATCH, HTTP_DELETE, HTTP_OPTIONS };
+enum HTTPUploadStatus { UPLOAD_FILE_START, UPLOAD_FILE_WRITE, UPLOAD_FILE_END, UPLOAD_FILE_ABORTED };
+enum HTTPRawStatus { RAW_START, RAW_WRITE, RAW_END, RAW_ABORTED };
+#define HTTP_UPLOAD_BUFLEN 1436
+#define HTTP_RAW_BUFLEN 1436
+#define CONTENT_LENGTH_UNKNOWN ((size_t)-1)
+#define CONTENT_LENGTH_NOT_SET ((size_t)-2)
+typedef struct { HTTPUploadStatus status; String filename; String name; String type; size_t totalSize; size_t currentSize; uint8_t buf[HTTP_UPLOAD_BUFLEN]; } HTTPUpload;
+typedef struct { HTTPRawStatus status; size_t totalSize; size_t currentSize; uint8_t buf[HTTP_RAW_BUFLEN]; void* data; } HTTPRaw;
+
+class WebServer;
+class RequestHandler
+{
+public:
+    virtual ~RequestHandler() {}
+    virtual bool canHandle(HTTPMethod, String) { return false; }
+    virtual bool canUpload(String) { return false; }
+    virtual bool canRaw(String) { return false; }
+    virtual bool handle(WebServer&, HTTPMethod, String) { return false; }
+    virtual void upload(WebServer&, String, HTTPUpload&) {}
+    virtual void raw(WebServer&, String, HTTPRaw&) {}
+};
+
+namespace fake {
+struct Request
+{
+    HTTPMethod method = HTTP_GET;
+    std::string uri;
+    std::vector<std::pair<std::string, std::string>> args;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+    enum Kind { NONE, MULTIPART, RAW } kind = NONE;
+    std::string filename;           // Multipart
+    bool abort = false;             // Client gone before the end of the body
+};
+struct Response
+{
+    int code = 0;
+    std::string type, body;
+    std::vector<std::pair<std::string, std::string>> headers;
+};
+}
+
+class WebServer
+{
+public:
+    typedef std::function<void(void)> THandlerFunction;
+    WebServer(int port = 80) : m_port(port) {}
+    void begin() { m_running = true; }
+    void stop() { m_running = false; }
+    void handleClient() { ++m_polls; }
+    void addHandler(RequestHandler* handler) { fake::Untracked scope; m_handlers.emplace_back(handler); }
+    void on(const String& uri, THandlerFunction fn) { on(uri, HTTP_ANY, fn); }
+    void on(const String& uri, HTTPMethod method, THandlerFunction fn) { on(uri, method, fn, nullptr); }
+    void on(const String& uri, HTTPMethod method, THandlerFunction fn, THandlerFunction upload)
+    {
+        fake::Untracked scope;
+        m_handlers.emplace_back(new FunctionHandler(uri.c_str(), method, fn, upload));
+    }
+    void onNotFound(THandlerFunction fn) { fake::Untracked scope; m_notFound = fn; }
+    void collectHeaders(const char*[], const size_t) {}
+
+    String arg(const char* name) { for (auto& a : m_request.args) if (a.first == name) return a.second.c_str(); return String(); }
+    String arg(const String& name) { return arg(name.c_str()); }
+    String arg(int i) { return i < (int)m_request.args.size() ? String(m_request.args[i].second.c_str()) : String(); }
+    String argName(int i) { return i < (int)m_request.args.size() ? String(m_request.args[i].first.c_str()) : String(); }
+    int args() { return m_request.args.size(); }
+    bool hasArg(const String& name) { for (auto& a : m_request.args) if (a.first == name.c_str()) return true; return false; }
+    String header(const String& name) { for (auto& h : m_request.headers) if (strcasecmp(h.first.c_str(), name.c_str()) == 0) return h.second.c_str(); return String(); }
+    bool hasHeader(const String& name) { for (auto& h : m_request.headers) if (strcasecmp(h.first.c_str(), name.c_str()) == 0) return true; return false; }
+    HTTPMethod method() { return m_request.method; }
+    String uri() { return m_request.uri.c_str(); }
+    HTTPUpload& upload() { return m_upload; }
+    HTTPRaw& raw() { return m_raw; }
+    WiFiClient client() { return WiFiClient::sink(m_sink); }
+
+    void sendHeader(const String& name, const String& value, bool = false)
+    {
+        fake::Untracked scope;
+        m_response.headers.push_back({ name.c_str(), value.c_str() });
+    }
+    void setContentLength(size_t length) { m_contentLength = length; }
+    void send(int code, const char* type = NULL, const String& content = String(""))
+    {
+        fake::Untracked scope;
+        m_response.code = code;
+        m_response.type = type ? type : "";
+        *m_sink += content.c_str();
+    }
+    void send(int code, const String& type, const String& content) { send(code, type.c_str(), content); }
+    void send(int code, const __FlashStringHelper* type, const String& content) { send(code, (const char*)type, content); }
+    void send(int code, const __FlashStringHelper* type, const __FlashStringHelper* content) { send(code, (const char*)type, String(content)); }
+    void send_P(int code, const char* type, const char* content) { send(code, type, String(content)); }
+    void send_P(int code, const char* type, const char* content, size_t) { send(code, type, String(content)); }
+    void sendContent(const String& content) { fake::Untracked scope; *m_sink += content.c_str(); }
+    void sendContent(const char* content, size_t n) { fake::Untracked scope; m_sink->append(content, n); }
+    template<typename T> size_t streamFile(T& file, const String& type)
+    {
+        send(200, type.c_str(), "");
+        uint8_t buffer[512];
+        size_t n, total = 0;
+        while ((n = file.read(buffer, sizeof(buffer))) > 0) { sendContent((const char*)buffer, n); total += n; }
+        return total;
+    }
+
+    // Test side: one request through the handlers, as WebServer::handleClient() would parse it
+    fake::Response request(const fake::Request& request)
+    {
+        fake::Response response;
+        {
+            fake::Untracked scope;
+            m_request = request;
+            m_response = fake::Response();
+            m_sink = std::make_shared<std::string>();
+            m_contentLength = CONTENT_LENGTH_NOT_SET;
+        }
+        String uri = request.uri.c_str();
+        RequestHandler* current = nullptr;
+        for (auto& handler : m_handlers) {
+            if (handler->canHandle(request.method, uri)) { current = handler.get(); break; }
+        }
+        if (current && request.kind == fake::Request::MULTIPART && current->canUpload(uri)) {
+            m_upload.filename = request.filename.c_str();
+            m_upload.name = "file";
+            m_upload.totalSize = 0;
+            m_upload.currentSize = 0;
+            m_upload.status = UPLOAD_FILE_START;
+            current->upload(*this, uri, m_upload);
+            body(request, m_upload.buf, HTTP_UPLOAD_BUFLEN, [&](size_t n) {
+                m_upload.status = UPLOAD_FILE_WRITE;
+                m_upload.currentSize = n;
+                m_upload.totalSize += n;
+                current->upload(*this, uri, m_upload);
+            });
+            m_upload.status = request.abort ? UPLOAD_FILE_ABORTED : UPLOAD_FILE_END;
+            m_upload.currentSize = 0;
+            current->upload(*this, uri, m_upload);
+            if (request.abort) return finish();
+        }
+        else if (current && request.kind == fake::Request::RAW && current->canRaw(uri)) {
+            m_raw.status = RAW_START;
+            m_raw.totalSize = m_raw.currentSize = 0;
+            current->raw(*this, uri, m_raw);
+            body(request, m_raw.buf, HTTP_RAW_BUFLEN, [&](size_t n) {
+                m_raw.status = RAW_WRITE;
+                m_raw.currentSize = n;
+                m_raw.totalSize += n;
+                current->raw(*this, uri, m_raw);
+            });
+            m_raw.status = request.abort ? RAW_ABORTED : RAW_END;
+            m_raw.currentSize = 0;
+            current->raw(*this, uri, m_raw);
+            if (request.abort) return finish();
+        }
+        else if (request.kind == fake::Request::RAW) {
+            fake::Untracked scope;
+            m_request.args.push_back({ "plain", request.body });
+        }
+        if (current == nullptr || !current->handle(*this, request.method, uri)) {
+            if (m_notFound) m_notFound();
+            else send(404);
+        }
+        return finish();
+    }
+    uint64_t m_polls = 0;
+    bool m_running = false;
+private:
+    class FunctionHandler : public RequestHandler
+    {
+    public:
+        FunctionHandler(const std::string& uri, HTTPMethod method, THandlerFunction fn, THandlerFunction upload)
+            : m_uri(uri), m_method(method), m_fn(fn), m_upload(upload) {}
+        bool canHandle(HTTPMethod method, String uri) override { return (m_method == HTTP_ANY || m_method == method) && m_uri == uri.c_str(); }
+        bool canUpload(String uri) override { return m_upload && m_uri == uri.c_str(); }
+        bool handle(WebServer&, HTTPMethod, String) override { m_fn(); return true; }
+        void upload(WebServer&, String, HTTPUpload&) override { m_upload(); }
+    private:
+        std::string m_uri;
+        HTTPMethod m_method;
+        THandlerFunction m_fn, m_upload;
+    };
+
+    template<typename F> void body(const fake::Request& request, uint8_t* buffer, size_t size, F chunk)
+    {
+        size_t length = request.abort ? request.body.size() / 2 : request.body.size();
+        for (size_t pos = 0; pos < length; pos += size) {
+            size_t n = std::min(size, length - pos);
+            memcpy(buffer, request.body.data() + pos, n);
+            chunk(n);
+        }
+    }
+    fake::Response finish()
+    {
+        fake::Untracked scope;
+        m_response.body = *m_sink;
+        return m_response;
+    }
+
+    int m_port;
+    std::vector<std::unique_ptr<RequestHandler>> m_handlers;
+    THandlerFunction m_notFound;
+    fake::Request m_request;
+    fake::Response m_response;
+    std::shared_ptr<std::string> m_sink = std::make_shared<std::string>();
+    size_t m_contentLength = CONTENT_LENGTH_NOT_SET;
+    HTTPUpload m_upload;
+    HTTPRaw m_raw;
+};
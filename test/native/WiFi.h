@@ -0,0 +1,268 @@
+// Network of the native test environment: TCP and UDP on host sockets (loopback), the station
+// joins as soon as it has credentials unless a test takes the access point away.
+#pragma once
+#include <Arduino.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+
+class IPAddress
+{
+public:
+    IPAddress() {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) { uint8_t* p = (uint8_t*)&m_address; p[0] = a; p[1] = b; p[2] = c; p[3] = d; }
+    IPAddress(uint32_t address) : m_address(address) {}    // Network order, as lwip stores it
+    operator uint32_t() const { return m_address; }
+    uint8_t operator[](int i) const { return ((const uint8_t*)&m_address)[i & 3]; }
+    bool operator==(const IPAddress& o) const { return m_address == o.m_address; }
+    bool fromString(const char* s) { in_addr a; if (s == nullptr || inet_aton(s, &a) == 0) return false; m_address = a.s_addr; return true; }
+    bool fromString(const String& s) { return fromString(s.c_str()); }
+    String toString() const { in_addr a; a.s_addr = m_address; return String(inet_ntoa(a)); }
+private:
+    uint32_t m_address = 0;
+};
+
+typedef enum { WL_IDLE_STATUS, WL_NO_SSID_AVAIL, WL_SCAN_COMPLETED, WL_CONNECTED, WL_CONNECT_FAILED, WL_CONNECTION_LOST, WL_DISCONNECTED } wl_status_t;
+typedef enum { WIFI_OFF, WIFI_STA, WIFI_AP, WIFI_AP_STA } wifi_mode_t;
+typedef enum { WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM } wifi_ps_type_t;
+inline esp_err_t esp_wifi_set_ps(wifi_ps_type_t) { return ESP_OK; }
+
+namespace fake {
+struct Network
+{
+    bool accessPoint = true;        // Station connects when begun
+    bool connected = false;
+    bool softAP = false;
+    wifi_mode_t mode = WIFI_OFF;
+    std::string ssid = "test";      // Stored credentials, empty = none
+    uint32_t joins = 0;
+    uint32_t portals = 0;           // Soft AP starts
+};
+inline Network network;
+}
+
+// TCP client on a host socket, shared between copies like the ESP32 one
+class WiFiClient : public Stream
+{
+public:
+    WiFiClient() {}
+    WiFiClient(int fd) : m_socket(std::make_shared<Socket>(fd)) {}
+    int connect(IPAddress ip, uint16_t port)
+    {
+        stop();
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = ip;
+        if (fd < 0 || ::connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            if (fd >= 0) ::close(fd);
+            return 0;
+        }
+        fake::Untracked scope;
+        m_socket = std::make_shared<Socket>(fd);
+        return 1;
+    }
+    int connect(const char* host, uint16_t port)
+    {
+        hostent* h = gethostbyname(host);
+        return h ? connect(IPAddress(*(uint32_t*)h->h_addr_list[0]), port) : 0;
+    }
+    uint8_t connected()
+    {
+        if (!m_socket) return 0;
+        if (available() > 0) return 1;
+        char c;
+        ssize_t r = recv(m_socket->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        return r > 0 || (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+    void stop() { m_socket.reset(); }
+    int available() override
+    {
+        int n = 0;
+        return m_socket && ioctl(m_socket->fd, FIONREAD, &n) == 0 ? n : 0;
+    }
+    int read() override { uint8_t c; return read(&c, 1) == 1 ? c : -1; }
+    int read(uint8_t* data, size_t n)
+    {
+        if (!m_socket) return -1;
+        ssize_t r = recv(m_socket->fd, data, n, MSG_DONTWAIT);
+        return r < 0 ? -1 : (int)r;
+    }
+    int peek() override
+    {
+        uint8_t c;
+        return m_socket && recv(m_socket->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 1 ? c : -1;
+    }
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* data, size_t n) override
+    {
+        if (m_sink) { fake::Untracked scope; m_sink->append((const char*)data, n); return n; }
+        if (!m_socket) return 0;
+        ssize_t r = send(m_socket->fd, data, n, MSG_NOSIGNAL);
+        return r < 0 ? 0 : r;
+    }
+    size_t write(Stream& stream)
+    {
+        uint8_t buffer[1436];
+        size_t n, total = 0;
+        while ((n = stream.readBytes(buffer, sizeof(buffer))) > 0) total += write(buffer, n);
+        return total;
+    }
+    operator bool() { return m_socket != nullptr || m_sink != nullptr; }
+    void setTimeout(uint32_t) {}
+    int fd() const { return m_socket ? m_socket->fd : -1; }
+
+    // Test side: writes collected in memory (web server responses)
+    static WiFiClient sink(std::shared_ptr<std::string> sink) { WiFiClient c; c.m_sink = sink; return c; }
+private:
+    struct Socket
+    {
+        Socket(int fd) : fd(fd) {}
+        ~Socket() { ::close(fd); }
+        int fd;
+    };
+    std::shared_ptr<Socket> m_socket;
+    std::shared_ptr<std::string> m_sink;
+};
+
+// UDP on a host socket. Multicast goes through the loopback interface, so every process of a
+// test joins the same group like units on one WiFi network.
+class WiFiUDP : public Stream
+{
+public:
+    ~WiFiUDP() { stop(); }
+    uint8_t begin(uint16_t port)
+    {
+        stop();
+        m_fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+        int one = 1;
+        setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(m_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (::bind(m_fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            stop();
+            return 0;
+        }
+        fcntl(m_fd, F_SETFL, O_NONBLOCK);
+        m_port = port;
+        return 1;
+    }
+    uint8_t beginMulticast(IPAddress group, uint16_t port)
+    {
+        if (!begin(port)) return 0;
+        ip_mreq request = {};
+        request.imr_multiaddr.s_addr = group;
+        request.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+        in_addr loopback = { htonl(INADDR_LOOPBACK) };
+        unsigned char on = 1;
+        if (setsockopt(m_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request)) < 0 ||
+            setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback)) < 0 ||
+            setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &on, sizeof(on)) < 0) {
+            stop();
+            return 0;
+        }
+        m_group = group;
+        return 1;
+    }
+    void stop()
+    {
+        if (m_fd >= 0) ::close(m_fd);
+        m_fd = -1;
+        m_group = IPAddress();
+    }
+    int beginPacket(IPAddress ip, uint16_t port) { m_to = ip; m_toPort = port; m_tx.clear(); return m_fd >= 0; }
+    int beginMulticastPacket() { return beginPacket(m_group, m_port); }
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* data, size_t n) override
+    {
+        fake::Untracked scope;
+        m_tx.insert(m_tx.end(), data, data + n);
+        return n;
+    }
+    int endPacket()
+    {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(m_toPort);
+        addr.sin_addr.s_addr = m_to;
+        bool sent = m_fd >= 0 && sendto(m_fd, m_tx.data(), m_tx.size(), 0, (sockaddr*)&addr, sizeof(addr)) == (ssize_t)m_tx.size();
+        m_tx.clear();
+        return sent;
+    }
+    int parsePacket()
+    {
+        if (m_fd < 0) return 0;
+        sockaddr_in from = {};
+        socklen_t length = sizeof(from);
+        ssize_t n = recvfrom(m_fd, m_rx, sizeof(m_rx), 0, (sockaddr*)&from, &length);
+        if (n <= 0) return 0;
+        m_rxSize = n;
+        m_rxPos = 0;
+        m_from = from.sin_addr.s_addr;
+        m_fromPort = ntohs(from.sin_port);
+        return n;
+    }
+    int available() override { return m_rxSize - m_rxPos; }
+    int read() override { return m_rxPos < m_rxSize ? m_rx[m_rxPos++] : -1; }
+    int read(uint8_t* data, size_t n)
+    {
+        n = std::min(n, m_rxSize - m_rxPos);
+        memcpy(data, m_rx + m_rxPos, n);
+        m_rxPos += n;
+        return n;
+    }
+    int peek() override { return m_rxPos < m_rxSize ? m_rx[m_rxPos] : -1; }
+    void flush() override { m_rxPos = m_rxSize; }
+    IPAddress remoteIP() { return m_from; }
+    uint16_t remotePort() { return m_fromPort; }
+private:
+    int m_fd = -1;
+    uint16_t m_port = 0, m_toPort = 0, m_fromPort = 0;
+    IPAddress m_group, m_to, m_from;
+    std::vector<uint8_t> m_tx;
+    uint8_t m_rx[2048];
+    size_t m_rxSize = 0, m_rxPos = 0;
+};
+
+class WiFiClass
+{
+public:
+    String SSID() { return fake::network.connected ? String(fake::network.ssid.c_str()) : String(); }
+    int8_t RSSI() { return fake::network.connected ? -60 : 0; }
+    IPAddress localIP() { return fake::network.connected ? IPAddress(127, 0, 0, 1) : IPAddress(); }
+    String macAddress() { return "A1:B2:C3:D4:E5:F6"; }
+    bool disconnect(bool wifioff = false, bool eraseap = false)
+    {
+        fake::network.connected = false;
+        if (wifioff) fake::network.mode = WIFI_OFF;
+        if (eraseap) fake::network.ssid.clear();
+        return true;
+    }
+    bool isConnected() { return fake::network.connected; }
+    wl_status_t status() { return fake::network.connected ? WL_CONNECTED : WL_DISCONNECTED; }
+    bool mode(wifi_mode_t m) { fake::network.mode = m; return true; }
+    wifi_mode_t getMode() { return fake::network.mode; }
+    wl_status_t begin()
+    {
+        fake::network.connected = fake::network.accessPoint && !fake::network.ssid.empty();
+        fake::network.joins += fake::network.connected;
+        return status();
+    }
+    wl_status_t begin(const char* ssid, const char* = NULL) { fake::Untracked scope; fake::network.ssid = ssid; return begin(); }
+    bool reconnect() { return begin() == WL_CONNECTED; }
+    bool setSleep(bool) { return true; }
+    bool setAutoReconnect(bool) { return true; }
+    bool softAPdisconnect(bool = false) { fake::network.softAP = false; return true; }
+    bool softAP(const char*, const char* = NULL) { fake::network.softAP = true; ++fake::network.portals; return true; }
+    IPAddress softAPIP() { return IPAddress(192, 168, 4, 1); }
+};
+inline WiFiClass WiFi;
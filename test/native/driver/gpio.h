@@ -0,0 +1,7 @@
+#pragma once
+#include <Arduino.h>
+typedef enum { GPIO_NUM_0 = 0 } gpio_num_t;
+typedef enum { GPIO_INTR_DISABLE, GPIO_INTR_POSEDGE, GPIO_INTR_NEGEDGE, GPIO_INTR_ANYEDGE, GPIO_INTR_LOW_LEVEL, GPIO_INTR_HIGH_LEVEL } gpio_int_type_t;
+inline esp_err_t gpio_wakeup_enable(gpio_num_t, gpio_int_type_t) { return ESP_OK; }
+inline esp_err_t gpio_wakeup_disable(gpio_num_t) { return ESP_OK; }
+inline esp_err_t gpio_set_intr_type(gpio_num_t, gpio_int_type_t) { return ESP_OK; }
@@ -0,0 +1,30 @@
+// OTA partitions of the native test environment: the running image is on trial while state is
+// ESP_OTA_IMG_PENDING_VERIFY, as the bootloader leaves it after an upgrade
+#pragma once
+#include <Arduino.h>
+typedef struct { int type; int subtype; uint32_t address; uint32_t size; char label[17]; } esp_partition_t;
+typedef enum { ESP_OTA_IMG_NEW = 0, ESP_OTA_IMG_PENDING_VERIFY = 1, ESP_OTA_IMG_VALID = 2, ESP_OTA_IMG_INVALID = 3, ESP_OTA_IMG_ABORTED = 4, ESP_OTA_IMG_UNDEFINED = -1 } esp_ota_img_states_t;
+namespace fake {
+struct Ota
+{
+    esp_ota_img_states_t state = ESP_OTA_IMG_VALID;
+    uint32_t confirmed = 0;
+};
+inline Ota ota;
+}
+inline const esp_partition_t* esp_ota_get_running_partition(void) { static esp_partition_t p = { 0, 0x10, 0x10000, 0x140000, "app0" }; return &p; }
+inline const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t*) { static esp_partition_t p = { 0, 0x11, 0x150000, 0x140000, "app1" }; return &p; }
+inline const esp_partition_t* esp_ota_get_boot_partition(void) { return esp_ota_get_running_partition(); }
+inline esp_err_t esp_ota_set_boot_partition(const esp_partition_t*) { return ESP_OK; }
+inline esp_err_t esp_ota_get_state_partition(const esp_partition_t* p, esp_ota_img_states_t* state)
+{
+    if (p != esp_ota_get_running_partition()) return -1;
+    *state = fake::ota.state;
+    return ESP_OK;
+}
+inline esp_err_t esp_ota_mark_app_valid_cancel_rollback(void)
+{
+    fake::ota.state = ESP_OTA_IMG_VALID;
+    ++fake::ota.confirmed;
+    return ESP_OK;
+}
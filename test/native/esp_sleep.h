@@ -0,0 +1,15 @@
+// Light sleep of the native test environment: the virtual clock jumps to the timer wake up
+#pragma once
+#include <Arduino.h>
+typedef enum { ESP_SLEEP_WAKEUP_UNDEFINED, ESP_SLEEP_WAKEUP_ALL, ESP_SLEEP_WAKEUP_EXT0, ESP_SLEEP_WAKEUP_EXT1, ESP_SLEEP_WAKEUP_TIMER, ESP_SLEEP_WAKEUP_TOUCHPAD, ESP_SLEEP_WAKEUP_ULP, ESP_SLEEP_WAKEUP_GPIO, ESP_SLEEP_WAKEUP_UART } esp_sleep_wakeup_cause_t;
+namespace fake { inline uint64_t sleepTimer = 0; }
+inline esp_err_t esp_sleep_enable_timer_wakeup(uint64_t us) { fake::sleepTimer = us; return ESP_OK; }
+inline esp_err_t esp_sleep_enable_gpio_wakeup(void) { return ESP_OK; }
+inline esp_err_t esp_light_sleep_start(void)
+{
+    ++fake::board.sleeps;
+    fake::board.sleepUs += fake::sleepTimer;
+    fake::clock.advance(fake::sleepTimer);
+    return ESP_OK;
+}
+inline esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause(void) { return ESP_SLEEP_WAKEUP_TIMER; }
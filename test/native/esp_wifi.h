@@ -0,0 +1,11 @@
+#pragma once
+#include <WiFi.h>
+typedef enum { WIFI_IF_STA, WIFI_IF_AP } wifi_interface_t;
+typedef struct { uint8_t ssid[32]; uint8_t password[64]; } wifi_sta_config_t;
+typedef union { wifi_sta_config_t sta; } wifi_config_t;
+inline esp_err_t esp_wifi_get_config(wifi_interface_t, wifi_config_t* config)
+{
+    memset(config, 0, sizeof(*config));
+    strncpy((char*)config->sta.ssid, fake::network.ssid.c_str(), sizeof(config->sta.ssid) - 1);
+    return ESP_OK;
+}
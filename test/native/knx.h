@@ -0,0 +1,160 @@
+// KNX stack of the native test environment: group objects hold their value, telegrams queued by the
+// tests are delivered from knx.loop() like received ones, written values are recorded.
+#pragma once
+#include <Arduino.h>
+#include <deque>
+
+struct Dpt
+{
+    Dpt(short main = 0, short sub = 0, short index = 0) : mainGroup(main), subGroup(sub), index(index) {}
+    short mainGroup, subGroup, index;
+    size_t size() const
+    {
+        switch (mainGroup) {
+            case 10: case 11: return 3;
+            case 19: return 8;
+            case 16: return 14;
+            default: return 1;
+        }
+    }
+};
+inline Dpt DPT_Switch(1, 1), DPT_Trigger(1, 17), DPT_Scaling(5, 1), DPT_Value_1_Ucount(5, 10), DPT_Value_1_Count(6, 10),
+           DPT_Value_2_Ucount(7, 1), DPT_Value_2_Count(8, 1), DPT_Value_4_Ucount(12, 1), DPT_TimeOfDay(10, 1), DPT_Date(11, 1),
+           DPT_DateTime(19, 1), DPT_Char_8859_1(4, 2), DPT_String_8859_1(16, 1);
+
+class KNXValue
+{
+public:
+    KNXValue(bool v) : m_int(v) {}
+    KNXValue(uint8_t v) : m_int(v) {}
+    KNXValue(uint16_t v) : m_int(v) {}
+    KNXValue(uint32_t v) : m_int(v) {}
+    KNXValue(uint64_t v) : m_int(v) {}
+    KNXValue(int8_t v) : m_int(v) {}
+    KNXValue(int16_t v) : m_int(v) {}
+    KNXValue(int32_t v) : m_int(v) {}
+    KNXValue(int64_t v) : m_int(v) {}
+    KNXValue(double v) : m_int((int64_t)v) {}
+    KNXValue(const char* v) : m_int(0) { strncpy(m_text, v, sizeof(m_text) - 1); }
+    KNXValue(struct tm v) : m_int(0), m_tm(v) {}
+    operator bool() const { return m_int != 0; }
+    operator uint8_t() const { return m_int; }
+    operator uint16_t() const { return m_int; }
+    operator uint32_t() const { return m_int; }
+    operator int8_t() const { return m_int; }
+    operator int16_t() const { return m_int; }
+    operator int32_t() const { return m_int; }
+    operator double() const { return m_int; }
+    operator const char*() const { return m_text; }
+    operator struct tm() const { return m_tm; }
+    int64_t m_int;
+    char m_text[15] = "";
+    struct tm m_tm = {};
+};
+
+class GroupObject;
+typedef std::function<void(GroupObject&)> GroupObjectUpdatedHandler;
+
+namespace fake {
+struct Sent { uint16_t asap; int64_t value; };
+inline std::vector<Sent> knxSent;   // Values written by the firmware, in order
+}
+
+class GroupObject
+{
+public:
+    KNXValue value() { return m_value; }
+    void value(const KNXValue& v) { valueNoSend(v); fake::Untracked scope; fake::knxSent.push_back({ m_asap, v.m_int }); }
+    void valueNoSend(const KNXValue& v) { m_value = v; encode(); }
+    void dataPointType(Dpt dpt) { m_dpt = dpt; }
+    Dpt dataPointType() { return m_dpt; }
+    void callback(GroupObjectUpdatedHandler handler) { fake::Untracked scope; m_callback = handler; }
+    GroupObjectUpdatedHandler callback() { return m_callback; }
+    uint16_t asap() { return m_asap; }
+    void requestObjectRead() { ++m_readRequests; }
+    size_t valueSize() { return m_dpt.size(); }
+    uint8_t* valueRef() { return m_raw; }
+
+    // Test side
+    void receive(const KNXValue& v) { valueNoSend(v); }
+    void receiveRaw(const uint8_t* data, size_t size) { memcpy(m_raw, data, std::min(size, sizeof(m_raw))); }
+    uint16_t m_asap = 0;
+    uint32_t m_readRequests = 0;
+private:
+    void encode()
+    {
+        memset(m_raw, 0, sizeof(m_raw));
+        if (m_dpt.mainGroup == 16) memcpy(m_raw, m_value.m_text, sizeof(m_raw));
+        else for (size_t i = 0; i < m_dpt.size(); ++i) m_raw[i] = m_value.m_int >> (8 * (m_dpt.size() - 1 - i));
+    }
+    KNXValue m_value = KNXValue((uint8_t)0);
+    Dpt m_dpt;
+    uint8_t m_raw[14] = {};
+    GroupObjectUpdatedHandler m_callback;
+};
+
+class Platform { public: void knxUart(HardwareSerial*) {} };
+class ArduinoPlatform : public Platform { public: static inline Stream* SerialDebug = &Serial; };
+class DeviceObject { public: void induvidualAddress(uint16_t a) { address = a; } uint16_t address = 0; };
+class Bau { public: DeviceObject& deviceObject() { return m_device; } private: DeviceObject m_device; };
+
+class KnxFacade
+{
+public:
+    KnxFacade() { for (uint16_t i = 0; i < 256; ++i) m_objects[i].m_asap = i; }
+    void loop()
+    {
+        ++loops;
+        while (!m_queue.empty()) {
+            auto telegram = m_queue.front();
+            m_queue.pop_front();
+            GroupObject& go = m_objects[telegram.first];
+            if (telegram.second.size()) go.receiveRaw(telegram.second.data(), telegram.second.size());
+            if (go.callback()) go.callback()(go);
+        }
+    }
+    bool configured() { return m_configured; }
+    bool progMode() { return m_progMode; }
+    void progMode(bool on) { m_progMode = on; }
+    GroupObject& getGroupObject(uint16_t asap) { return m_objects[asap & 0xFF]; }
+    uint32_t paramInt(uint32_t addr) { return (m_params[addr] << 24) | (m_params[addr + 1] << 16) | (m_params[addr + 2] << 8) | m_params[addr + 3]; }
+    uint8_t paramByte(uint32_t addr) { return m_params[addr]; }
+    ArduinoPlatform& platform() { return m_platform; }
+    void ledPin(uint32_t) {}
+    void ledPinActiveOn(uint32_t) {}
+    void buttonPin(uint32_t) {}
+    void buttonPinInterruptOn(uint32_t) {}
+    void version(uint16_t) {}
+    void orderNumber(const uint8_t*) {}
+    void manufacturerId(uint16_t) {}
+    void bauNumber(uint32_t) {}
+    void hardwareType(const uint8_t*) {}
+    Bau& bau() { return m_bau; }
+    void readMemory() {}
+    void writeMemory() {}
+    void start() {}
+    uint16_t induvidualAddress() { return m_bau.deviceObject().address; }
+
+    // Test side: a telegram from the bus, delivered by the next loop()
+    void receive(uint16_t asap, const KNXValue& v)
+    {
+        fake::Untracked scope;
+        m_objects[asap & 0xFF].receive(v);
+        m_queue.push_back({ (uint16_t)(asap & 0xFF), {} });
+    }
+    void receiveRaw(uint16_t asap, std::vector<uint8_t> raw)
+    {
+        fake::Untracked scope;
+        m_queue.push_back({ (uint16_t)(asap & 0xFF), raw });
+    }
+    bool m_configured = true;
+    bool m_progMode = false;
+    uint8_t m_params[256] = {};
+    uint64_t loops = 0;
+private:
+    GroupObject m_objects[256];
+    std::deque<std::pair<uint16_t, std::vector<uint8_t>>> m_queue;
+    ArduinoPlatform m_platform;
+    Bau m_bau;
+};
+inline KnxFacade knx;
@@ -0,0 +1,87 @@
+// TinySoundFont of the native test environment: parses nothing, records the notes with the sample they
+// start on and renders a level per sounding voice. Loads, resets and closes are counted.
+#pragma once
+#include <Arduino.h>
+#include <set>
+
+struct tsf_stream
+{
+    void* data;
+    int (*read)(void* data, void* ptr, unsigned int size);
+    int (*skip)(void* data, unsigned int count);
+    int (*tell)(void* data);
+    int (*seek)(void* data, unsigned int pos);
+    int (*close)(void* data);
+    int (*size)(void* data);
+};
+enum TSFOutputMode { TSF_STEREO_INTERLEAVED, TSF_STEREO_UNWEAVED, TSF_MONO };
+
+namespace fake {
+struct Note { uint64_t sample; int preset, key; bool on; };
+struct Synth
+{
+    uint32_t loads = 0, closes = 0, resets = 0, maxVoices = 0;
+    bool percussion = true;         // Bank 128 present
+    uint64_t rendered = 0;          // Samples since the load
+    std::vector<Note> notes;
+};
+inline Synth synth;
+}
+
+struct tsf
+{
+    std::set<std::pair<int, int>> voices;
+    int rate = 44100;
+    void* parsed = nullptr;         // Presets and regions
+    void* voiceList = nullptr;
+};
+
+inline tsf* tsf_load(struct tsf_stream* stream)
+{
+    char riff[4];
+    if (stream->read(stream->data, riff, 4) != 4 || memcmp(riff, "RIFF", 4) != 0) return nullptr;
+    stream->seek(stream->data, stream->size(stream->data) / 2);     // Sample headers at the end
+    ++fake::synth.loads;
+    fake::synth.rendered = 0;
+    tsf* f = new tsf();
+    f->parsed = malloc(8 * 1024);
+    return f;
+}
+inline void tsf_close(tsf* f)
+{
+    if (f == nullptr) return;
+    ++fake::synth.closes;
+    free(f->parsed);
+    free(f->voiceList);
+    delete f;
+}
+inline void tsf_reset(tsf* f) { ++fake::synth.resets; f->voices.clear(); }
+inline int tsf_set_max_voices(tsf* f, int max_voices)
+{
+    fake::synth.maxVoices = max_voices;
+    f->voiceList = malloc(max_voices * 120);
+    return 1;
+}
+inline int tsf_get_presetindex(const tsf*, int bank, int preset_number)
+{
+    if (bank == 0) return preset_number;
+    return bank == 128 && fake::synth.percussion ? 128 + preset_number : -1;
+}
+inline void tsf_set_output(tsf* f, enum TSFOutputMode, int samplerate, float) { f->rate = samplerate; }
+inline void tsf_note_on(tsf* f, int preset_index, int key, float)
+{
+    fake::Untracked scope;
+    fake::synth.notes.push_back({ fake::synth.rendered, preset_index, key, true });
+    if (f->voices.size() < fake::synth.maxVoices || fake::synth.maxVoices == 0) f->voices.insert({ preset_index, key });
+}
+inline void tsf_note_off(tsf* f, int preset_index, int key)
+{
+    fake::Untracked scope;
+    fake::synth.notes.push_back({ fake::synth.rendered, preset_index, key, false });
+    f->voices.erase({ preset_index, key });
+}
+inline void tsf_render_short(tsf* f, short* buffer, int samples, int flag_mixing)
+{
+    for (int i = 0; i < samples; ++i) buffer[i] = (flag_mixing ? buffer[i] : 0) + 1000 * (short)f->voices.size();
+    fake::synth.rendered += samples;
+}
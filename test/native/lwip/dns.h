@@ -0,0 +1,36 @@
+// Name resolution answered from another thread like the lwip one: numeric addresses at once,
+// names through the host resolver.
+#pragma once
+#include <Arduino.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+typedef int8_t err_t;
+#define ERR_OK          0
+#define ERR_INPROGRESS  -5
+#define ERR_ARG         -16
+struct ip4_addr { uint32_t addr; };
+typedef struct { union { struct ip4_addr ip4; } u_addr; uint8_t type; } ip_addr_t;
+typedef void (*dns_found_callback)(const char* name, const ip_addr_t* ipaddr, void* callback_arg);
+
+inline err_t dns_gethostbyname(const char* hostname, ip_addr_t* addr, dns_found_callback found, void* callback_arg)
+{
+    in_addr numeric;
+    if (hostname == nullptr || *hostname == 0) return ERR_ARG;
+    if (inet_aton(hostname, &numeric)) {
+        addr->u_addr.ip4.addr = numeric.s_addr;
+        return ERR_OK;
+    }
+    fake::Untracked scope;
+    std::thread([name = std::string(hostname), found, callback_arg]() {
+        fake::Untracked scope;
+        addrinfo hints = {}, *result = nullptr;
+        hints.ai_family = AF_INET;
+        ip_addr_t ip = {};
+        bool ok = getaddrinfo(name.c_str(), nullptr, &hints, &result) == 0 && result;
+        if (ok) ip.u_addr.ip4.addr = ((sockaddr_in*)result->ai_addr)->sin_addr.s_addr;
+        if (result) freeaddrinfo(result);
+        found(name.c_str(), ok ? &ip : nullptr, callback_arg);
+    }).detach();
+    return ERR_INPROGRESS;
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+// Same as the ROM: reflected CRC-32 (IEEE), crc and result not inverted by the caller
+inline uint32_t crc32_le(uint32_t crc, uint8_t const* buf, uint32_t len)
+{
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        for (int i = 0; i < 8; ++i) crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
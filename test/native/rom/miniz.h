@@ -0,0 +1,49 @@
+// Inflate of the native test environment: the ROM's tinfl streaming contract on top of the host zlib, so
+// gzip images go through the firmware's header parsing, chunked input and output and trailer checks for real
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <zlib.h>
+#include <Arduino.h>
+#define TINFL_LZ_DICT_SIZE 32768
+enum { TINFL_FLAG_PARSE_ZLIB_HEADER = 1, TINFL_FLAG_HAS_MORE_INPUT = 2, TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4 };
+typedef enum { TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS = -4, TINFL_STATUS_BAD_PARAM = -3, TINFL_STATUS_ADLER32_MISMATCH = -2, TINFL_STATUS_FAILED = -1, TINFL_STATUS_DONE = 0, TINFL_STATUS_NEEDS_MORE_INPUT = 1, TINFL_STATUS_HAS_MORE_OUTPUT = 2 } tinfl_status;
+typedef struct { int m_state; char pad[10992]; } tinfl_decompressor;     // Same size as the ROM one
+#define tinfl_init(r) do { (r)->m_state = 0; } while (0)
+typedef uint8_t mz_uint8;
+typedef uint32_t mz_uint32;
+
+namespace fake {
+// The decompressor struct has no end call: one zlib stream, replaced on the next tinfl_init()
+struct Inflater
+{
+    z_stream stream = {};
+    bool open = false;
+    ~Inflater() { if (open) inflateEnd(&stream); }
+};
+inline Inflater inflater;
+}
+
+inline tinfl_status tinfl_decompress(tinfl_decompressor* r, const mz_uint8* in, size_t* inSize, mz_uint8*, mz_uint8* out, size_t* outSize, const mz_uint32 flags)
+{
+    fake::Untracked scope;
+    z_stream& z = fake::inflater.stream;
+    if (r->m_state == 0) {
+        if (fake::inflater.open) inflateEnd(&z);
+        z = {};
+        fake::inflater.open = inflateInit2(&z, (flags & TINFL_FLAG_PARSE_ZLIB_HEADER) ? 15 : -15) == Z_OK;
+        if (!fake::inflater.open) return TINFL_STATUS_FAILED;
+        r->m_state = 1;
+    }
+    z.next_in = (Bytef*)in;
+    z.avail_in = *inSize;
+    z.next_out = out;
+    z.avail_out = *outSize;
+    int result = inflate(&z, Z_SYNC_FLUSH);
+    *inSize -= z.avail_in;
+    *outSize -= z.avail_out;
+    if (result == Z_STREAM_END) return TINFL_STATUS_DONE;
+    if (result != Z_OK && result != Z_BUF_ERROR) return TINFL_STATUS_FAILED;
+    if (z.avail_out == 0) return TINFL_STATUS_HAS_MORE_OUTPUT;
+    return (flags & TINFL_FLAG_HAS_MORE_INPUT) ? TINFL_STATUS_NEEDS_MORE_INPUT : TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS;
+}
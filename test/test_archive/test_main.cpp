@@ -0,0 +1,158 @@
+// Bank archive import: entries written to the banks, the metadata committed once, and nothing half written
+// left behind when the flash fills up, the upload is cut short or the metadata does not fit this firmware.
+#include "../../src/main.cpp"
+#include <unity.h>
+
+static std::string tar(const std::vector<std::pair<std::string, std::string>>& entries, bool end = true)
+{
+    fake::Untracked scope;
+    std::string archive;
+    uint8_t block[TAR_BLOCK];
+    for (auto& e : entries) {
+        Archive::header(block, e.first.c_str(), e.second.size());
+        archive.append((const char*)block, TAR_BLOCK);
+        archive += e.second;
+        archive.append(Archive::padding(e.second.size()), 0);
+    }
+    if (end) archive.append(2 * TAR_BLOCK, 0);
+    return archive;
+}
+
+static std::string audio(size_t size)
+{
+    fake::Untracked scope;
+    std::string body = "ID3";
+    while (body.size() < size) body += (char)(body.size() * 7);
+    return body;
+}
+
+static std::string meta()
+{
+    fake::Untracked scope;
+    auto& content = fake::flash.files[META_PATH];
+    return std::string(content.begin(), content.end());
+}
+
+static fake::Response import(const std::string& archive, bool abort = false)
+{
+    fake::Untracked scope;
+    fake::Request r;
+    r.method = HTTP_POST;
+    r.uri = URI_ARCHIVE;
+    r.kind = fake::Request::MULTIPART;
+    r.filename = "bells.tar";
+    r.body = archive;
+    r.abort = abort;
+    return server.request(r);
+}
+
+void setUp()
+{
+    fake::flash.capacity = 1408 * 1024;
+    for (uint32_t channel = 1; channel <= NBBANKS; ++channel) player.removeChannel(channel);
+    player.flushConfig();
+}
+void tearDown() {}
+
+void test_banks_imported()
+{
+    fake::Response response = import(tar({ { "bank_1", audio(3000) }, { "2_door.mp3", audio(5000) } }));
+    TEST_ASSERT_EQUAL(200, response.code);
+    TEST_ASSERT_EQUAL_STRING("{\"imported\":2,\"dropped\":0}", response.body.c_str());
+    TEST_ASSERT_EQUAL(3000, fake::flash.files["/bank_1"].size());
+    TEST_ASSERT_EQUAL(5000, fake::flash.files["/bank_2"].size());
+    TEST_ASSERT_EQUAL_STRING("door.mp3", player.channelName(2).c_str());
+    TEST_ASSERT_NOT_EQUAL(0, player.hash(2));
+}
+
+void test_flash_full_removes_partial_bank()
+{
+    import(tar({ { "bank_3", audio(3000) } }));
+    TEST_ASSERT_EQUAL(Player::MP3, player.format(3));
+    fake::flash.capacity = fake::flash.used() + 4000;
+    fake::Response response = import(tar({ { "bank_1", audio(2000) }, { "bank_3", audio(20000) }, { "bank_4", audio(20000) } }));
+    TEST_ASSERT_EQUAL_STRING("{\"imported\":1,\"dropped\":2}", response.body.c_str());
+    TEST_ASSERT_EQUAL(1, fake::flash.files.count("/bank_1"));
+    TEST_ASSERT_EQUAL(0, fake::flash.files.count("/bank_3"));     // Replaced by nothing rather than a truncated file
+    TEST_ASSERT_EQUAL(0, fake::flash.files.count("/bank_4"));
+    TEST_ASSERT_EQUAL(Player::NO_FILE, player.format(3));
+    TEST_ASSERT_EQUAL(Player::NO_FILE, player.format(4));
+    TEST_ASSERT_EQUAL_STRING("", player.channelName(3).c_str());
+}
+
+void test_cut_short_removes_partial_bank()
+{
+    std::string archive = tar({ { "bank_1", audio(2000) }, { "bank_2", audio(40000) } }, false);
+    fake::Response response = import(archive.substr(0, archive.size() - 10000));
+    TEST_ASSERT_EQUAL_STRING("{\"imported\":1,\"dropped\":1}", response.body.c_str());
+    TEST_ASSERT_EQUAL(0, fake::flash.files.count("/bank_2"));
+    TEST_ASSERT_EQUAL(Player::NO_FILE, player.format(2));
+    response = import(tar({ { "bank_1", audio(2000) }, { "bank_2", audio(40000) } }), true);     // Client gone
+    TEST_ASSERT_EQUAL(0, fake::flash.files.count("/bank_2"));
+}
+
+void test_meta_committed()
+{
+    import(tar({ { "5_chime.mp3", audio(3000) } }));
+    player.setVolume(40);
+    player.flushConfig();
+    std::string saved = meta();
+    player.removeChannel(5);
+    player.setVolume(90);
+    player.flushConfig();
+    fake::Response response = import(tar({ { "5_chime.mp3", audio(3000) }, { ARCHIVE_META, saved } }));
+    TEST_ASSERT_EQUAL_STRING("{\"imported\":2,\"dropped\":0}", response.body.c_str());
+    TEST_ASSERT_EQUAL(40, player.volume());
+    TEST_ASSERT_EQUAL_STRING("chime.mp3", player.channelName(5).c_str());
+    TEST_ASSERT_EQUAL(0, fake::flash.files.count(ARCHIVE_NEWMETA));
+}
+
+void test_meta_of_other_layout_rejected()
+{
+    player.setVolume(70);
+    player.flushConfig();
+    std::string before = meta();
+    for (size_t size : { Player::configSize() - 1, Player::configSize() + 16, (size_t)0 }) {
+        fake::Untracked scope;
+        std::string other(size, 0x5A);
+        fake::Response response = import(tar({ { "6_bell.mp3", audio(3000) }, { ARCHIVE_META, other } }));
+        TEST_ASSERT_EQUAL_STRING("{\"imported\":2,\"dropped\":1}", response.body.c_str());
+        TEST_ASSERT_EQUAL(70, player.volume());
+        TEST_ASSERT_EQUAL_STRING("bell.mp3", player.channelName(6).c_str());     // Bank kept with its own metadata
+        TEST_ASSERT_EQUAL(0, fake::flash.files.count(ARCHIVE_NEWMETA));
+        player.removeChannel(6);
+        player.flushConfig();
+        TEST_ASSERT_TRUE(meta() == before);
+    }
+}
+
+void test_export_round_trip()
+{
+    import(tar({ { "7_ding.mp3", audio(4000) } }));
+    fake::Request r;
+    r.uri = URI_ARCHIVE;
+    fake::Response exported = server.request(r);
+    TEST_ASSERT_EQUAL(200, exported.code);
+    player.removeChannel(7);
+    fake::Response response = import(exported.body);
+    TEST_ASSERT_EQUAL_STRING("{\"imported\":2,\"dropped\":0}", response.body.c_str());
+    TEST_ASSERT_EQUAL_STRING("ding.mp3", player.channelName(7).c_str());
+    TEST_ASSERT_EQUAL(4000, fake::flash.files["/bank_7"].size());
+}
+
+int main()
+{
+    setup();
+    while (bootStage != BOOT_NETWORK) {
+        loop();
+        delay(10);
+    }
+    UNITY_BEGIN();
+    RUN_TEST(test_banks_imported);
+    RUN_TEST(test_flash_full_removes_partial_bank);
+    RUN_TEST(test_cut_short_removes_partial_bank);
+    RUN_TEST(test_meta_committed);
+    RUN_TEST(test_meta_of_other_layout_rejected);
+    RUN_TEST(test_export_round_trip);
+    return UNITY_END();
+}
@@ -0,0 +1,158 @@
+// Bank download: single byte ranges, the ETag from the bank CRC with If-None-Match and If-Range, no validator when
+// the CRC is 0, and uploaded file names that cannot break out of the Content-Disposition header.
+#include "../../src/main.cpp"
+#include <unity.h>
+
+static std::string audio(size_t size)
+{
+    fake::Untracked scope;
+    std::string body = "ID3";
+    while (body.size() < size) body += (char)(body.size() * 7);
+    return body;
+}
+
+// Four bytes appended so that the CRC-32 of the whole is 0: the bank has no ETag
+static std::string zeroCrc(std::string body)
+{
+    fake::Untracked scope;
+    uint32_t table[256];
+    uint8_t top[256];
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0xEDB88320 & (0 - (c & 1)));
+        table[i] = c;
+        top[c >> 24] = i;
+    }
+    // Back from the register the final inversion turns into 0, to the register before the four bytes
+    uint32_t s = ~0u;
+    for (int i = 0; i < 4; ++i) {
+        uint8_t index = top[s >> 24];
+        s = ((s ^ table[index]) << 8) | index;
+    }
+    s ^= ~crc32_le(0, (const uint8_t*)body.data(), body.size());
+    for (int i = 0; i < 4; ++i) body += (char)(s >> (8 * i));
+    return body;
+}
+
+static void upload(int bank, const std::string& name, const std::string& body)
+{
+    fake::Request r;
+    {
+        fake::Untracked scope;
+        r.method = HTTP_POST;
+        r.uri = URI_UPLOAD;
+        r.args = { { "id", std::to_string(bank) } };
+        r.kind = fake::Request::MULTIPART;
+        r.filename = name;
+        r.body = body;
+    }
+    TEST_ASSERT_EQUAL(200, server.request(r).code);
+    while (!player.idle()) {
+        loop();
+        delay(1);
+    }
+}
+
+static fake::Response download(int bank, const std::vector<std::pair<std::string, std::string>>& headers = {})
+{
+    fake::Request r;
+    {
+        fake::Untracked scope;
+        r.uri = URI_DOWNLOAD;
+        r.args = { { "id", std::to_string(bank) } };
+        r.headers = headers;
+    }
+    return server.request(r);
+}
+
+static std::string header(const fake::Response& response, const char* name)
+{
+    for (auto& h : response.headers) if (strcasecmp(h.first.c_str(), name) == 0) return h.second;
+    return "";
+}
+static bool hasHeader(const fake::Response& response, const char* name)
+{
+    for (auto& h : response.headers) if (strcasecmp(h.first.c_str(), name) == 0) return true;
+    return false;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_range_and_etag()
+{
+    std::string body = audio(5000);
+    upload(1, "bell.mp3", body);
+    fake::Response full = download(1);
+    TEST_ASSERT_EQUAL(200, full.code);
+    TEST_ASSERT_TRUE(full.body == body);
+    char etag[16];
+    snprintf(etag, sizeof(etag), "\"%x\"", crc32_le(0, (const uint8_t*)body.data(), body.size()));
+    TEST_ASSERT_EQUAL_STRING(etag, header(full, "ETag").c_str());
+
+    TEST_ASSERT_EQUAL(304, download(1, { { "If-None-Match", etag } }).code);
+    fake::Response part = download(1, { { "Range", "bytes=100-199" }, { "If-Range", etag } });
+    TEST_ASSERT_EQUAL(206, part.code);
+    TEST_ASSERT_TRUE(part.body == body.substr(100, 100));
+    TEST_ASSERT_EQUAL_STRING("bytes 100-199/5000", header(part, "Content-Range").c_str());
+    part = download(1, { { "Range", "bytes=-10" } });
+    TEST_ASSERT_TRUE(part.body == body.substr(4990));
+    // Changed since: the whole file
+    fake::Response stale = download(1, { { "Range", "bytes=100-199" }, { "If-Range", "\"1234\"" } });
+    TEST_ASSERT_EQUAL(200, stale.code);
+    TEST_ASSERT_TRUE(stale.body == body);
+    TEST_ASSERT_EQUAL(416, download(1, { { "Range", "bytes=6000-" } }).code);
+}
+
+// A CRC of 0 means unknown: no ETag, and a client that guesses "0" is not told its copy is current
+void test_no_validator_without_hash()
+{
+    std::string body = zeroCrc(audio(4000));
+    TEST_ASSERT_EQUAL_HEX32(0, crc32_le(0, (const uint8_t*)body.data(), body.size()));
+    upload(2, "door.mp3", body);
+    TEST_ASSERT_EQUAL(0, player.hash(2));
+    fake::Response full = download(2);
+    TEST_ASSERT_EQUAL(200, full.code);
+    TEST_ASSERT_FALSE(hasHeader(full, "ETag"));
+    TEST_ASSERT_TRUE(full.body == body);
+
+    fake::Response cached = download(2, { { "If-None-Match", "\"0\"" } });
+    TEST_ASSERT_EQUAL(200, cached.code);
+    TEST_ASSERT_TRUE(cached.body == body);
+    fake::Response resumed = download(2, { { "Range", "bytes=100-199" }, { "If-Range", "\"0\"" } });
+    TEST_ASSERT_EQUAL(200, resumed.code);
+    TEST_ASSERT_TRUE(resumed.body == body);
+    TEST_ASSERT_EQUAL(206, download(2, { { "Range", "bytes=100-199" } }).code);
+}
+
+void test_filename_escaped()
+{
+    upload(3, "a\"b\\c\r\nX: y;\xC3\xA9.mp3", audio(3000));
+    fake::Response response = download(3);
+    TEST_ASSERT_EQUAL(200, response.code);
+    TEST_ASSERT_EQUAL_STRING("attachment; filename=\"a\\\"b\\\\c__X: y;__.mp3\"; filename*=UTF-8''a%22b%5Cc%0D%0AX%3A%20y%3B%C3%A9.mp3",
+                             header(response, "Content-Disposition").c_str());
+
+    fake::Request r;
+    {
+        fake::Untracked scope;
+        r.uri = URI_DOWNLOAD;
+        r.args = { { "id", "3" }, { "inline", "1" } };
+    }
+    TEST_ASSERT_EQUAL(0, header(server.request(r), "Content-Disposition").find("inline; filename=\"a\\\"b"));
+}
+
+int main()
+{
+    fake::flash.mounted = true;
+    setup();
+    while (bootStage != BOOT_NETWORK) {
+        loop();
+        delay(10);
+    }
+    UNITY_BEGIN();
+    RUN_TEST(test_range_and_etag);
+    RUN_TEST(test_no_validator_without_hash);
+    RUN_TEST(test_filename_escaped);
+    return UNITY_END();
+}
@@ -0,0 +1,253 @@
+// MIDI banks on the resident synthesizer: the soundfont is parsed once and reused, events land on the sample
+// their tick and tempo give, and nothing is allocated per play.
+#define CUSTOM_FORMATS
+#define ENABLE_MP3
+#define ENABLE_MIDI
+#include "../../src/main.cpp"
+#include <unity.h>
+
+// Standard MIDI file builder
+struct Smf
+{
+    std::vector<std::string> tracks;
+    uint16_t division = 96;
+
+    Smf& track() { fake::Untracked scope; tracks.emplace_back(); return *this; }
+    Smf& event(uint32_t delta, std::initializer_list<uint8_t> bytes)
+    {
+        fake::Untracked scope;
+        std::string& t = tracks.back();
+        uint8_t vlq[4];
+        int n = 0;
+        do { vlq[n++] = delta & 0x7F; delta >>= 7; } while (delta);
+        while (n--) t += (char)(vlq[n] | (n ? 0x80 : 0));
+        for (uint8_t b : bytes) t += (char)b;
+        return *this;
+    }
+    Smf& tempo(uint32_t delta, uint32_t us) { return event(delta, { 0xFF, 0x51, 3, (uint8_t)(us >> 16), (uint8_t)(us >> 8), (uint8_t)us }); }
+    Smf& end(uint32_t delta = 0) { return event(delta, { 0xFF, 0x2F, 0 }); }
+    std::string file() const
+    {
+        fake::Untracked scope;
+        auto be = [](uint32_t v, int n) { std::string s; while (n--) s += (char)(v >> (8 * n)); return s; };
+        std::string f = "MThd" + be(6, 4) + be(tracks.size() > 1, 2) + be(tracks.size(), 2) + be(division, 2);
+        for (auto& t : tracks) f += "MTrk" + be(t.size(), 4) + t;
+        return f;
+    }
+};
+
+static void store(const char* path, const std::string& content)
+{
+    fake::Untracked scope;
+    fake::flash.files[path].assign(content.begin(), content.end());
+}
+
+static void bank(uint32_t channel, const std::string& midi)
+{
+    store(Player::pathFromChannel(channel), midi);
+    player.setChannelName(channel, "tune.mid", player.autodetect(channel));
+    TEST_ASSERT_EQUAL(Player::MIDI, player.format(channel));
+}
+
+static bool playToEnd(uint32_t channel, int limitMs = 20000)
+{
+    player.play(channel);
+    loop();
+    int64_t start = fake::clock.now();
+    do {
+        if (fake::clock.now() - start > limitMs * 1000LL) return false;
+        loop();
+        delay(1);
+    } while (!player.idle());
+    return true;
+}
+
+// Sample of the n-th note event, relative to the first one
+static int64_t at(size_t n) { return (int64_t)(fake::synth.notes[n].sample - fake::synth.notes[0].sample); }
+
+static std::string tune()
+{
+    return Smf().track()
+        .event(0, { 0x90, 60, 100 })
+        .event(96, { 0x80, 60, 0 })             // One beat at 120 bpm: 0.5 s
+        .tempo(0, 250000)
+        .event(0, { 0x90, 64, 100 })
+        .event(96, { 64, 0 })                   // Running status, velocity 0: off after 0.25 s
+        .end().file();
+}
+
+void setUp()
+{
+    fake::Untracked scope;
+    fake::synth.notes.clear();
+}
+void tearDown() {}
+
+// Parsed by setup(): the first press does not wait for it
+void test_soundfont_parsed_at_boot()
+{
+    TEST_ASSERT_EQUAL(1, fake::synth.loads);
+    TEST_ASSERT_EQUAL(1, soundFont.parses());
+}
+
+void test_events_at_their_time()
+{
+    bank(1, tune());
+    TEST_ASSERT_TRUE(playToEnd(1));
+    TEST_ASSERT_EQUAL(4, fake::synth.notes.size());
+    TEST_ASSERT_TRUE(fake::synth.notes[0].on);
+    TEST_ASSERT_FALSE(fake::synth.notes[1].on);
+    TEST_ASSERT_FALSE(fake::synth.notes[3].on);
+    TEST_ASSERT_INT_WITHIN(MIDI_RENDER, MIDI_SAMPLE_RATE / 2, at(1));
+    TEST_ASSERT_INT_WITHIN(MIDI_RENDER, MIDI_SAMPLE_RATE / 2, at(2));
+    TEST_ASSERT_INT_WITHIN(MIDI_RENDER, MIDI_SAMPLE_RATE * 3 / 4, at(3));
+    TEST_ASSERT_EQUAL(MIDI_SAMPLE_RATE, fake::i2s.rate);
+}
+
+void test_soundfont_parsed_once()
+{
+    uint32_t loads = fake::synth.loads;
+    uint32_t resets = fake::synth.resets;
+    bank(1, tune());
+    TEST_ASSERT_TRUE(playToEnd(1));
+    size_t used = fake::heap.used;
+    TEST_ASSERT_TRUE(playToEnd(1));
+    TEST_ASSERT_TRUE(playToEnd(1));
+    TEST_ASSERT_EQUAL(loads, fake::synth.loads);
+    TEST_ASSERT_GREATER_THAN(resets, fake::synth.resets);
+    TEST_ASSERT_EQUAL(MIDI_MAX_VOICES, fake::synth.maxVoices);
+    TEST_ASSERT_EQUAL(used, fake::heap.used);        // Nothing allocated per play beyond the decoder
+}
+
+void test_tracks_merged()
+{
+    bank(2, Smf().track().tempo(0, 500000).end(400)
+        .track().event(0, { 0xC0, 5 }).event(48, { 0x90, 60, 90 }).event(48, { 0x80, 60, 0 }).end()
+        .track().event(24, { 0x99, 36, 127 }).event(48, { 0x89, 36, 0 }).end()      // Percussion channel
+        .file());
+    TEST_ASSERT_TRUE(playToEnd(2));
+    TEST_ASSERT_EQUAL(4, fake::synth.notes.size());
+    TEST_ASSERT_EQUAL(128 + 0, fake::synth.notes[0].preset);     // Drum kit 0
+    TEST_ASSERT_EQUAL(36, fake::synth.notes[0].key);
+    TEST_ASSERT_EQUAL(5, fake::synth.notes[1].preset);
+    TEST_ASSERT_INT_WITHIN(MIDI_RENDER, MIDI_SAMPLE_RATE / 8, at(1));
+    TEST_ASSERT_INT_WITHIN(MIDI_RENDER, MIDI_SAMPLE_RATE / 4, at(2));
+    TEST_ASSERT_INT_WITHIN(MIDI_RENDER, MIDI_SAMPLE_RATE * 3 / 8, at(3));
+}
+
+void test_sysex_and_meta_skipped()
+{
+    bank(3, Smf().track()
+        .event(0, { 0xF0, 3, 0x7E, 0x7F, 0xF7 })
+        .event(0, { 0xFF, 0x03, 4, 'b', 'e', 'l', 'l' })
+        .event(0, { 0xB0, 7, 100 })
+        .event(0, { 0xE0, 0, 64 })
+        .event(0, { 0x90, 67, 80 })
+        .event(96, { 0x80, 67, 0 })
+        .end().file());
+    TEST_ASSERT_TRUE(playToEnd(3));
+    TEST_ASSERT_EQUAL(2, fake::synth.notes.size());
+    TEST_ASSERT_EQUAL(67, fake::synth.notes[0].key);
+}
+
+void test_truncated_file_ends()
+{
+    std::string midi = tune();
+    bank(4, midi.substr(0, midi.size() - 6));
+    TEST_ASSERT_TRUE(playToEnd(4));
+    std::string garbage = "MThd" + std::string("\0\0\0\x06\0\0\0\x01\0\x60" "MTrk\x7F\xFF\xFF\xFF", 18) + std::string(64, '\xFF');
+    bank(5, garbage);
+    TEST_ASSERT_TRUE(playToEnd(5));
+}
+
+void test_smpte_division_refused()
+{
+    Smf smpte;
+    smpte.division = 0xE728;
+    bank(6, smpte.track().event(0, { 0x90, 60, 100 }).end(10).file());
+    player.play(6);
+    for (int i = 0; i < 10; ++i) loop();
+    TEST_ASSERT_TRUE(player.idle());
+    TEST_ASSERT_EQUAL(0, fake::synth.notes.size());
+}
+
+void test_soundfont_replaced_reparsed()
+{
+    bank(1, tune());
+    TEST_ASSERT_TRUE(playToEnd(1));
+    uint32_t loads = fake::synth.loads, closes = fake::synth.closes;
+    fake::Request r;
+    r.method = HTTP_POST;
+    r.uri = URI_UPLOAD;
+    r.kind = fake::Request::MULTIPART;
+    r.filename = "piano.sf2";
+    r.body = std::string("RIFF") + std::string(2000, 'x');
+    TEST_ASSERT_EQUAL(200, server.request(r).code);
+    TEST_ASSERT_EQUAL(closes + 1, fake::synth.closes);
+    loop();
+    TEST_ASSERT_EQUAL(loads + 1, fake::synth.loads);     // Before the next play
+    TEST_ASSERT_TRUE(playToEnd(1));
+    TEST_ASSERT_EQUAL(loads + 1, fake::synth.loads);
+}
+
+// A chord held past the voice limit: the oldest notes are released for the new ones, never more held than allocated
+void test_voices_capped()
+{
+    const int notes = MIDI_MAX_VOICES + 6;
+    Smf smf;
+    smf.track();
+    for (int key = 0; key < notes; ++key) smf.event(key ? 0 : 10, { 0x90, (uint8_t)(40 + key), 100 });
+    for (int key = 0; key < notes; ++key) smf.event(key ? 0 : 96, { 0x80, (uint8_t)(40 + key), 0 });
+    bank(7, smf.end().file());
+    TEST_ASSERT_TRUE(playToEnd(7));
+    int held = 0, heldMax = 0;
+    std::vector<int> released;
+    for (auto& n : fake::synth.notes) {
+        held += n.on ? 1 : -1;
+        heldMax = MAX(heldMax, held);
+        if (!n.on) released.push_back(n.key);
+    }
+    TEST_ASSERT_EQUAL(MIDI_MAX_VOICES, heldMax);
+    TEST_ASSERT_EQUAL(0, held);
+    TEST_ASSERT_EQUAL(notes, released.size());      // Each note released once, the stolen ones early
+    for (int i = 0; i < notes; ++i) TEST_ASSERT_EQUAL(40 + i, released[i]);
+    TEST_ASSERT_FALSE(fake::synth.notes[MIDI_MAX_VOICES].on);
+    TEST_ASSERT_EQUAL(40, fake::synth.notes[MIDI_MAX_VOICES].key);
+}
+
+void test_without_soundfont_nothing_plays()
+{
+    soundFont.unload();
+    {
+        fake::Untracked scope;
+        fake::flash.files.erase(SOUNDFONT_PATH);
+    }
+    bank(1, tune());
+    player.play(1);
+    for (int i = 0; i < 10; ++i) loop();
+    TEST_ASSERT_TRUE(player.idle());
+    TEST_ASSERT_EQUAL(0, fake::synth.notes.size());
+}
+
+int main()
+{
+    fake::flash.mounted = true;
+    store(SOUNDFONT_PATH, std::string("RIFF") + std::string(4000, 's'));
+    setup();
+    while (bootStage != BOOT_NETWORK) {
+        loop();
+        delay(10);
+    }
+    UNITY_BEGIN();
+    RUN_TEST(test_soundfont_parsed_at_boot);
+    RUN_TEST(test_events_at_their_time);
+    RUN_TEST(test_soundfont_parsed_once);
+    RUN_TEST(test_tracks_merged);
+    RUN_TEST(test_sysex_and_meta_skipped);
+    RUN_TEST(test_truncated_file_ends);
+    RUN_TEST(test_smpte_division_refused);
+    RUN_TEST(test_soundfont_replaced_reparsed);
+    RUN_TEST(test_voices_capped);
+    RUN_TEST(test_without_soundfont_nothing_plays);
+    return UNITY_END();
+}
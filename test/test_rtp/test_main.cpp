@@ -0,0 +1,287 @@
+// Intercom RTP receiver fed by a loopback sender: payload types, jitter buffer, and malformed headers
+// that must be dropped without reading past the packet.
+#include "../../src/main.cpp"
+#include <unity.h>
+
+static const uint16_t port = 20000 + getpid() % 10000;     // Suites may run side by side
+
+struct Sender
+{
+    Sender()
+    {
+        fake::Untracked scope;
+        m_fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    }
+    ~Sender() { ::close(m_fd); }
+    void send(const std::vector<uint8_t>& packet)
+    {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ::sendto(m_fd, packet.data(), packet.size(), 0, (sockaddr*)&addr, sizeof(addr));
+    }
+private:
+    int m_fd;
+};
+
+// 12 byte header, payload appended by the caller
+static std::vector<uint8_t> header(uint16_t seq, uint8_t type, uint32_t timestamp = 0, uint8_t first = 0x80)
+{
+    fake::Untracked scope;
+    return { first, type, (uint8_t)(seq >> 8), (uint8_t)seq,
+             (uint8_t)(timestamp >> 24), (uint8_t)(timestamp >> 16), (uint8_t)(timestamp >> 8), (uint8_t)timestamp,
+             0x12, 0x34, 0x56, 0x78 };
+}
+
+static std::vector<uint8_t> l16(uint16_t seq, size_t count, int16_t value, uint8_t type = 96)
+{
+    std::vector<uint8_t> p = header(seq, type, seq * count);
+    fake::Untracked scope;
+    for (size_t i = 0; i < count; ++i) {
+        p.push_back((uint16_t)value >> 8);
+        p.push_back((uint8_t)value);
+    }
+    return p;
+}
+
+static Sender* sender;
+static RtpReceiver* rtp;
+static AudioOutputI2S* out;
+
+// Lets the loopback deliver, then runs the receiver
+static void settle(int loops = 5)
+{
+    for (int i = 0; i < loops; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        rtp->loop(out);
+    }
+}
+
+void setUp()
+{
+    fake::i2s.paced = false;
+    fake::i2s.keep = 4096;
+    fake::i2s.recorded.clear();
+    rtp = new RtpReceiver();
+    out = new AudioOutputI2S();
+    out->begin();
+    TEST_ASSERT_TRUE(rtp->begin(IPAddress(0, 0, 0, 0), port));
+}
+void tearDown()
+{
+    size_t used = fake::heap.used;
+    delete rtp;
+    TEST_ASSERT_LESS_THAN(used - sizeof(RtpReceiver), fake::heap.used);     // Slots and packet buffer freed too
+    delete out;
+    fake::i2s.paced = true;
+    fake::i2s.keep = 0;
+}
+
+void test_l16_plays_after_target_depth()
+{
+    for (uint16_t seq = 100; seq < 100 + INTERCOM_TARGET - 1; ++seq) sender->send(l16(seq, 160, 1000));
+    settle();
+    TEST_ASSERT_EQUAL(INTERCOM_TARGET - 1, rtp->received());
+    TEST_ASSERT_EQUAL(0, fake::i2s.recorded.size());
+    sender->send(l16(100 + INTERCOM_TARGET - 1, 160, 1000));
+    settle();
+    TEST_ASSERT_GREATER_OR_EQUAL(2 * 160, fake::i2s.recorded.size());
+    TEST_ASSERT_EQUAL(1000, fake::i2s.recorded[0]);
+    TEST_ASSERT_EQUAL(1000, fake::i2s.recorded[1]);
+    TEST_ASSERT_EQUAL(INTERCOM_RATE, fake::i2s.rate);
+}
+
+void test_payload_types()
+{
+    for (uint16_t seq = 0; seq < INTERCOM_TARGET; ++seq) {
+        std::vector<uint8_t> p = header(seq, 0);    // PCMU
+        p.insert(p.end(), 160, 0xFF);               // Zero level
+        sender->send(p);
+    }
+    settle();
+    TEST_ASSERT_EQUAL(8000, fake::i2s.rate);
+    TEST_ASSERT_EQUAL(0, fake::i2s.recorded[0]);
+    TEST_ASSERT_EQUAL(INTERCOM_TARGET, rtp->received());
+}
+
+void test_unknown_type_dropped()
+{
+    for (uint16_t seq = 0; seq < INTERCOM_TARGET; ++seq) sender->send(l16(seq, 160, 1000, 34));   // H.263
+    settle();
+    TEST_ASSERT_EQUAL(0, fake::i2s.recorded.size());
+}
+
+void test_padding_removed()
+{
+    for (uint16_t seq = 0; seq < INTERCOM_TARGET; ++seq) {
+        std::vector<uint8_t> p = l16(seq, 4, 500);
+        p[0] |= 0x20;
+        p.insert(p.end(), { 0x7F, 0x7F, 0x7F, 4 });  // Would be one more sample
+        sender->send(p);
+    }
+    settle();
+    TEST_ASSERT_EQUAL(INTERCOM_TARGET, rtp->received());
+    for (size_t i = 0; i < fake::i2s.recorded.size(); ++i) TEST_ASSERT_NOT_EQUAL(0x7F7F, fake::i2s.recorded[i]);
+}
+
+void test_padding_zero_dropped()
+{
+    std::vector<uint8_t> p = l16(0, 4, 500);
+    p[0] |= 0x20;
+    p.back() = 0;
+    sender->send(p);
+    settle();
+    TEST_ASSERT_EQUAL(0, rtp->received());
+}
+
+void test_padding_beyond_payload_dropped()
+{
+    std::vector<uint8_t> p = l16(0, 4, 500);      // 8 bytes of payload
+    p[0] |= 0x20;
+    p.back() = 9;
+    sender->send(p);
+    p.back() = 255;                               // Beyond the whole packet
+    sender->send(p);
+    std::vector<uint8_t> bare = header(1, 96);    // Padding bit, no payload: the count is a header byte
+    bare[0] |= 0x20;
+    sender->send(bare);
+    settle();
+    TEST_ASSERT_EQUAL(0, rtp->received());
+}
+
+void test_padding_whole_payload_dropped()
+{
+    std::vector<uint8_t> p = l16(0, 4, 500);
+    p[0] |= 0x20;
+    p.back() = 8;
+    sender->send(p);
+    settle();
+    TEST_ASSERT_EQUAL(0, rtp->received());
+}
+
+void test_csrc_list_beyond_packet_dropped()
+{
+    std::vector<uint8_t> p = l16(0, 8, 500);      // 16 bytes of payload, 15 CSRCs need 60
+    p[0] |= 0x0F;
+    sender->send(p);
+    p[0] |= 0x10;                                 // And an extension read after the list
+    sender->send(p);
+    settle();
+    TEST_ASSERT_EQUAL(0, rtp->received());
+}
+
+void test_csrc_list_skipped()
+{
+    for (uint16_t seq = 0; seq < INTERCOM_TARGET; ++seq) {
+        std::vector<uint8_t> p = header(seq, 96);
+        p[0] |= 2;
+        p.insert(p.end(), 8, 0x55);               // Two CSRCs
+        p.insert(p.end(), { 0x01, 0x00, 0x01, 0x00 });
+        sender->send(p);
+    }
+    settle();
+    TEST_ASSERT_EQUAL(INTERCOM_TARGET, rtp->received());
+    TEST_ASSERT_EQUAL(256, fake::i2s.recorded[0]);
+}
+
+void test_extension_beyond_packet_dropped()
+{
+    std::vector<uint8_t> p = header(0, 96);
+    p[0] |= 0x10;
+    p.insert(p.end(), { 0xBE, 0xDE });            // Extension header cut short
+    sender->send(p);
+    p.insert(p.end(), { 0x40, 0x00, 0x01, 0x00 });  // 16384 words announced
+    sender->send(p);
+    settle();
+    TEST_ASSERT_EQUAL(0, rtp->received());
+}
+
+void test_extension_skipped()
+{
+    for (uint16_t seq = 0; seq < INTERCOM_TARGET; ++seq) {
+        std::vector<uint8_t> p = header(seq, 96);
+        p[0] |= 0x10;
+        p.insert(p.end(), { 0xBE, 0xDE, 0x00, 0x01, 0xAA, 0xAA, 0xAA, 0xAA });
+        p.insert(p.end(), { 0x02, 0x00 });
+        sender->send(p);
+    }
+    settle();
+    TEST_ASSERT_EQUAL(INTERCOM_TARGET, rtp->received());
+    TEST_ASSERT_EQUAL(512, fake::i2s.recorded[0]);
+}
+
+void test_late_and_lost_packets()
+{
+    for (uint16_t seq : { 10, 11, 12, 14, 15 }) sender->send(l16(seq, 160, 1000));
+    settle(2);
+    sender->send(l16(11, 160, 1000));             // Already played
+    settle(2);
+    TEST_ASSERT_EQUAL(1, rtp->late());
+    TEST_ASSERT_GREATER_OR_EQUAL(1, rtp->lost());
+    TEST_ASSERT_GREATER_OR_EQUAL(1, rtp->concealed());
+}
+
+// Random headers over valid and short packets: nothing may be accepted with a header past the data
+void test_random_packets()
+{
+    srand(1);
+    for (int i = 0; i < 20000; ++i) {
+        fake::Untracked scope;
+        std::vector<uint8_t> p(rand() % 80);
+        for (auto& b : p) b = rand();
+        if (p.size()) p[0] = (p[0] & 0x3F) | 0x80;
+        sender->send(p);
+        if (i % 100 == 0) settle(1);
+    }
+    settle();
+    TEST_ASSERT_LESS_THAN(20000, rtp->received());
+}
+
+void test_player_intercom()
+{
+    delete rtp;
+    rtp = new RtpReceiver();                      // Port left to the player
+    player.setIntercom(IPAddress(0, 0, 0, 0), port);
+    TEST_ASSERT_TRUE(player.intercom(true));
+    uint64_t samples = fake::i2s.samples;
+    for (uint16_t seq = 0; seq < 20; ++seq) {
+        sender->send(l16(seq, 320, 2000));
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        loop();
+    }
+    TEST_ASSERT_EQUAL(20, player.rtp().received());
+    TEST_ASSERT_GREATER_THAN(samples, fake::i2s.samples);
+    for (int i = 0; i < INTERCOM_TIMEOUT / 10 + 100 && player.rtp().active(); ++i) {
+        loop();
+        delay(10);
+    }
+    TEST_ASSERT_FALSE(player.rtp().active());     // Sender silent: intercom ended
+    TEST_ASSERT_TRUE(player.idle());
+}
+
+int main()
+{
+    setup();
+    while (bootStage != BOOT_NETWORK) {
+        loop();
+        delay(10);
+    }
+    sender = new Sender();
+    UNITY_BEGIN();
+    RUN_TEST(test_l16_plays_after_target_depth);
+    RUN_TEST(test_payload_types);
+    RUN_TEST(test_unknown_type_dropped);
+    RUN_TEST(test_padding_removed);
+    RUN_TEST(test_padding_zero_dropped);
+    RUN_TEST(test_padding_beyond_payload_dropped);
+    RUN_TEST(test_padding_whole_payload_dropped);
+    RUN_TEST(test_csrc_list_beyond_packet_dropped);
+    RUN_TEST(test_csrc_list_skipped);
+    RUN_TEST(test_extension_beyond_packet_dropped);
+    RUN_TEST(test_extension_skipped);
+    RUN_TEST(test_late_and_lost_packets);
+    RUN_TEST(test_random_packets);
+    RUN_TEST(test_player_intercom);
+    return UNITY_END();
+}
@@ -0,0 +1,397 @@
+// Soak: months of doorbell traffic on the virtual clock, across the millis() wrap once with timers running and once
+// idle. Bell presses, volume bursts, uploads, status and diag polls, the auto-off timer, programming mode and reboot
+// requests, with the heap high-water mark, fragmentation, flash writes and event timing checked against the limits below.
+// The KNX clock is set rarely enough that the week time is read more than 2^32 ms past a late Sunday sync.
+#include "../../src/main.cpp"
+#include <unity.h>
+#include <random>
+
+#ifndef SOAK_DAYS
+#define SOAK_DAYS           100     // Two millis() wraps
+#endif
+#define SOAK_SEED           42
+#define SOAK_BANKS          4
+#define SOAK_PRESSES        20      // Per day
+#define SOAK_OUTPUTS        5
+#define SOAK_BURSTS         3       // Volume bursts per day
+#define SOAK_BURST          5       // Telegrams per burst, 200 ms apart
+#define SOAK_STATUS         ( 10 * 60 )     // s between status polls
+#define SOAK_DIAG           ( 60 * 60 )     // s between diag polls
+#define SOAK_UPLOAD_DAYS    7
+#define SOAK_AUTO_OFF       3000    // ms, output 1
+#define SOAK_WARMUP_DAYS    SOAK_UPLOAD_DAYS    // Every path taken once before the heap baseline
+#define SOAK_IDLE_STEP      1000    // ms between loops while nothing plays or runs
+#define SOAK_CLOCK_DAYS     45      // Between time telegrams, Sunday 23:00: 43 days later the week time passes 2^32 ms
+
+// Regression limits
+#define SOAK_LEAK           256     // Bytes the heap may grow over the baseline
+#define SOAK_MIN_FREE       ( 120 * 1024 )
+#define SOAK_FRAGMENTATION  ( 8 * 1024 )    // Free bytes not in the largest block, at rest
+#define SOAK_PRESS_LATENCY  100     // ms from telegram to first sample
+#define SOAK_TIMER_SLACK    100     // ms late allowed on auto-off, reboot and programming mode timeouts, seen after
+                                    // the light sleep the loop that ended them may enter (IDLE_SLEEP_WIFI)
+
+#define MS                  1000LL                  // Virtual clock units, us
+#define SEC                 ( 1000 * MS )
+#define DAY                 ( 24 * 60 * 60 * SEC )
+#define WRAP                ( (1LL << 32) * MS )    // us when millis() wraps
+
+enum Kind { PRESS, OUTPUT_ON, VOLUME, STATUS, DIAG, UPLOAD, PROG_MODE, REBOOT, CLOCK, DAY_END };
+struct Event { int64_t time; Kind kind; int arg; };
+
+struct Stats
+{
+    uint32_t presses = 0, uploads = 0, polls = 0, bursts = 0, changes = 0, timers = 0, wraps = 0;
+    int64_t pressLatencyMax = 0, timerLateMax = 0;
+    size_t baseline = 0, usedMax = 0, largestMin = SIZE_MAX, fragmentationMax = 0;
+    uint64_t metaWrites = 0, bankWrites = 0;
+    int64_t clockSet = -1;      // us of the last time telegram
+};
+static Stats stats;
+static std::vector<Event> events;
+static std::mt19937 rng(SOAK_SEED);
+
+static int64_t nowUs() { return fake::clock.now(); }
+static bool busy()
+{
+    if (!player.idle() || knx.progMode() || rebootRequested) return true;
+    for (int i = 0; i < outputCount; ++i) {
+        if (!output[i].idle() || digitalRead(outputPins[i]) == HIGH) return true;
+    }
+    return false;
+}
+static void step()
+{
+    loop();
+    delay(busy() ? 1 : SOAK_IDLE_STEP);
+}
+static void advanceTo(int64_t time)
+{
+    while (nowUs() < time) {
+        loop();
+        int64_t left = (time - nowUs() + MS - 1) / MS;     // The loop may have slept past it
+        if (left > 0) delay(MIN(busy() ? 1 : SOAK_IDLE_STEP, left));
+    }
+}
+// Steps until done() or the limit, returns the ms it took
+template<typename F> static int64_t until(F done, int64_t limitMs)
+{
+    int64_t start = nowUs();
+    while (!done() && nowUs() - start < limitMs * MS) {
+        loop();
+        delay(1);
+    }
+    return (nowUs() - start) / MS;
+}
+
+static std::string audio(size_t size, uint8_t seed)
+{
+    fake::Untracked scope;
+    std::string body = "ID3";
+    while (body.size() < size) body += (char)(body.size() * seed);
+    return body;
+}
+static fake::Response get(const char* uri)
+{
+    fake::Request r;
+    {
+        fake::Untracked scope;
+        r.uri = uri;
+    }
+    return server.request(r);
+}
+static void upload(int bank, uint8_t seed)
+{
+    fake::Request r;
+    {
+        fake::Untracked scope;
+        r.method = HTTP_POST;
+        r.uri = URI_UPLOAD;
+        r.args = { { "id", std::to_string(bank) } };
+        r.kind = fake::Request::MULTIPART;
+        r.filename = "bell.mp3";
+        r.body = audio(8000 + seed * 100, seed);
+    }
+    TEST_ASSERT_EQUAL(200, server.request(r).code);
+    ++stats.uploads;
+}
+static void telegram(uint16_t goNb, const KNXValue& value)
+{
+    knx.receive(goNb, value);
+    loop();
+}
+
+// The day's traffic at random times, plus the timers started just before a millis() wrap in it
+static void plan(int day)
+{
+    fake::Untracked scope;
+    int64_t start = day * DAY, end = (day + 1) * DAY;
+    std::uniform_int_distribution<int64_t> at(start, end - 60 * SEC);
+    for (int i = 0; i < SOAK_PRESSES; ++i) events.push_back({ at(rng), PRESS, 1 + (int)(rng() % SOAK_BANKS) });
+    for (int i = 0; i < SOAK_OUTPUTS; ++i) events.push_back({ at(rng), OUTPUT_ON, 0 });
+    for (int i = 0; i < SOAK_BURSTS; ++i) events.push_back({ at(rng), VOLUME, 0 });
+    for (int64_t t = start; t < end; t += SOAK_STATUS * SEC) events.push_back({ t + 17 * SEC, STATUS, 0 });
+    for (int64_t t = start; t < end; t += SOAK_DIAG * SEC) events.push_back({ t + 31 * SEC, DIAG, 0 });
+    if (day % SOAK_UPLOAD_DAYS == 0) events.push_back({ start + DAY / 2, UPLOAD, 1 + (day / SOAK_UPLOAD_DAYS) % SOAK_BANKS });
+    if (day % SOAK_CLOCK_DAYS == 0) events.push_back({ start + 10 * SEC, CLOCK, 0 });
+    // Odd wraps are crossed by running timers, even ones by the idle loop with the timers started after them
+    for (int64_t wrap = WRAP; wrap < (int64_t)SOAK_DAYS * DAY; wrap += WRAP) {
+        if (wrap < start || wrap >= end) continue;
+        int64_t at = wrap / WRAP % 2 ? wrap : wrap + 5 * 60 * SEC;
+        events.push_back({ at - 5 * 60 * SEC, PROG_MODE, 0 });
+        events.push_back({ at - 20 * SEC, PRESS, 1 });
+        events.push_back({ at - 1000 * MS, OUTPUT_ON, 0 });
+        events.push_back({ at - 500 * MS, REBOOT, 0 });
+        ++stats.wraps;
+    }
+    events.push_back({ end - 1, DAY_END, day });
+    std::stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) { return a.time < b.time; });
+}
+
+static void lateBy(int64_t tookMs, int64_t dueMs, const char* what)
+{
+    int64_t late = tookMs - dueMs;
+    stats.timerLateMax = MAX(stats.timerLateMax, late);
+    ++stats.timers;
+    if (late < 0 || late > SOAK_TIMER_SLACK + IDLE_SLEEP_WIFI / 1000) {
+        char message[96];
+        snprintf(message, sizeof(message), "%s after %lld ms instead of %lld ms, millis() %lu", what, (long long)tookMs, (long long)dueMs, millis());
+        TEST_FAIL_MESSAGE(message);
+    }
+}
+
+static void run(const Event& e)
+{
+    switch (e.kind) {
+        case PRESS: {
+            int64_t pressed = nowUs();
+            telegram(GO_PLAYER + Player::GO_BANK + e.arg - 1, true);
+            int64_t latency = until([pressed]() { return fake::i2s.started >= pressed; }, 1000);
+            TEST_ASSERT_LESS_OR_EQUAL(SOAK_PRESS_LATENCY, latency);
+            stats.pressLatencyMax = MAX(stats.pressLatencyMax, latency);
+            ++stats.presses;
+        }; break;
+        case OUTPUT_ON: {
+            telegram(GO_OUTPUTS + Output::GO_ONOFF, true);
+            lateBy(until([]() { return digitalRead(outputPins[0]) == LOW; }, 10 * SOAK_AUTO_OFF), SOAK_AUTO_OFF, "auto-off");
+        }; break;
+        case VOLUME: {
+            uint8_t volume = player.volume();
+            for (int i = 0; i < SOAK_BURST; ++i) {
+                telegram(GO_PLAYER + Player::GO_VOLUME, (uint8_t)(20 + rng() % 4 * 20));
+                until([]() { return false; }, 200);
+            }
+            stats.changes += player.volume() != volume;
+            ++stats.bursts;
+        }; break;
+        case STATUS: {
+            fake::Response response = get(URI_STATUS);
+            TEST_ASSERT_EQUAL(200, response.code);
+            ++stats.polls;
+        }; break;
+        case DIAG: TEST_ASSERT_EQUAL(200, get(URI_DIAG).code); break;
+        case UPLOAD: upload(e.arg, stats.uploads % 50 + 3); break;
+        case PROG_MODE: {
+            knx.progMode(true);
+            lateBy(until([]() { return !knx.progMode(); }, 2 * PROG_TIMEOUT), PROG_TIMEOUT, "programming mode");
+        }; break;
+        case REBOOT: {
+            uint32_t restarts = fake::board.restarts;
+            requestReboot();
+            lateBy(until([restarts]() { return fake::board.restarts != restarts; }, 10 * REBOOT_TIMER * 1000), REBOOT_TIMER * 1000, "reboot");
+        }; break;
+        case CLOCK: {
+            knx.receiveRaw(GO_TIME, { 7 << 5 | 23, 0, 0 });     // DPT 10.001 Sunday 23:00:00
+            loop();
+            stats.clockSet = nowUs();
+        }; break;
+        case DAY_END: {
+            until([]() { return !busy(); }, 60 * 1000);
+            uint32_t expected = (6 * DAY_MS + 23 * 60 * MINUTE_MS + (nowUs() - stats.clockSet) / MS) % WEEK_MS;
+            TEST_ASSERT_TRUE(wallClock.timeKnown());
+            TEST_ASSERT_UINT32_WITHIN(1, expected, wallClock.weekTime());
+            size_t free = fake::heap.freeBytes(), largest = fake::heap.largestFree();
+            stats.usedMax = MAX(stats.usedMax, fake::heap.used);
+            stats.largestMin = MIN(stats.largestMin, largest);
+            stats.fragmentationMax = MAX(stats.fragmentationMax, free - largest);
+            if (e.arg + 1 == SOAK_WARMUP_DAYS) stats.baseline = fake::heap.used;
+            if (e.arg + 1 > SOAK_WARMUP_DAYS && fake::heap.used > stats.baseline + SOAK_LEAK) {
+                char message[96];
+                snprintf(message, sizeof(message), "day %d: %u bytes used, %u after warm-up", e.arg + 1, (unsigned)fake::heap.used, (unsigned)stats.baseline);
+                TEST_FAIL_MESSAGE(message);
+            }
+            TEST_ASSERT_LESS_OR_EQUAL(SOAK_FRAGMENTATION, free - largest);
+        }; break;
+    }
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_soak()
+{
+    uint64_t bankWrites = 0;
+    for (int day = 0; day < SOAK_DAYS; ++day) {
+        plan(day);
+        while (!events.empty() && events.front().time < (day + 1) * DAY) {
+            Event e = events.front();
+            {
+                fake::Untracked scope;
+                events.erase(events.begin());
+            }
+            advanceTo(e.time);
+            run(e);
+        }
+    }
+    for (int bank = 1; bank <= SOAK_BANKS; ++bank) bankWrites += fake::flash.fileWrites[Player::pathFromChannel(bank)];
+    stats.metaWrites = fake::flash.fileWrites[META_PATH];
+    stats.bankWrites = bankWrites;
+
+    char message[200];
+    snprintf(message, sizeof(message), "%d days, %u wraps: %u presses, %u bursts (%u changed the volume), %u uploads, %u status polls, %u timers",
+             SOAK_DAYS, stats.wraps, stats.presses, stats.bursts, stats.changes, stats.uploads, stats.polls, stats.timers);
+    TEST_MESSAGE(message);
+    snprintf(message, sizeof(message), "heap: baseline %u, max used %u, high-water %u, least largest block %u, most fragmented %u, failures %u",
+             (unsigned)stats.baseline, (unsigned)stats.usedMax, (unsigned)fake::heap.peak, (unsigned)stats.largestMin,
+             (unsigned)stats.fragmentationMax, (unsigned)fake::heap.failures);
+    TEST_MESSAGE(message);
+    snprintf(message, sizeof(message), "flash: %llu /meta writes, %llu bank writes, %llu bytes; latency max %lld ms, timers late max %lld ms",
+             (unsigned long long)stats.metaWrites, (unsigned long long)stats.bankWrites, (unsigned long long)fake::flash.bytesWritten,
+             (long long)stats.pressLatencyMax, (long long)stats.timerLateMax);
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_EQUAL(SOAK_DAYS * SOAK_PRESSES + stats.wraps, stats.presses);
+    TEST_ASSERT_EQUAL(0, fake::heap.failures);
+    TEST_ASSERT_GREATER_OR_EQUAL(SOAK_MIN_FREE, fake::heap.minFree());
+    // /meta written once per settled volume change and per upload (bank name, then the benchmark result), never per telegram
+    TEST_ASSERT_LESS_OR_EQUAL(stats.changes + 2 * stats.uploads, stats.metaWrites);
+    TEST_ASSERT_EQUAL(stats.uploads, stats.bankWrites);
+}
+
+static size_t metaSize()
+{
+    auto it = fake::flash.files.find(META_PATH);
+    return it == fake::flash.files.end() ? 0 : it->second.size();
+}
+
+// Flash full: the short /meta write is not taken for done, the next flush writes it again
+void test_failed_meta_write_retried()
+{
+    uint32_t writes = player.configWrites();
+    size_t capacity = fake::flash.capacity;
+    fake::flash.capacity = fake::flash.used() - metaSize() + 100;     // Room for part of it once truncated
+    telegram(GO_PLAYER + Player::GO_VOLUME, (uint8_t)(player.volume() == 50 ? 60 : 50));
+    until([]() { return false; }, CONFIG_FLUSH_DELAY + 100);
+    TEST_ASSERT_EQUAL(writes, player.configWrites());
+    TEST_ASSERT_NOT_EQUAL(player.configSize(), metaSize());
+    fake::flash.capacity = capacity;
+    player.flushConfig();
+    TEST_ASSERT_EQUAL(writes + 1, player.configWrites());
+    TEST_ASSERT_EQUAL(player.configSize(), metaSize());
+}
+
+// Format with the settings already at their defaults: /meta is written again for the export
+void test_meta_recreated_after_format()
+{
+    TEST_ASSERT_EQUAL(200, get(URI_FORMAT).code);
+    player.flushConfig();
+    TEST_ASSERT_EQUAL(player.configSize(), metaSize());
+    TEST_ASSERT_EQUAL(200, get(URI_FORMAT).code);
+    TEST_ASSERT_EQUAL(0, metaSize());
+    player.flushConfig();
+    TEST_ASSERT_EQUAL(player.configSize(), metaSize());
+}
+
+// A day without the access point: the open soft AP serves the setup page only, and the attempts space out to the
+// longest backoff instead of the portal coming back every quarter of an hour
+void test_portal_backoff()
+{
+    fake::network.accessPoint = false;
+    fake::network.connected = false;
+    int64_t end = nowUs() + DAY, backoffStart = 0, backoffMax = 0;
+    bool checked = false;
+    uint32_t portals = fake::network.portals;
+    while (nowUs() < end) {
+        step();
+        if (serverState == BACKOFF && backoffStart == 0) backoffStart = nowUs();
+        if (serverState != BACKOFF && backoffStart) {
+            backoffMax = MAX(backoffMax, nowUs() - backoffStart);
+            backoffStart = 0;
+        }
+        if (serverState == PORTAL && !checked) {
+            TEST_ASSERT_EQUAL(200, get(URI_ROOT).code);
+            TEST_ASSERT_EQUAL(302, get(URI_FORMAT).code);
+            TEST_ASSERT_EQUAL(302, get(URI_STATUS).code);
+            TEST_ASSERT_NOT_EQUAL(0, metaSize());
+            fake::Request r;
+            {
+                fake::Untracked scope;
+                r.method = HTTP_POST;
+                r.uri = URI_UPLOAD;
+                r.args = { { "id", "1" } };
+                r.kind = fake::Request::MULTIPART;
+                r.filename = "evil.mp3";
+                r.body = audio(4000, 99);
+            }
+            uint64_t writes = fake::flash.fileWrites[Player::pathFromChannel(1)];
+            TEST_ASSERT_EQUAL(302, server.request(r).code);
+            TEST_ASSERT_EQUAL(writes, fake::flash.fileWrites[Player::pathFromChannel(1)]);
+            checked = true;
+        }
+    }
+    TEST_ASSERT_TRUE(checked);
+    TEST_ASSERT_INT_WITHIN(SOAK_IDLE_STEP * MS, WIFI_BACKOFF_MAX * MS, backoffMax);
+    // Each cycle: WIFI_PORTAL_RETRIES attempts at most WIFI_BACKOFF_MAX apart, then the portal timeout
+    TEST_ASSERT_LESS_OR_EQUAL(DAY / ((WIFI_PORTAL_RETRIES * WIFI_BACKOFF_MAX + PROG_TIMEOUT) * MS) + 2, fake::network.portals - portals);
+
+    fake::network.accessPoint = true;
+    until([]() { return serverState == RUNNING; }, WIFI_BACKOFF_MAX + WIFI_CONNECT_TIMEOUT + 1000);
+    TEST_ASSERT_EQUAL(RUNNING, serverState);
+    TEST_ASSERT_FALSE(fake::network.softAP);
+}
+
+// Station connected: light sleep once no HTTP request came for IDLE_HTTP, in slices the association survives
+void test_sleep_while_connected()
+{
+    TEST_ASSERT_EQUAL(RUNNING, serverState);
+    upload(1, 5);       // Formatted by test_meta_recreated_after_format
+    until([]() { return player.idle(); }, 60 * 1000);
+    TEST_ASSERT_EQUAL(200, get(URI_STATUS).code);
+    uint32_t sleeps = fake::board.sleeps;
+    until([]() { return false; }, IDLE_HTTP - 500);
+    TEST_ASSERT_EQUAL(sleeps, fake::board.sleeps);
+    until([]() { return false; }, 1000);
+    TEST_ASSERT_GREATER_THAN(sleeps, fake::board.sleeps);
+    TEST_ASSERT_EQUAL(IDLE_SLEEP_WIFI, fake::sleepTimer);
+    // A bell press still plays within the press latency, plus the slice the fake telegram does not wake up from
+    int64_t pressed = nowUs();
+    telegram(GO_PLAYER + Player::GO_BANK, true);
+    TEST_ASSERT_LESS_OR_EQUAL(SOAK_PRESS_LATENCY + IDLE_SLEEP_WIFI / 1000, until([pressed]() { return fake::i2s.started >= pressed; }, 1000));
+    until([]() { return player.idle(); }, 60 * 1000);
+    // Synchronised units stay awake for the beacons
+    player.setSync(true);
+    until([]() { return false; }, IDLE_HTTP);
+    sleeps = fake::board.sleeps;
+    until([]() { return false; }, 5000);
+    TEST_ASSERT_EQUAL(sleeps, fake::board.sleeps);
+    player.setSync(false);
+}
+
+int main()
+{
+    knx.m_params[3] = SOAK_AUTO_OFF / 100;      // Output 1 auto-off timer, 100 ms units
+    fake::flash.mounted = true;
+    setup();
+    while (bootStage != BOOT_NETWORK) step();
+    for (int bank = 1; bank <= SOAK_BANKS; ++bank) upload(bank, bank);
+    while (!player.idle()) step();      // Benchmarks of the uploads
+    stats.uploads = 0;
+    fake::flash.fileWrites.clear();
+    UNITY_BEGIN();
+    RUN_TEST(test_soak);
+    RUN_TEST(test_failed_meta_write_retried);
+    RUN_TEST(test_meta_recreated_after_format);
+    RUN_TEST(test_portal_backoff);
+    RUN_TEST(test_sleep_while_connected);
+    return UNITY_END();
+}
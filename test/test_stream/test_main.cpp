@@ -0,0 +1,294 @@
+// Network stream against a local HTTP stand-in: non-blocking open, failures, and POST bodies
+// decoded as they arrive (raw and multipart).
+#include "../../src/main.cpp"
+#include <unity.h>
+#include <atomic>
+
+// One response per connection, served from its own thread after an optional delay
+struct HttpStandIn
+{
+    HttpStandIn(const std::string& response, int delayMs = 0) : m_delay(delayMs)
+    {
+        fake::Untracked scope;
+        m_response = response;
+        m_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ::bind(m_fd, (sockaddr*)&addr, sizeof(addr));
+        socklen_t length = sizeof(addr);
+        getsockname(m_fd, (sockaddr*)&addr, &length);
+        port = ntohs(addr.sin_port);
+        ::listen(m_fd, 4);
+        m_thread = std::thread([this]() { serve(); });
+    }
+    ~HttpStandIn()
+    {
+        fake::Untracked scope;
+        ::shutdown(m_fd, SHUT_RDWR);
+        ::close(m_fd);
+        m_thread.join();
+    }
+    std::string url(const char* path = "/bell.mp3") const { return "http://127.0.0.1:" + std::to_string(port) + path; }
+
+    uint16_t port = 0;
+    std::string request;
+    std::atomic<bool> served { false };
+private:
+    void serve()
+    {
+        fake::Untracked scope;
+        int client = ::accept(m_fd, nullptr, nullptr);
+        if (client < 0) return;
+        char buffer[1024];
+        ssize_t n;
+        while (request.find("\r\n\r\n") == std::string::npos && (n = ::recv(client, buffer, sizeof(buffer), 0)) > 0) request.append(buffer, n);
+        std::this_thread::sleep_for(std::chrono::milliseconds(m_delay));
+        for (size_t pos = 0; pos < m_response.size(); pos += n) {
+            n = ::send(client, m_response.data() + pos, m_response.size() - pos, MSG_NOSIGNAL);
+            if (n <= 0) break;
+        }
+        ::close(client);
+        served = true;
+    }
+    std::string m_response;
+    int m_delay;
+    int m_fd;
+    std::thread m_thread;
+};
+
+// Test side buffers stay out of the firmware heap accounting
+static std::string audio(size_t size)
+{
+    fake::Untracked scope;
+    std::string body = "ID3";
+    while (body.size() < size) body += (char)(body.size() * 7);
+    return body;
+}
+
+static int64_t realMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Runs the stream loop until done() or the real time limit
+template<typename F> static bool until(AudioFileSourceNetwork& stream, F done, int limitMs = 3000)
+{
+    int64_t start = realMs();
+    while (!done()) {
+        if (realMs() - start > limitMs) return false;
+        stream.loop();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+// Main loop with the virtual clock until the player is idle
+static bool playToEnd(int limitMs = 5000)
+{
+    int64_t start = realMs();
+    do {
+        if (realMs() - start > limitMs) return false;
+        loop();
+        delay(1);
+    } while (!player.idle());
+    return true;
+}
+
+static std::string ok(size_t size)
+{
+    fake::Untracked scope;
+    return "HTTP/1.0 200 OK\r\nContent-Type: audio/mpeg\r\n\r\n" + audio(size);
+}
+
+static fake::Request post(fake::Request::Kind kind, size_t size, bool decodable = true)
+{
+    fake::Untracked scope;
+    fake::Request r;
+    r.method = HTTP_POST;
+    r.uri = URI_STREAM;
+    r.kind = kind;
+    r.body = decodable ? audio(size) : std::string(size, 'x');
+    r.filename = "bell.mp3";
+    return r;
+}
+
+void setUp()
+{
+    fake::i2s.stuck = false;
+    player.abort();
+    playToEnd();
+}
+void tearDown() {}
+
+void test_open_does_not_block()
+{
+    HttpStandIn http(ok(4096), 500);
+    AudioFileSourceNetwork stream;
+    int64_t start = realMs();
+    TEST_ASSERT_TRUE(stream.open(http.url().c_str()));
+    stream.loop();
+    TEST_ASSERT_LESS_THAN(100, realMs() - start);
+    TEST_ASSERT_FALSE(stream.started());
+    TEST_ASSERT_TRUE(until(stream, [&]() { return stream.started(); }));
+    TEST_ASSERT_FALSE(stream.failed());
+}
+
+void test_open_resolves_names_in_background()
+{
+    HttpStandIn http(ok(4096));
+    AudioFileSourceNetwork stream;
+    std::string url = "http://localhost:" + std::to_string(http.port) + "/bell.mp3";
+    TEST_ASSERT_TRUE(stream.open(url.c_str()));
+    TEST_ASSERT_TRUE(until(stream, [&]() { return stream.started() || stream.failed(); }));
+    TEST_ASSERT_FALSE(stream.failed());
+    TEST_ASSERT_TRUE(http.request.find("Host: localhost\r\n") != std::string::npos);
+}
+
+void test_headers_and_body()
+{
+    fake::Untracked scope;
+    std::string body = audio(12000);
+    HttpStandIn http("ICY 200 OK\r\nContent-Type: audio/mpeg; charset=x\r\nContent-Length: 12000\r\n\r\n" + body);
+    AudioFileSourceNetwork stream;
+    TEST_ASSERT_TRUE(stream.open(http.url().c_str()));
+    TEST_ASSERT_TRUE(until(stream, [&]() { return stream.level() == body.size(); }));
+    TEST_ASSERT_EQUAL_STRING("audio/mpeg", stream.mime());
+    TEST_ASSERT_EQUAL(12000, stream.getSize());
+    TEST_ASSERT_TRUE(http.request.rfind("GET /bell.mp3 HTTP/1.0\r\n", 0) == 0);
+    std::string read(body.size(), 0);
+    TEST_ASSERT_EQUAL(body.size(), stream.read(&read[0], read.size()));
+    TEST_ASSERT_TRUE(read == body);
+}
+
+void test_http_error_fails()
+{
+    HttpStandIn http("HTTP/1.0 404 Not Found\r\n\r\n");
+    AudioFileSourceNetwork stream;
+    TEST_ASSERT_TRUE(stream.open(http.url().c_str()));
+    TEST_ASSERT_TRUE(until(stream, [&]() { return stream.failed(); }));
+}
+
+void test_refused_connection_fails()
+{
+    uint16_t port;
+    {
+        HttpStandIn closed("");
+        port = closed.port;
+        WiFiClient c;
+        c.connect(IPAddress(127, 0, 0, 1), port);   // Lets the stand-in thread end
+    }
+    AudioFileSourceNetwork stream;
+    std::string url = "http://127.0.0.1:" + std::to_string(port) + "/";
+    TEST_ASSERT_TRUE(stream.open(url.c_str()));
+    TEST_ASSERT_TRUE(until(stream, [&]() { return stream.failed(); }));
+}
+
+void test_unknown_host_fails()
+{
+    AudioFileSourceNetwork stream;
+    TEST_ASSERT_TRUE(stream.open("http://doorbell.invalid/bell.mp3"));
+    TEST_ASSERT_TRUE(until(stream, [&]() { return stream.failed(); }, 10000));
+}
+
+void test_bad_url_leaves_no_stream()
+{
+    size_t used = fake::heap.used;
+    TEST_ASSERT_FALSE(player.playStream("ftp://host/bell.mp3"));
+    TEST_ASSERT_NULL(player.stream());
+    TEST_ASSERT_FALSE(player.playStream("http://:80/"));
+    TEST_ASSERT_NULL(player.stream());
+    TEST_ASSERT_EQUAL(used, fake::heap.used);
+    TEST_ASSERT_TRUE(player.idle());
+}
+
+void test_url_stream_plays()
+{
+    HttpStandIn http(ok(30000));
+    uint32_t bytes = fake::decoders.bytes;
+    TEST_ASSERT_TRUE(player.playStream(http.url().c_str()));
+    TEST_ASSERT_TRUE(playToEnd());
+    TEST_ASSERT_EQUAL(30000, fake::decoders.bytes - bytes);
+    TEST_ASSERT_NULL(player.stream());
+}
+
+void test_raw_post_streams()
+{
+    uint32_t bytes = fake::decoders.bytes;
+    fake::Response response = server.request(post(fake::Request::RAW, 100000));
+    TEST_ASSERT_EQUAL(200, response.code);
+    TEST_ASSERT_GREATER_OR_EQUAL(100000 - STREAM_BUFFER_SIZE, fake::decoders.bytes - bytes);
+    TEST_ASSERT_TRUE(playToEnd());
+    TEST_ASSERT_EQUAL(100000, fake::decoders.bytes - bytes);
+}
+
+void test_multipart_post_streams()
+{
+    uint32_t bytes = fake::decoders.bytes;
+    fake::Response response = server.request(post(fake::Request::MULTIPART, 50000));
+    TEST_ASSERT_EQUAL(200, response.code);
+    TEST_ASSERT_TRUE(playToEnd());
+    TEST_ASSERT_EQUAL(50000, fake::decoders.bytes - bytes);
+}
+
+void test_post_not_decodable_fails()
+{
+    int64_t start = realMs();
+    fake::Response response = server.request(post(fake::Request::RAW, 100000, false));
+    TEST_ASSERT_EQUAL(503, response.code);
+    TEST_ASSERT_LESS_THAN(1000, realMs() - start);
+    TEST_ASSERT_NULL(player.stream());
+}
+
+void test_post_stalled_output_fails()
+{
+    fake::i2s.stuck = true;
+    uint32_t time = millis();
+    fake::Response response = server.request(post(fake::Request::RAW, 100000));
+    TEST_ASSERT_EQUAL(503, response.code);
+    TEST_ASSERT_INT_WITHIN(500, STREAM_STALL, millis() - time);
+    fake::i2s.stuck = false;
+    TEST_ASSERT_TRUE(playToEnd());
+}
+
+void test_save_checks_length_first()
+{
+    player.setStreamUrl("http://127.0.0.1/saved.mp3");
+    fake::Request r;
+    r.uri = URI_STREAM;
+    r.args = { { "url", "http://127.0.0.1/" + std::string(STREAM_MAXURLSIZE, 'a') }, { "save", "1" } };
+    TEST_ASSERT_EQUAL(400, server.request(r).code);
+    TEST_ASSERT_EQUAL_STRING("http://127.0.0.1/saved.mp3", player.streamUrl().c_str());
+
+    HttpStandIn http(ok(9000));
+    r.args = { { "url", http.url() }, { "save", "1" } };
+    TEST_ASSERT_EQUAL(200, server.request(r).code);
+    TEST_ASSERT_EQUAL_STRING(http.url().c_str(), player.streamUrl().c_str());
+    TEST_ASSERT_TRUE(playToEnd());
+}
+
+int main()
+{
+    setup();
+    while (bootStage != BOOT_NETWORK) {     // Web server handlers registered
+        loop();
+        delay(10);
+    }
+    UNITY_BEGIN();
+    RUN_TEST(test_open_does_not_block);
+    RUN_TEST(test_open_resolves_names_in_background);
+    RUN_TEST(test_headers_and_body);
+    RUN_TEST(test_http_error_fails);
+    RUN_TEST(test_refused_connection_fails);
+    RUN_TEST(test_unknown_host_fails);
+    RUN_TEST(test_bad_url_leaves_no_stream);
+    RUN_TEST(test_url_stream_plays);
+    RUN_TEST(test_raw_post_streams);
+    RUN_TEST(test_multipart_post_streams);
+    RUN_TEST(test_post_not_decodable_fails);
+    RUN_TEST(test_post_stalled_output_fails);
+    RUN_TEST(test_save_checks_length_first);
+    return UNITY_END();
+}
@@ -0,0 +1,179 @@
+// Synchronised start across units: one process per unit on this host, each with its own clock offset and chip id,
+// joined on the multicast group through loopback. Triggers reach the units with different latencies, the first
+// sample must still leave every unit at the same instant.
+#include "../../src/main.cpp"
+#include <unity.h>
+#include <sys/wait.h>
+
+#define UNITS       3
+#define BANK        1
+#define TOLERANCE   5000        // us between first samples, a few loop iterations
+#define DRIFT_PPM   250         // DAC clock error of the skewed unit, within what one sample per SYNC_CHECK corrects
+
+struct Result
+{
+    int64_t started;            // First sample, host time
+    uint32_t master;
+    int32_t error;              // Drift against the shared clock over the last second of the play, median
+};
+
+// One batch of boards: same OUI and MAC[3], only the NIC specific bytes differ. The first unit has the lowest id.
+static uint64_t mac(int index)
+{
+    const uint8_t bytes[6] = { 0x24, 0x0A, 0xC4, 0x12, (uint8_t)(0xA0 - index), (uint8_t)(0x40 + index) };
+    uint64_t value = 0;
+    for (int i = 5; i >= 0; --i) value = value << 8 | bytes[i];     // getEfuseMac() holds MAC[0] in the low byte
+    return value;
+}
+
+// Host time shared by all units: the local clock minus its offset
+static int64_t hostUs() { return fake::clock.now() - fake::clock.offsetUs; }
+
+// The median of the drift samples taken meanwhile: a loop stalled by the host shows as a single spike
+static int32_t run(int64_t untilUs)
+{
+    std::vector<int32_t> errors;
+    int64_t next = hostUs();
+    while (hostUs() < untilUs) {
+        loop();
+        delayMicroseconds(200);     // Keeps the DMA topped up like the target loop does
+        if (hostUs() >= next) {
+            fake::Untracked scope;
+            errors.push_back(player.syncError());
+            next += SYNC_CHECK * 1000LL;
+        }
+    }
+    if (errors.empty()) return 0;
+    fake::Untracked scope;
+    std::nth_element(errors.begin(), errors.begin() + errors.size() / 2, errors.end());
+    return errors[errors.size() / 2];
+}
+
+// One unit: boots, joins the sync group, plays the bank when its trigger time comes and reports the first sample
+static void unit(int index, int64_t triggerUs, int32_t ppm, int64_t playUs, int fd)
+{
+    fake::clock.offsetUs = (index + 1) * 37000 + index * 1111;   // Free running clocks, not aligned
+    fake::board.efuseMac = mac(index);
+    fake::i2s.ppm = ppm;
+    fake::flash.mounted = true;
+    {
+        fake::Untracked scope;
+        std::string body = "ID3";
+        while (body.size() < (size_t)(22050 * (playUs / 1000000 + 2))) body += (char)(body.size() * 7);
+        fake::flash.files[Player::pathFromChannel(BANK)].assign(body.begin(), body.end());
+    }
+    setup();
+    player.setChannelName(BANK, "bell.mp3", player.autodetect(BANK));
+    player.setSync(true);
+    while (bootStage != BOOT_NETWORK) {
+        loop();
+        delay(1);
+    }
+    run(triggerUs);
+    player.play(BANK);
+    run(triggerUs + 2 * SYNC_DELAY * 1000LL + MAX(playUs - 1000000, 0LL));
+    int32_t error = run(triggerUs + 2 * SYNC_DELAY * 1000LL + playUs);
+    Result result = { fake::i2s.started - fake::clock.offsetUs, syncClock.masterId(), error };
+    _exit(write(fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+}
+
+// Forks the units with their trigger delays after a common instant far enough for boot and a few beacons
+static std::vector<Result> play(const std::vector<int64_t>& latencyUs, const std::vector<int32_t>& ppm = {}, int64_t playUs = 0)
+{
+    int64_t trigger = hostUs() + NETWORK_START_DELAY * 1000LL + 4 * SYNC_BEACON * 1000LL;
+    std::vector<std::pair<pid_t, int>> units;
+    for (size_t i = 0; i < latencyUs.size(); ++i) {
+        int fds[2];
+        TEST_ASSERT_EQUAL(0, pipe(fds));
+        fflush(stdout);
+        pid_t pid = fork();
+        TEST_ASSERT_NOT_EQUAL(-1, pid);
+        if (pid == 0) {
+            close(fds[0]);
+            unit(i, trigger + latencyUs[i], i < ppm.size() ? ppm[i] : 0, playUs, fds[1]);
+        }
+        close(fds[1]);
+        units.push_back({ pid, fds[0] });
+    }
+    std::vector<Result> results;
+    for (auto& u : units) {
+        Result r = {};
+        ssize_t n = read(u.second, &r, sizeof(r));
+        close(u.second);
+        int status = 0;
+        waitpid(u.first, &status, 0);
+        TEST_ASSERT_EQUAL(sizeof(r), n);
+        TEST_ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        results.push_back(r);
+    }
+    for (auto& r : results) {
+        TEST_ASSERT_EQUAL_UINT32((uint32_t)(mac(0) >> 24), r.master);
+        TEST_ASSERT_NOT_EQUAL(0, r.started);
+    }
+    return results;
+}
+
+static int64_t spread(const std::vector<Result>& results)
+{
+    int64_t first = INT64_MAX, last = INT64_MIN;
+    for (auto& r : results) {
+        first = MIN(first, r.started);
+        last = MAX(last, r.started);
+    }
+    return last - first;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_simultaneous_triggers()
+{
+    std::vector<Result> results = play({ 0, 0, 0 });
+    TEST_ASSERT_INT_WITHIN(TOLERANCE, 0, (int)spread(results));
+}
+
+// A later unit gets the first announcement before its own trigger and joins that start
+void test_staggered_triggers()
+{
+    std::vector<Result> results = play({ 0, 40000, 90000 });
+    TEST_ASSERT_INT_WITHIN(TOLERANCE, 0, (int)spread(results));
+}
+
+// The master is not the first triggered: the offset estimate carries the start across clocks
+void test_slave_triggered_first()
+{
+    std::vector<Result> results = play({ 120000, 60000, 0 });
+    TEST_ASSERT_INT_WITHIN(TOLERANCE, 0, (int)spread(results));
+}
+
+// Trigger after the announced start has passed: no unit waits for an instant that is gone
+void test_late_trigger_starts_alone()
+{
+    std::vector<Result> results = play({ 0, SYNC_DELAY * 1000LL + 100000 });
+    int64_t late = results[1].started - results[0].started;
+    TEST_ASSERT_INT_WITHIN(20000, SYNC_DELAY * 1000 + 100000, (int)late);
+}
+
+// A DAC running fast drains more samples than the shared clock allows: repeated samples hold it to the tolerance
+void test_drift_corrected()
+{
+    const int64_t playUs = 6 * 1000000LL;
+    std::vector<Result> results = play({ 0, 0 }, { 0, DRIFT_PPM }, playUs);
+    TEST_ASSERT_INT_WITHIN(TOLERANCE, 0, (int)spread(results));
+    TEST_ASSERT_INT_WITHIN(SYNC_TOLERANCE, 0, results[0].error);
+    // Uncorrected the skewed unit would be DRIFT_PPM * (playUs - SYNC_SETTLE) = 1250 us ahead by the end
+    TEST_ASSERT_INT_WITHIN(SYNC_TOLERANCE / 2, SYNC_TOLERANCE, results[1].error);
+}
+
+int main()
+{
+    fake::clock.realtime = true;
+    hostUs();       // Fixes the clock origin before the units fork
+    UNITY_BEGIN();
+    RUN_TEST(test_simultaneous_triggers);
+    RUN_TEST(test_staggered_triggers);
+    RUN_TEST(test_slave_triggered_first);
+    RUN_TEST(test_late_trigger_starts_alone);
+    RUN_TEST(test_drift_corrected);
+    return UNITY_END();
+}
@@ -0,0 +1,188 @@
+// Firmware upgrade: gzip images inflated as they arrive through every optional header field, the trailer's CRC-32
+// and size and the required SHA-256 checked before the partition swap, and a new image left on trial with the
+// bootloader until it has run OTA_HEALTH_TIME.
+#include "../../src/main.cpp"
+#include <unity.h>
+#include <zlib.h>
+
+#define IMAGE_SIZE  ( 300 * 1024 )
+
+// Code-like content: runs, repeats and noise, so deflate emits every block type and distances across the window
+static std::string image()
+{
+    fake::Untracked scope;
+    std::string body(1, (char)0xE9);        // ESP32 image magic
+    uint32_t seed = 1;
+    while (body.size() < IMAGE_SIZE) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t kind = seed >> 29;
+        if (kind == 0) body.append(1 + (seed >> 8) % 64, (char)(seed >> 16));
+        else if (kind <= 2 && body.size() > 40000) body += body.substr(body.size() - 1 - (seed >> 8) % 32000, 8 + (seed >> 4) % 200);
+        else for (int i = 0; i < 16; ++i) body += (char)((seed = seed * 1103515245 + 12345) >> 24);
+    }
+    body.resize(IMAGE_SIZE);
+    return body;
+}
+
+// gzip member with the optional header fields set, spanning several upload chunks
+static std::string gzip(const std::string& data, bool fields = true)
+{
+    fake::Untracked scope;
+    static std::string extra, name(3000, 'n'), comment = "firmware";
+    for (int i = (int)extra.size(); i < 2000; ++i) extra += (char)(i * 7);      // Binary, zeros included
+    gz_header header = {};
+    if (fields) {
+        header.extra = (Bytef*)extra.data();
+        header.extra_len = extra.size();
+        header.name = (Bytef*)name.c_str();
+        header.comment = (Bytef*)comment.c_str();
+        header.hcrc = 1;
+    }
+    z_stream z = {};
+    TEST_ASSERT_EQUAL(Z_OK, deflateInit2(&z, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY));
+    TEST_ASSERT_EQUAL(Z_OK, deflateSetHeader(&z, &header));
+    std::string out(deflateBound(&z, data.size()) + 8192, 0);
+    z.next_in = (Bytef*)data.data();
+    z.avail_in = data.size();
+    z.next_out = (Bytef*)&out[0];
+    z.avail_out = out.size();
+    TEST_ASSERT_EQUAL(Z_STREAM_END, deflate(&z, Z_FINISH));
+    out.resize(z.total_out);
+    deflateEnd(&z);
+    return out;
+}
+
+static std::string sha256(const std::string& data)
+{
+    fake::Untracked scope;
+    mbedtls_sha256_context c;
+    uint8_t digest[32];
+    mbedtls_sha256_init(&c);
+    mbedtls_sha256_starts_ret(&c, 0);
+    mbedtls_sha256_update_ret(&c, (const uint8_t*)data.data(), data.size());
+    mbedtls_sha256_finish_ret(&c, digest);
+    char hex[65];
+    for (int i = 0; i < 32; ++i) sprintf(hex + 2 * i, "%02x", digest[i]);
+    return hex;
+}
+
+// The page shown after the upload: "succeeded" or "failed: <reason>"
+static std::string upload(const std::string& body, const std::string& hash)
+{
+    fake::Request r;
+    {
+        fake::Untracked scope;
+        r.method = HTTP_POST;
+        r.uri = URI_UPDATE;
+        if (!hash.empty()) r.args = { { "sha256", hash } };
+        r.kind = fake::Request::MULTIPART;
+        r.filename = "firmware.bin.gz";
+        r.body = body;
+    }
+    fake::Response response = server.request(r);
+    TEST_ASSERT_EQUAL(200, response.code);
+    rebootRequested = 0;
+    return response.body;
+}
+
+static bool succeeded(const std::string& page) { return page.find("Update succeeded") != std::string::npos; }
+static bool failed(const std::string& page, const char* reason) { return page.find(std::string("failed: ") + reason) != std::string::npos; }
+
+void setUp() {}
+void tearDown() {}
+
+void test_sha256_reference()
+{
+    TEST_ASSERT_EQUAL_STRING("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", sha256("abc").c_str());
+}
+
+// Started by the bootloader on trial: confirmed once it has run long enough, a reset before that rolls back
+void test_new_image_confirmed_after_health_time()
+{
+    TEST_ASSERT_TRUE(upgrade.pending());
+    TEST_ASSERT_EQUAL(0, fake::ota.confirmed);
+    while (millis() < OTA_HEALTH_TIME - 1000) {
+        loop();
+        delay(100);
+    }
+    TEST_ASSERT_EQUAL(0, fake::ota.confirmed);
+    TEST_ASSERT_EQUAL(ESP_OTA_IMG_PENDING_VERIFY, fake::ota.state);
+    while (millis() < OTA_HEALTH_TIME + 1000) {
+        loop();
+        delay(100);
+    }
+    TEST_ASSERT_EQUAL(1, fake::ota.confirmed);
+    TEST_ASSERT_EQUAL(ESP_OTA_IMG_VALID, fake::ota.state);
+    TEST_ASSERT_FALSE(upgrade.pending());
+}
+
+void test_gzip_image_inflated()
+{
+    std::string firmware = image();
+    uint32_t ends = fake::update.ends;
+    std::string page = upload(gzip(firmware), sha256(firmware));
+    TEST_ASSERT_TRUE(succeeded(page));
+    TEST_ASSERT_EQUAL(ends + 1, fake::update.ends);
+    TEST_ASSERT_EQUAL(firmware.size(), fake::update.image.size());
+    TEST_ASSERT_TRUE(firmware == fake::update.image);
+    TEST_ASSERT_TRUE(page.find(sha256(firmware)) != std::string::npos);
+}
+
+void test_plain_gzip_and_raw_images()
+{
+    std::string firmware = image();
+    TEST_ASSERT_TRUE(succeeded(upload(gzip(firmware, false), sha256(firmware))));
+    TEST_ASSERT_TRUE(firmware == fake::update.image);
+    TEST_ASSERT_TRUE(succeeded(upload(firmware, sha256(firmware))));
+    TEST_ASSERT_TRUE(firmware == fake::update.image);
+}
+
+void test_sha256_required()
+{
+    std::string firmware = image();
+    uint32_t begins = fake::update.begins, ends = fake::update.ends;
+    TEST_ASSERT_TRUE(failed(upload(firmware, ""), "SHA-256 required"));
+    TEST_ASSERT_TRUE(failed(upload(firmware, std::string(64, 'g')), "SHA-256 required"));
+    TEST_ASSERT_EQUAL(begins, fake::update.begins);
+    std::string wrong = sha256(firmware);
+    wrong[0] = wrong[0] == '0' ? '1' : '0';
+    TEST_ASSERT_TRUE(failed(upload(firmware, wrong), "SHA-256 mismatch"));
+    TEST_ASSERT_EQUAL(ends, fake::update.ends);
+}
+
+// The SHA-256 given matches what was inflated, the trailer does not: the gzip file itself is damaged
+void test_gzip_trailer_checked()
+{
+    std::string firmware = image(), hash = sha256(firmware), compressed = gzip(firmware);
+    uint32_t ends = fake::update.ends;
+    std::string bad = compressed;
+    bad[bad.size() - 8] ^= 1;
+    TEST_ASSERT_TRUE(failed(upload(bad, hash), "gzip CRC mismatch"));
+    bad = compressed;
+    bad[bad.size() - 1] ^= 1;
+    TEST_ASSERT_TRUE(failed(upload(bad, hash), "gzip size mismatch"));
+    TEST_ASSERT_TRUE(failed(upload(compressed.substr(0, compressed.size() - 3), hash), "truncated image"));
+    bad = compressed;
+    bad[bad.size() / 2] ^= 0x55;
+    TEST_ASSERT_FALSE(succeeded(upload(bad, hash)));
+    TEST_ASSERT_EQUAL(ends, fake::update.ends);
+}
+
+int main()
+{
+    fake::ota.state = ESP_OTA_IMG_PENDING_VERIFY;      // First boot after an upgrade
+    fake::flash.mounted = true;
+    setup();
+    while (bootStage != BOOT_NETWORK) {
+        loop();
+        delay(10);
+    }
+    UNITY_BEGIN();
+    RUN_TEST(test_sha256_reference);
+    RUN_TEST(test_new_image_confirmed_after_health_time);
+    RUN_TEST(test_gzip_image_inflated);
+    RUN_TEST(test_plain_gzip_and_raw_images);
+    RUN_TEST(test_sha256_required);
+    RUN_TEST(test_gzip_trailer_checked);
+    return UNITY_END();
+}